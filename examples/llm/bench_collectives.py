@@ -0,0 +1,302 @@
+###############################################################################
+# Copyright (c) 2022 Intel Corporation - All rights reserved.                 #
+#                                                                             #
+# For information on the license, see the LICENSE file.                       #
+# Further information: https://github.com/libxsmm/tpp-pytorch-extension/      #
+# SPDX-License-Identifier: BSD-3-Clause                                       #
+###############################################################################
+
+import argparse
+import csv
+import json
+import os
+import time
+
+import numpy as np
+import torch
+import torch.distributed as dist
+
+
+def comma_separated_ints(value):
+    try:
+        return [int(v) for v in value.split(",")]
+    except ValueError:
+        raise argparse.ArgumentTypeError(
+            "%s is not a valid comma separated list of ints" % value
+        )
+
+
+def comma_separated_strs(value):
+    return value.split(",")
+
+
+parser = argparse.ArgumentParser(
+    "Collective benchmark for SHM and c10d backends (single node only)"
+)
+parser.add_argument(
+    "--nprocs",
+    default=2,
+    type=int,
+    help="processes to spawn when not started by mpirun / torchrun",
+)
+parser.add_argument("--dist-backend", default="gloo", type=str)
+parser.add_argument(
+    "--ops",
+    default="allreduce,allreduce_async,allgather,reduce_scatter,broadcast",
+    type=comma_separated_strs,
+)
+parser.add_argument(
+    "--impls",
+    default="shm,c10d",
+    type=comma_separated_strs,
+    help="shm: tpp collectives, c10d: torch.distributed on the same group",
+)
+parser.add_argument(
+    "--dtypes", default="float32,bfloat16,float16", type=comma_separated_strs
+)
+parser.add_argument(
+    "--sizes",
+    default=None,
+    type=comma_separated_ints,
+    help="message sizes in bytes, default 1KB to 1GB in steps of 4x",
+)
+parser.add_argument(
+    "--ranks",
+    default=None,
+    type=comma_separated_ints,
+    help="group sizes to sweep, default all ranks",
+)
+parser.add_argument(
+    "--threads",
+    default=None,
+    type=comma_separated_ints,
+    help="OpenMP thread counts to sweep, default current",
+)
+parser.add_argument("--num-iter", default=100, type=int, help="max iterations")
+parser.add_argument("--num-warmup", default=5, type=int, help="num warmup")
+parser.add_argument(
+    "--max-bytes-per-point",
+    default=8 * 1024**3,
+    type=int,
+    help="cap on iterations x size for each point",
+)
+parser.add_argument("--check", action="store_true", help="verify results")
+parser.add_argument("--csv", default=None, type=str, help="write results as CSV")
+parser.add_argument("--json", default=None, type=str, help="write results as JSON")
+
+DTYPES = {
+    "float32": torch.float32,
+    "bfloat16": torch.bfloat16,
+    "float16": torch.float16,
+}
+
+
+# Bus bandwidth factors as in nccl-tests, for group size n
+def bus_factor(op, n):
+    if op.startswith("allreduce"):
+        return 2.0 * (n - 1) / n
+    if op in ("allgather", "reduce_scatter"):
+        return (n - 1) / n
+    return 1.0
+
+
+class Bench:
+    def __init__(self, args, rank, size):
+        self.args = args
+        self.rank = rank
+        self.size = size
+        self.results = []
+
+    def make_op(self, op, impl, t, n, group):
+        # Returns (run, check) closures for a message of t.numel() elements
+        from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
+
+        chunk = t.numel() // n
+        grank = dist.get_rank(group)
+        if op == "allreduce":
+            if impl == "shm":
+                run = lambda: fused_llm_cpp.allreduce(t)
+            else:
+                run = lambda: dist.all_reduce(t, group=group)
+            check = lambda: torch.allclose(t.float(), torch.full_like(t, n).float())
+        elif op == "allreduce_async":
+            if impl == "shm":
+                run = lambda: fused_llm_cpp.allreduce_async(t).wait()
+            else:
+                run = lambda: dist.all_reduce(t, group=group, async_op=True).wait()
+            check = lambda: torch.allclose(t.float(), torch.full_like(t, n).float())
+        elif op == "allgather":
+            # Chunk i of the result comes from group rank i
+            t_in = t[:chunk].fill_(grank)
+            expect = torch.arange(n, dtype=t.dtype).repeat_interleave(chunk)
+            if impl == "shm":
+                out = [None]
+
+                def run():
+                    out[0] = fused_llm_cpp.allgather(t_in.view(1, -1), [chunk] * n)
+
+            else:
+                out = [torch.empty_like(t_in) for _ in range(n)]
+                run = lambda: dist.all_gather(out, t_in, group=group)
+            check = lambda: torch.equal(torch.cat(out, -1).view(-1), expect)
+        elif op == "reduce_scatter":
+            # Inputs are all ones
+            t_in = t[: chunk * n]
+            if impl == "shm":
+                out = [None]
+
+                def run():
+                    out[0] = fused_llm_cpp.reduce_scatter(t_in)
+
+            else:
+                out = [torch.empty(chunk, dtype=t.dtype)]
+                outs = list(t_in.chunk(n))
+                run = lambda: dist.reduce_scatter(out[0], outs, group=group)
+            check = lambda: bool((out[0] == n).all())
+        elif op == "broadcast":
+            # Groups are ranks 0..n-1, so group rank 0 is global rank 0
+            if impl == "shm":
+                run = lambda: fused_llm_cpp.broadcast(t, 0)
+            else:
+                run = lambda: dist.broadcast(t, 0, group=group)
+            check = lambda: bool((t == 1).all())
+        else:
+            raise ValueError(f"Unknown op {op}")
+        return run, check
+
+    def run_point(self, op, impl, dtype, nbytes, n, nthreads, group):
+        args = self.args
+        elem_size = torch.tensor([], dtype=dtype).element_size()
+        numel = max(n, nbytes // elem_size // n * n)
+        iters = max(5, min(args.num_iter, args.max_bytes_per_point // nbytes))
+        t = torch.ones(numel, dtype=dtype)
+        run, check = self.make_op(op, impl, t, n, group)
+        # Allreduces scale t by n, refill so that bf16/fp16 don't overflow
+        refill = op.startswith("allreduce")
+        for _ in range(args.num_warmup):
+            if refill:
+                t.fill_(1)
+            run()
+        if args.check:
+            if refill or op == "broadcast":
+                # Broadcast has to spread the ones of group rank 0
+                root = dist.get_rank(group) == 0
+                t.fill_(1 if root or op != "broadcast" else 0)
+            run()
+            ok = check()
+            if not ok:
+                print(f"Rank {self.rank}: {op} {impl} {dtype} {nbytes} FAILED")
+        times = torch.zeros(iters, dtype=torch.float64)
+        for i in range(iters):
+            if refill:
+                t.fill_(1)
+            dist.barrier(group=group)
+            t0 = time.perf_counter()
+            run()
+            times[i] = time.perf_counter() - t0
+        # The slowest rank defines each iteration
+        dist.all_reduce(times, op=dist.ReduceOp.MAX, group=group)
+        us = times.numpy() * 1e6
+        msg_bytes = numel * elem_size
+        mean_s = us.mean() * 1e-6
+        algbw = msg_bytes / mean_s / 1e9
+        return {
+            "op": op,
+            "impl": impl,
+            "dtype": str(dtype).replace("torch.", ""),
+            "bytes": msg_bytes,
+            "ranks": n,
+            "threads": nthreads,
+            "iters": iters,
+            "mean_us": float(us.mean()),
+            "p50_us": float(np.percentile(us, 50)),
+            "p90_us": float(np.percentile(us, 90)),
+            "p99_us": float(np.percentile(us, 99)),
+            "min_us": float(us.min()),
+            "algbw_GBps": float(algbw),
+            "busbw_GBps": float(algbw * bus_factor(op, n)),
+        }
+
+    def run(self):
+        from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
+
+        args = self.args
+        sizes = args.sizes or [1024 * 4**i for i in range(11)]
+        ranks = args.ranks or [self.size]
+        threads = args.threads or [torch.get_num_threads()]
+        for n in ranks:
+            assert 1 < n <= self.size, f"Bad group size {n}"
+            # new_group() has to be called by all ranks
+            group = dist.new_group(list(range(n))) if n < self.size else None
+            if self.rank >= n:
+                continue
+            pg = group if group is not None else dist.group.WORLD
+            # All ranks of the group are local, let set_pg enable SHM
+            os.environ["MPI_LOCALNRANKS"] = str(n)
+            fused_llm_cpp.set_pg(pg)
+            for nthreads in threads:
+                torch.set_num_threads(nthreads)
+                for op in args.ops:
+                    for impl in args.impls:
+                        for dt in args.dtypes:
+                            for nbytes in sizes:
+                                r = self.run_point(
+                                    op, impl, DTYPES[dt], nbytes, n, nthreads, group
+                                )
+                                self.report(r)
+        dist.barrier()
+
+    def report(self, r):
+        if self.rank != 0:
+            return
+        self.results.append(r)
+        print(
+            f"{r['op']:16s} {r['impl']:5s} {r['dtype']:9s} ranks: {r['ranks']:3d} "
+            f"threads: {r['threads']:3d} bytes: {r['bytes']:11d} "
+            f"p50: {r['p50_us']:11.2f} us  p99: {r['p99_us']:11.2f} us  "
+            f"busbw: {r['busbw_GBps']:8.2f} GB/s"
+        )
+
+    def save(self):
+        if self.rank != 0 or not self.results:
+            return
+        if self.args.csv:
+            with open(self.args.csv, "w", newline="") as f:
+                w = csv.DictWriter(f, fieldnames=list(self.results[0].keys()))
+                w.writeheader()
+                w.writerows(self.results)
+        if self.args.json:
+            with open(self.args.json, "w") as f:
+                json.dump(self.results, f, indent=2)
+
+
+def main(rank, size, args):
+    dist.init_process_group(backend=args.dist_backend, rank=rank, world_size=size)
+    bench = Bench(args, rank, size)
+    bench.run()
+    bench.save()
+    dist.destroy_process_group()
+
+
+def spawn_main(rank, size, args):
+    os.environ["RANK"] = str(rank)
+    os.environ["WORLD_SIZE"] = str(size)
+    main(rank, size, args)
+
+
+if __name__ == "__main__":
+    args = parser.parse_args()
+    if int(os.environ.get("PMI_SIZE", "0")) > 1:
+        # mpirun on one node
+        os.environ["RANK"] = os.environ.get("PMI_RANK", "0")
+        os.environ["WORLD_SIZE"] = os.environ["PMI_SIZE"]
+    if "WORLD_SIZE" in os.environ:
+        os.environ.setdefault("MASTER_ADDR", "127.0.0.1")
+        os.environ.setdefault("MASTER_PORT", "29500")
+        main(int(os.environ["RANK"]), int(os.environ["WORLD_SIZE"]), args)
+    else:
+        os.environ["MASTER_ADDR"] = "127.0.0.1"
+        os.environ.setdefault("MASTER_PORT", "29500")
+        torch.multiprocessing.spawn(
+            spawn_main, args=(args.nprocs, args), nprocs=args.nprocs
+        )
@@ -0,0 +1,476 @@
+###############################################################################
+# Copyright (c) 2022 Intel Corporation - All rights reserved.                 #
+#                                                                             #
+# For information on the license, see the LICENSE file.                       #
+# Further information: https://github.com/libxsmm/tpp-pytorch-extension/      #
+# SPDX-License-Identifier: BSD-3-Clause                                       #
+###############################################################################
+
+# Functional checks of the fused LLM blocks against eager transformers models
+# with small random weights. Each check runs in its own process: the blocks
+# read their knobs (KV_WINDOW_SIZE, USE_INT8_GEMM, ...) from the environment
+# when the extension loads, and importing the fused modules patches the
+# transformers model classes, so references are computed before that.
+
+import argparse
+import copy
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+import torch
+import transformers
+
+parser = argparse.ArgumentParser("Fused LLM block reference checks", add_help=False)
+parser.add_argument("--check", default=None, type=str, help="run only this check")
+args = parser.parse_args()
+
+CHECKS = {}
+
+
+def register(name, **env):
+    def wrap(fn):
+        CHECKS[name] = (fn, {k: str(v) for k, v in env.items()})
+        return fn
+
+    return wrap
+
+
+def check(name, ok):
+    print(f"{name:40s} {'PASSED' if ok else 'FAILED'}")
+    return ok
+
+
+def close(ref, opt, tol=1e-3):
+    # Max error relative to the largest reference value
+    err = ((ref - opt).abs().max() / ref.abs().max()).item()
+    if err > tol:
+        print(f"  max relative error {err:.3g} > {tol:.3g}")
+    return err <= tol
+
+
+def llama_config(**kwargs):
+    cfg = dict(
+        vocab_size=512,
+        hidden_size=256,
+        intermediate_size=512,
+        num_hidden_layers=2,
+        num_attention_heads=4,
+        num_key_value_heads=4,
+        max_position_embeddings=512,
+        attn_implementation="eager",
+    )
+    cfg.update(kwargs)
+    return transformers.LlamaConfig(**cfg)
+
+
+def tiny_model(cls, config):
+    torch.manual_seed(0)
+    return cls(config).eval()
+
+
+def step_logits(model, ids, prompt_len, past=None, start=0, **kwargs):
+    """Returns the logits of the last prompt token and of each following
+    token of ids [B, L], fed one at a time through the kv cache, and the
+    final cache. A given past already holds ids[:, :start]."""
+    B, L = ids.shape
+    out = []
+    for end in [prompt_len] + list(range(prompt_len + 1, L + 1)):
+        res = model(
+            input_ids=ids[:, start:end],
+            attention_mask=torch.ones([B, end], dtype=torch.long),
+            past_key_values=past,
+            use_cache=True,
+            return_dict=True,
+            **kwargs,
+        )
+        out.append(res.logits[:, -1].float())
+        past = res.past_key_values
+        start = end
+    return torch.stack(out, 1), past
+
+
+@register("kv_eviction", KV_WINDOW_SIZE=32, KV_SINK_TOKENS=4, KV_EVICT_CHUNK=8)
+def check_kv_eviction():
+    sink, window, chunk = 4, 32, 8
+    model = tiny_model(
+        transformers.LlamaForCausalLM, llama_config(num_hidden_layers=1)
+    )
+    torch.manual_seed(1)
+    B, P, L = 2, 16, 96
+    ids = torch.randint(512, [B, L])
+
+    # With a single layer the cached K/V of a token only depend on the token
+    # and its rotary position, so a step after evictions matches a full
+    # forward of the sink and retained tokens at contiguous positions
+    refs = []
+    S, E = P, 0
+    for t in range(P - 1, L):
+        if t >= P:
+            S += 1
+        kept = ids[:, : t + 1]
+        if E > 0:
+            kept = torch.cat([ids[:, :sink], ids[:, sink + E : t + 1]], 1)
+        refs.append(model(kept).logits[:, -1])
+        if t >= P and S >= sink + window + chunk:
+            E += S - sink - window
+            S = sink + window
+    ref = torch.stack(refs, 1)
+
+    from tpp_pytorch_extension.llm.fused_llama_infer import OptimizeModelForLlama
+
+    OptimizeModelForLlama(model, torch.float32)
+    opt, past = step_logits(model, ids, P)
+    ok = check("kv_eviction logits", close(ref, opt))
+    evicted = int(past[0][6]) if len(past[0]) > 6 else 0
+    return check("kv_eviction evicted tokens", evicted == E) and ok
+
+
+@register("prefix_cache")
+def check_prefix_cache():
+    model = tiny_model(transformers.LlamaForCausalLM, llama_config())
+    torch.manual_seed(1)
+    B, A, P, L = 2, 24, 40, 48
+    ids = torch.randint(512, [B, L])
+    ref = model(ids).logits
+
+    from tpp_pytorch_extension.llm.fused_llama_infer import OptimizeModelForLlama
+    from tpp_pytorch_extension.llm.llm_common import (
+        PrefixKVCache,
+        load_kv_cache,
+        save_kv_cache,
+    )
+
+    OptimizeModelForLlama(model, torch.float32)
+    _, past = step_logits(model, ids[:, :A], A)
+    cache = PrefixKVCache()
+    cache.put(ids[:, :A], past)
+    tmpdir = tempfile.TemporaryDirectory()
+    path = os.path.join(tmpdir.name, "prefix.kvc")
+    save_kv_cache(past, path)
+
+    # Prefill of the remaining prompt on top of the restored prefix, then
+    # decode
+    n, past = cache.lookup(ids[:, :P])
+    ok = check("prefix_cache lookup", n == A)
+    res = model(
+        input_ids=ids[:, n:P],
+        attention_mask=torch.ones([B, P], dtype=torch.long),
+        past_key_values=past,
+        use_cache=True,
+        return_dict=True,
+    )
+    ok = check("prefix_cache prefill", close(ref[:, n:P], res.logits)) and ok
+    opt, _ = step_logits(model, ids, P + 1, res.past_key_values, P)
+    ok = check("prefix_cache decode", close(ref[:, P:], opt)) and ok
+
+    # Exact match, the last prompt token is run again
+    n, past = cache.lookup(ids[:, :A])
+    ok = check("prefix_cache exact lookup", n == A - 1) and ok
+    opt, _ = step_logits(model, ids, A, past, n)
+    ok = check("prefix_cache exact match", close(ref[:, A - 1 :], opt)) and ok
+
+    opt, _ = step_logits(model, ids, P, load_kv_cache(path), A)
+    ok = check("prefix_cache snapshot file", close(ref[:, P - 1 :], opt)) and ok
+    return ok
+
+
+class YarnRotaryEmbedding(torch.nn.Module):
+    # YaRN sin/cos for the eager reference, transformers 4.40 lacks it
+    def __init__(self, dim, base, factor, orig_max_pos, beta_fast=32, beta_slow=1):
+        super().__init__()
+        inv_freq = 1.0 / base ** (torch.arange(0, dim, 2).float() / dim)
+
+        def correction_dim(num_rot):
+            return (dim * math.log(orig_max_pos / (num_rot * 2 * math.pi))) / (
+                2 * math.log(base)
+            )
+
+        low = max(math.floor(correction_dim(beta_fast)), 0)
+        high = min(math.ceil(correction_dim(beta_slow)), dim - 1)
+        if low == high:
+            high += 0.001
+        ramp = ((torch.arange(dim // 2).float() - low) / (high - low)).clamp(0, 1)
+        extrapolation = 1 - ramp
+        self.inv_freq = inv_freq / factor * (1 - extrapolation)
+        self.inv_freq += inv_freq * extrapolation
+        self.mscale = 0.1 * math.log(factor) + 1.0
+
+    def forward(self, x, position_ids):
+        freqs = position_ids[:, :, None].float() * self.inv_freq[None, None, :]
+        emb = torch.cat([freqs, freqs], -1)
+        cos = emb.cos() * self.mscale
+        sin = emb.sin() * self.mscale
+        return cos.to(x.dtype), sin.to(x.dtype)
+
+
+@register("rope_on_the_fly", ROPE_ON_THE_FLY=1)
+def check_rope_on_the_fly():
+    torch.manual_seed(1)
+    B, P, L = 2, 24, 64
+    ids = torch.randint(512, [B, L])
+    # Dynamic NTK and YaRN only differ from the default past 32 positions
+    cases = {
+        "default": llama_config(),
+        "linear": llama_config(rope_scaling={"type": "linear", "factor": 2.0}),
+        "dynamic": llama_config(
+            max_position_embeddings=32,
+            rope_scaling={"type": "dynamic", "factor": 2.0},
+        ),
+        "yarn": llama_config(),
+    }
+    models, refs = {}, {}
+    for name, config in cases.items():
+        model = tiny_model(transformers.LlamaForCausalLM, config)
+        if name == "yarn":
+            for layer in model.model.layers:
+                attn = layer.self_attn
+                attn.rotary_emb = YarnRotaryEmbedding(
+                    attn.head_dim, config.rope_theta, 4.0, 32
+                )
+        # Stepwise like the fused model, dynamic NTK frequencies depend on the
+        # length at the time a key is cached
+        refs[name], _ = step_logits(model, ids, P)
+        models[name] = model
+
+    from tpp_pytorch_extension.llm.fused_llama_infer import OptimizeModelForLlama
+
+    ok = True
+    for name, model in models.items():
+        if name == "yarn":
+            model.config.rope_scaling = {
+                "rope_type": "yarn",
+                "factor": 4.0,
+                "original_max_position_embeddings": 32,
+            }
+        OptimizeModelForLlama(model, torch.float32)
+        opt, _ = step_logits(model, ids, P)
+        ok = check(f"rope_on_the_fly {name}", close(refs[name], opt)) and ok
+    return ok
+
+
+@register("multi_lora")
+def check_multi_lora():
+    model = tiny_model(transformers.LlamaForCausalLM, llama_config())
+    torch.manual_seed(1)
+    B, P, L = 3, 24, 32
+    ids = torch.randint(512, [B, L])
+    # Adapters of different ranks on partly overlapping projections
+    targets = [
+        (8, ["self_attn.q_proj", "self_attn.v_proj", "mlp.down_proj"]),
+        (6, ["self_attn.q_proj", "self_attn.o_proj", "mlp.up_proj"]),
+    ]
+    adapters = []
+    for r, paths in targets:
+        adapter = {}
+        for i in range(len(model.model.layers)):
+            for path in paths:
+                name = f"model.layers.{i}.{path}"
+                K, C = model.get_submodule(name).weight.shape
+                lora_A = torch.randn([r, C]) * 0.05
+                lora_B = torch.randn([K, r]) * 0.05
+                adapter[name] = (lora_A, lora_B, 2.0)
+        adapters.append(adapter)
+
+    # Reference per adapter with merged weights, the base model last
+    refs = []
+    for adapter in adapters + [{}]:
+        merged = copy.deepcopy(model)
+        for name, (lora_A, lora_B, scaling) in adapter.items():
+            merged.get_submodule(name).weight += scaling * lora_B @ lora_A
+        refs.append(step_logits(merged, ids, P)[0])
+
+    from tpp_pytorch_extension.llm.fused_llama_infer import OptimizeModelForLlama
+    from tpp_pytorch_extension.llm.llm_common import (
+        load_lora_adapters,
+        set_lora_adapter_ids,
+    )
+
+    OptimizeModelForLlama(model, torch.float32)
+    load_lora_adapters(model, adapters)
+    # Rows of different adapters share GEMM row blocks
+    adapter_ids = [0, 1, -1]
+    set_lora_adapter_ids(model, torch.tensor(adapter_ids))
+    ref = torch.stack([refs[a][b] for b, a in enumerate(adapter_ids)])
+    opt, _ = step_logits(model, ids, P)
+    ok = check("multi_lora mixed adapters", close(ref, opt))
+
+    set_lora_adapter_ids(model, None)
+    opt, _ = step_logits(model, ids, P)
+    return check("multi_lora disabled", close(refs[-1], opt)) and ok
+
+
+@register("cross_attention")
+def check_cross_attention():
+    torch.manual_seed(1)
+    B, T, P, L = 2, 20, 8, 24
+    src = torch.randint(512, [B, T])
+    # Padded encoder input for the second sequence
+    src_mask = torch.ones([B, T], dtype=torch.long)
+    src_mask[1, -5:] = 0
+    tgt = torch.randint(512, [B, L])
+
+    def decode(model):
+        enc = model.get_encoder()(input_ids=src, attention_mask=src_mask)
+        past, out, start = None, [], 0
+        for end in [P] + list(range(P + 1, L + 1)):
+            res = model(
+                encoder_outputs=enc,
+                attention_mask=src_mask,
+                decoder_input_ids=tgt[:, start:end],
+                past_key_values=past,
+                use_cache=True,
+                return_dict=True,
+            )
+            out.append(res.logits[:, -1].float())
+            past = res.past_key_values
+            start = end
+        return torch.stack(out, 1)
+
+    config = dict(
+        vocab_size=512,
+        d_model=256,
+        encoder_layers=1,
+        decoder_layers=2,
+        encoder_attention_heads=4,
+        decoder_attention_heads=4,
+        encoder_ffn_dim=512,
+        decoder_ffn_dim=512,
+        max_position_embeddings=64,
+        attn_implementation="eager",
+    )
+    # BART normalizes after each sublayer, mBART before
+    cases = {
+        "bart": (transformers.BartForConditionalGeneration, transformers.BartConfig),
+        "mbart": (
+            transformers.MBartForConditionalGeneration,
+            transformers.MBartConfig,
+        ),
+    }
+    models, refs = {}, {}
+    for name, (cls, config_cls) in cases.items():
+        models[name] = tiny_model(cls, config_cls(**config))
+        refs[name] = decode(models[name])
+
+    from tpp_pytorch_extension.llm.fused_enc_dec_infer import OptimizeModelForEncDec
+
+    ok = True
+    for name, model in models.items():
+        OptimizeModelForEncDec(model, torch.float32)
+        ok = check(f"cross_attention {name}", close(refs[name], decode(model))) and ok
+    return ok
+
+
+# Prefills of at least FT_OPT_SIZE rows use the int8 first token weights
+@register("w8a8", USE_INT8_GEMM=1, FT_OPT_SIZE=32)
+def check_w8a8():
+    model = tiny_model(transformers.LlamaForCausalLM, llama_config())
+    torch.manual_seed(1)
+    B, P, L = 2, 32, 40
+    ids = torch.randint(512, [B, L])
+    ref = model(ids).logits
+
+    from tpp_pytorch_extension.llm.fused_llama_infer import OptimizeModelForLlama
+
+    OptimizeModelForLlama(model, torch.float32)
+    res = model(
+        input_ids=ids[:, :P],
+        attention_mask=torch.ones([B, P], dtype=torch.long),
+        use_cache=True,
+        return_dict=True,
+    )
+    # Symmetric int8 weights per channel and inputs per token
+    ok = check("w8a8 prefill", close(ref[:, :P], res.logits, 5e-2))
+    opt, _ = step_logits(model, ids, P + 1, res.past_key_values, P)
+    return check("w8a8 decode after prefill", close(ref[:, P:], opt, 5e-2)) and ok
+
+
+def sparse_wt_check(fmt):
+    def run():
+        model = tiny_model(transformers.LlamaForCausalLM, llama_config())
+        # Drop half of the [64, 16] weight blocks the decoder layers use and
+        # prune the rest 2:4 along the input features
+        torch.manual_seed(2)
+        for layer in model.model.layers:
+            for m in layer.modules():
+                if not isinstance(m, torch.nn.Linear):
+                    continue
+                K, C = m.weight.shape
+                keep = torch.rand([K // 16, 1, C // 64, 1]) < 0.5
+                w = (m.weight.view([K // 16, 16, C // 64, 64]) * keep).view(K, -1, 4)
+                small = w.abs().topk(2, -1, largest=False).indices
+                m.weight.copy_(w.scatter(-1, small, 0.0).view(K, C))
+        torch.manual_seed(1)
+        B, P, L = 2, 16, 32
+        ids = torch.randint(512, [B, L])
+        ref = model(ids).logits[:, P - 1 :]
+
+        from tpp_pytorch_extension.llm.fused_llama_infer import (
+            OptimizeModelForLlama,
+        )
+
+        OptimizeModelForLlama(model, torch.float32)
+        opt, _ = step_logits(model, ids, P)
+        return check(f"sparse_wt format {fmt}", close(ref, opt))
+
+    return run
+
+
+# Block sparse decode weights, dense blocks and bitmask compressed blocks
+register("sparse_wt_blocks", SPARSE_WT_FORMAT=1)(sparse_wt_check(1))
+register("sparse_wt_bitmask", SPARSE_WT_FORMAT=2)(sparse_wt_check(2))
+
+
+# Layer norms computed in the prologue of the QKV and FC1 GEMMs
+@register("opt_ln_fusion", FUSED_QKV_GEMM=2)
+def check_opt_ln_fusion():
+    torch.manual_seed(1)
+    B, P, L = 2, 16, 32
+    ids = torch.randint(512, [B, L])
+    models, refs = {}, {}
+    for ln_before in [True, False]:
+        config = transformers.OPTConfig(
+            vocab_size=512,
+            hidden_size=256,
+            ffn_dim=512,
+            num_hidden_layers=2,
+            num_attention_heads=4,
+            max_position_embeddings=128,
+            word_embed_proj_dim=256,
+            do_layer_norm_before=ln_before,
+            attn_implementation="eager",
+        )
+        models[ln_before] = tiny_model(transformers.OPTForCausalLM, config)
+        refs[ln_before], _ = step_logits(models[ln_before], ids, P)
+
+    from tpp_pytorch_extension.llm.fused_opt_infer import OptimizeModelForOPT
+
+    ok = True
+    for ln_before, model in models.items():
+        OptimizeModelForOPT(model, torch.float32)
+        opt, _ = step_logits(model, ids, P)
+        name = f"opt_ln_fusion {'pre' if ln_before else 'post'} layer norm"
+        ok = check(name, close(refs[ln_before], opt)) and ok
+    return ok
+
+
+if args.check is None:
+    failed = []
+    for name, (fn, env) in CHECKS.items():
+        res = subprocess.run(
+            [sys.executable, __file__, "--check", name], env=dict(os.environ, **env)
+        )
+        if res.returncode != 0:
+            failed.append(name)
+    print(f"{len(CHECKS) - len(failed)} of {len(CHECKS)} checks passed")
+    if failed:
+        print(f"Failed: {', '.join(failed)}")
+    sys.exit(1 if failed else 0)
+else:
+    fn, env = CHECKS[args.check]
+    for k, v in env.items():
+        assert os.environ.get(k) == v, f"run with {k}={v} or without --check"
+    with torch.no_grad():
+        sys.exit(0 if fn() else 1)
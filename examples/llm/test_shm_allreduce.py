@@ -114,6 +114,72 @@ print(f"before x: {x}")
 shm_allreduce(x)
 print(f"after x: {x}")
 
+# Functional checks of the collectives, on the SHM path unless
+# USE_SHM_ALLREDUCE=0. Setting MPI_LOCALNRANKS below the number of ranks
+# emulates nodes and checks the hierarchical allreduce, TPP_SHM_WIRE_DTYPE
+# the reduced precision wire formats of fp32 allreduces.
+from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
+
+
+def check(name, ok):
+    t_ok = torch.tensor([1 if ok else 0])
+    if my_size > 1:
+        torch.distributed.all_reduce(t_ok, op=torch.distributed.ReduceOp.MIN)
+    print(f"{name:40s} {'PASSED' if t_ok.item() == 1 else 'FAILED'}")
+
+
+def run_checks(sz):
+    n = my_size
+    # Small integers are exact in every dtype
+    t = torch.full([sz], my_rank + 1, dtype=dtype)
+    shm_allreduce(t)
+    check(f"allreduce {sz}", bool((t == n * (n + 1) // 2).all()))
+
+    t = torch.full([sz], my_rank + 1, dtype=dtype)
+    fused_llm_cpp.allreduce_async(t).wait()
+    check(f"allreduce_async {sz}", bool((t == n * (n + 1) // 2).all()))
+
+    t = torch.full([sz], my_rank + 1, dtype=dtype)
+    res = fused_llm_cpp.allreduce_async(t).get_future().wait()[0]
+    check(f"allreduce_async future {sz}", bool((res == n * (n + 1) // 2).all()))
+
+    # Uneven splits, rank i contributes i + 1 columns of value i
+    t_in = torch.full([2, my_rank + 1], my_rank, dtype=dtype)
+    t_out = fused_llm_cpp.allgather(t_in, [i + 1 for i in range(n)])
+    expect = torch.cat([torch.full([2, i + 1], i, dtype=dtype) for i in range(n)], -1)
+    check("allgather", torch.equal(t_out, expect))
+
+    chunk = (sz + n - 1) // n
+    t_in = (torch.arange(chunk * n) % 64 + my_rank).to(dtype)
+    t_out = fused_llm_cpp.reduce_scatter(t_in)
+    expect = (torch.arange(chunk * n) % 64 * n + n * (n - 1) // 2).to(dtype)
+    check(f"reduce_scatter {sz}", torch.equal(t_out, expect.view(n, -1)[my_rank]))
+
+    t = torch.full([sz], my_rank, dtype=dtype)
+    fused_llm_cpp.broadcast(t, n - 1)
+    check(f"broadcast {sz}", bool((t == n - 1).all()))
+
+    # fp32 may go over the wire in reduced precision, compare against the
+    # exact sum with the error allowed by the format relative to the block max
+    wire = int(os.environ.get("TPP_SHM_WIRE_DTYPE", "0"))
+    tol = {0: 1e-6, 1: 1e-2, 2: 0.25, 3: 0.125}[wire] * n
+    torch.manual_seed(my_rank)
+    t = torch.randn([sz])
+    parts = []
+    for r in range(n):
+        torch.manual_seed(r)
+        parts.append(torch.randn([sz]))
+    ref = torch.stack(parts).sum(0)
+    shm_allreduce(t)
+    amax = torch.stack(parts).abs().max()
+    ok = bool((t - ref).abs().max() <= tol * amax)
+    check(f"allreduce float32 wire {wire} {sz}", ok)
+
+
+# Sizes below and above the staging and pipelining thresholds
+for sz in [1, 1025, 2**20 + 3, 2**23 + 5]:
+    run_checks(sz)
+
 if args.sizes is not None:
     sizes = np.fromstring(args.sizes, dtype=int, sep=",")
 else:
@@ -12,7 +12,21 @@
 // #include <torch/csrc/autograd/VariableTypeUtils.h>
 #include <torch/extension.h>
 
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include "ext_tpp.h"
 #include "init.h"
@@ -56,6 +70,33 @@ static const char* GEMM_LOOP_SCHEME_STREAMING =
     getenv("GEMM_LOOP_SCHEME_STREAMING") ? getenv("GEMM_LOOP_SCHEME_STREAMING")
                                          : "aCb";
 static const int USE_MXFP4 = env2int("USE_MXFP4", 0);
+// Store decode weights block sparse, skipping all zero [Hc, Hk] blocks:
+// 1 keeps the remaining blocks dense, 2 also compresses them with a bitmask
+static const int SPARSE_WT_FORMAT = env2int("SPARSE_WT_FORMAT", 0);
+// Quantize first token (prefill) weights to int8 per output channel and run
+// those GEMMs as W8A8 with dynamic per token activation scales
+static const int USE_INT8_GEMM = env2int("USE_INT8_GEMM", 0);
+// Bytes of each upcoming decode weight to prefetch while attention or
+// allreduce is running, 0 disables weight prefetching
+static const int WT_PREFETCH_SIZE = env2int("WT_PREFETCH_SIZE", 0);
+// StreamingLLM style KV cache eviction: keep KV_SINK_TOKENS leading tokens
+// plus the most recent KV_WINDOW_SIZE tokens, 0 window keeps the full cache.
+// The middle is dropped once KV_EVICT_CHUNK extra tokens have accumulated.
+static const int KV_SINK_TOKENS = env2int("KV_SINK_TOKENS", 4);
+static const int KV_WINDOW_SIZE = env2int("KV_WINDOW_SIZE", 0);
+static const int KV_EVICT_CHUNK = env2int("KV_EVICT_CHUNK", 64);
+// Directory (ideally on local NVMe) used to back KV caches with memory mapped
+// files, unset keeps KV caches in anonymous memory. The newest
+// KV_RESIDENT_SIZE tokens stay in anonymous memory, older ones are moved to
+// the file in steps of KV_CACHE_INC_SIZE tokens and may be paged out.
+static const char* KV_CACHE_OFFLOAD_DIR = getenv("KV_CACHE_OFFLOAD_DIR");
+static const int KV_RESIDENT_SIZE = env2int("KV_RESIDENT_SIZE", 4096);
+// Use huge pages for weight segments shared across processes, and seconds
+// to wait for another process to finish filling a segment
+static const int TPP_WEIGHT_SHM_HUGETLB =
+    env2int("TPP_WEIGHT_SHM_HUGETLB", 0);
+static const int TPP_WEIGHT_SHM_TIMEOUT =
+    env2int("TPP_WEIGHT_SHM_TIMEOUT", 600);
 
 REGISTER_LOCAL_SCOPE(b_emb, "b_emb");
 REGISTER_LOCAL_SCOPE(pln_gemm, "pln_gemm");
@@ -76,11 +117,77 @@ REGISTER_LOCAL_SCOPE(reorder, "rorder");
 REGISTER_LOCAL_SCOPE(allred, "allred");
 REGISTER_LOCAL_SCOPE(barrier, "barrier");
 REGISTER_LOCAL_SCOPE(concat, "concat");
+REGISTER_LOCAL_SCOPE(kv_evict, "kv_evict");
 REGISTER_LOCAL_SCOPE(fftkn, "fftkn");
+REGISTER_LOCAL_SCOPE(lora_xa, "lora_xa");
+REGISTER_LOCAL_SCOPE(lora_mask, "lora_mask");
 REGISTER_LOCAL_SCOPE(k_trans, "k_trans");
 REGISTER_LOCAL_SCOPE(pt_op, "pt_op");
 
+// Issues software prefetches for the leading blocks of weights that the next
+// GEMMs are going to stream. Blocked weights are laid out as [Nk][Nc][...] and
+// decode GEMMs are parallelized over Nk, so the first nc blocks of every nk
+// row are what the threads touch first.
+class WeightPrefetcher {
+ public:
+  void add(const at::Tensor& t_wt) {
+    if (WT_PREFETCH_SIZE <= 0 || !t_wt.defined() || t_wt.numel() == 0)
+      return;
+    // Quantized and block sparse weights keep the payload and the scales or
+    // indices in separate buffers
+    if (t_wt.is_quantized() || t_wt.layout() != at::kStrided ||
+        t_wt.dim() < 4)
+      return;
+    long Nk = t_wt.size(0);
+    long row_bytes = t_wt.numel() / Nk * t_wt.element_size();
+    long pf_bytes = std::min<long>(WT_PREFETCH_SIZE / Nk, row_bytes);
+    if (pf_bytes <= 0)
+      pf_bytes = std::min<long>(64, row_bytes);
+    regions.push_back({(const char*)t_wt.data_ptr(), Nk, row_bytes, pf_bytes});
+  }
+
+  void clear() {
+    regions.clear();
+  }
+
+  bool empty() {
+    return regions.empty();
+  }
+
+  // To be called by every thread of a parallel region
+  void issue(int tid, int nThreads) {
+    for (auto& r : regions) {
+      for (long nk = tid; nk < r.Nk; nk += nThreads) {
+        const char* ptr = r.ptr + nk * r.row_bytes;
+        for (long off = 0; off < r.pf_bytes; off += 64) {
+          // Weights are consumed by whichever core picks up the block so
+          // target the shared LLC rather than the local L1
+          __builtin_prefetch(ptr + off, 0, 1);
+        }
+      }
+    }
+  }
+
+  // To be called from a single thread while it waits on something else
+  void issue_all() {
+    issue(0, 1);
+  }
+
+ private:
+  struct Region {
+    const char* ptr;
+    long Nk;
+    long row_bytes;
+    long pf_bytes;
+  };
+  std::vector<Region> regions;
+};
+
 static c10::intrusive_ptr<c10d::ProcessGroup> process_group;
+// Ranks of this node and ranks with the same local rank across nodes, used
+// by the hierarchical allreduce (USE_SHM_ALLREDUCE == 2)
+static c10::intrusive_ptr<c10d::ProcessGroup> local_pg;
+static c10::intrusive_ptr<c10d::ProcessGroup> cross_pg;
 
 void set_pg(c10::intrusive_ptr<c10d::ProcessGroup> process_group_) {
   process_group = process_group_;
@@ -117,7 +224,27 @@ void set_pg(c10::intrusive_ptr<c10d::ProcessGroup> process_group_) {
       USE_SHM_ALLREDUCE);
 }
 
-static inline void allreduce(at::Tensor t_in) {
+// Called after set_pg() in multi-node runs, switches allreduce to SHM
+// within the node plus cross node allreduce of shards unless
+// USE_SHM_ALLREDUCE=0
+void set_node_pgs(
+    c10::intrusive_ptr<c10d::ProcessGroup> local_pg_,
+    c10::intrusive_ptr<c10d::ProcessGroup> cross_pg_) {
+  local_pg = local_pg_;
+  cross_pg = cross_pg_;
+  if (env2int("USE_SHM_ALLREDUCE", -1) != 0 && local_pg->getSize() > 1) {
+    USE_SHM_ALLREDUCE = 2;
+  }
+  printf(
+      "Setting node PGs: local_size = %d  num_nodes = %d SHM_ALLREDUCE = %d\n",
+      local_pg->getSize(),
+      cross_pg->getSize(),
+      USE_SHM_ALLREDUCE);
+}
+
+static inline void allreduce_and_prefetch(
+    at::Tensor t_in,
+    WeightPrefetcher* wt_pf) {
   RECORD_SCOPE(allred, {t_in});
   if (!process_group) {
     printf("Missing process group when using model parallel, use set_pg()\n");
@@ -129,11 +256,83 @@ static inline void allreduce(at::Tensor t_in) {
     process_group->barrier()->wait();
   }
 #endif
-  if (USE_SHM_ALLREDUCE != 1) {
-    std::vector<at::Tensor> temp_vec = {t_in};
-    process_group->allreduce(temp_vec)->wait();
-  } else {
+  if (USE_SHM_ALLREDUCE == 1) {
+    // Decode sized SHM allreduces mostly wait on the other ranks, the
+    // prefetches are in flight meanwhile
+    if (wt_pf)
+      wt_pf->issue_all();
     shm_allreduce(t_in, process_group);
+  } else if (USE_SHM_ALLREDUCE == 2) {
+    // Prefetch while the cross node part is on the wire
+    std::function<void()> on_cross_wait;
+    if (wt_pf)
+      on_cross_wait = [wt_pf]() { wt_pf->issue_all(); };
+    shm_allreduce_hierarchical(t_in, local_pg, cross_pg, on_cross_wait);
+  } else {
+    std::vector<at::Tensor> temp_vec = {t_in};
+    auto work = process_group->allreduce(temp_vec);
+    // Communication progresses in the backend, use the wait to warm up
+    // the weights of the next GEMM
+    if (wt_pf)
+      wt_pf->issue_all();
+    work->wait();
+  }
+}
+
+static inline void allreduce(at::Tensor t_in) {
+  allreduce_and_prefetch(t_in, nullptr);
+}
+
+// Returns once the allreduce is queued, wait() on the work before using
+// t_in. SHM allreduces progress on a helper thread team of their own.
+c10::intrusive_ptr<c10d::Work> allreduce_async(at::Tensor t_in) {
+  if (!process_group) {
+    printf("Missing process group when using model parallel, use set_pg()\n");
+    exit(1);
+  }
+  if (USE_SHM_ALLREDUCE == 1)
+    return shm_allreduce_async(t_in, process_group);
+  std::vector<at::Tensor> temp_vec = {t_in};
+  return process_group->allreduce(temp_vec);
+}
+
+// Output buffer for a GEMM whose result is allreduced right away. With SHM
+// allreduce it lives in the SHM staging area so that allreduce_staged()
+// reduces it from there without copying it in first.
+static inline c10::optional<at::Tensor> allreduce_buffer(at::Tensor t_like) {
+  if (my_size > 1 && USE_SHM_ALLREDUCE == 1) {
+    auto t = shm_staging_tensor(t_like, process_group);
+    if (t.defined())
+      return t;
+  }
+  return c10::nullopt;
+}
+
+static inline at::Tensor allreduce_staged(at::Tensor t_in) {
+  if (my_size == 1)
+    return t_in;
+  if (USE_SHM_ALLREDUCE != 1) {
+    allreduce(t_in);
+    return t_in;
+  }
+  RECORD_SCOPE(allred, {t_in});
+  return shm_allreduce_staged(t_in, process_group);
+}
+
+// Sizes the OpenMP team of the calling thread to the given cores and pins
+// each team member to one of them. Lets separate Python threads (e.g.
+// prefill and decode) run blocks concurrently on disjoint core partitions
+// of the same process, don't combine with OMP_PROC_BIND / KMP_AFFINITY.
+void set_thread_team(std::vector<long> cores) {
+  int nThreads = cores.size();
+  TPP_ASSERT(nThreads > 0, "Empty thread team\n");
+  omp_set_num_threads(nThreads);
+#pragma omp parallel num_threads(nThreads)
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cores[omp_get_thread_num()], &cpuset);
+    sched_setaffinity(0, sizeof(cpuset), &cpuset);
   }
 }
 
@@ -155,6 +354,15 @@ inline at::Tensor allgather(at::Tensor t_in, std::vector<long>& split_sizes) {
   TPP_ASSERT(
       (int)split_sizes.size() == my_size,
       "Length of split vector doesn't match group size");
+  if (USE_SHM_ALLREDUCE == 1) {
+    // Gathered in place, no concat needed
+    sz[dim] = 0;
+    for (auto s : split_sizes)
+      sz[dim] += s;
+    auto t_out = t_in.new_empty(sz);
+    shm_allgather(t_in, t_out, split_sizes, process_group);
+    return t_out;
+  }
   for (int i = 0; i < my_size; i++) {
     c10::InferenceMode guard(false);
     sz[dim] = split_sizes[i];
@@ -166,6 +374,47 @@ inline at::Tensor allgather(at::Tensor t_in, std::vector<long>& split_sizes) {
   return t_out;
 }
 
+// Sums t_in across ranks and returns chunk my_rank of the flattened result
+inline at::Tensor reduce_scatter(at::Tensor t_in) {
+  RECORD_SCOPE(allred, {t_in});
+  if (!process_group) {
+    printf("Missing process group when using model parallel, use set_pg()\n");
+    exit(1);
+  }
+  t_in = t_in.contiguous();
+  TPP_ASSERT(
+      t_in.numel() % my_size == 0,
+      "reduce_scatter size not divisible by group size\n");
+  auto t_out = t_in.new_empty({t_in.numel() / my_size});
+  if (USE_SHM_ALLREDUCE == 1) {
+    shm_reduce_scatter(t_in, t_out, process_group);
+  } else {
+    std::vector<at::Tensor> out_vec = {t_out};
+    std::vector<std::vector<at::Tensor>> in_vec(1);
+    for (auto& t : t_in.view({-1}).chunk(my_size))
+      in_vec[0].push_back(t);
+    process_group->reduce_scatter(out_vec, in_vec)->wait();
+  }
+  return t_out;
+}
+
+// Broadcasts t from rank root in place
+inline void broadcast(at::Tensor t, long root) {
+  RECORD_SCOPE(allred, {t});
+  if (!process_group) {
+    printf("Missing process group when using model parallel, use set_pg()\n");
+    exit(1);
+  }
+  if (USE_SHM_ALLREDUCE == 1) {
+    shm_broadcast(t, root, process_group);
+  } else {
+    std::vector<at::Tensor> temp_vec = {t};
+    c10d::BroadcastOptions opts;
+    opts.rootRank = root;
+    process_group->broadcast(temp_vec, opts)->wait();
+  }
+}
+
 template <typename T>
 inline at::Tensor kv_concat(
     at::Tensor t_in1,
@@ -225,6 +474,401 @@ inline at::Tensor kv_concat(
   return t_out;
 }
 
+// Copies the retained rows of an indirect KV cache into t_out, dropping rows
+// [sink, sink + delta) of the first L rows. Beam indices are resolved while
+// copying so the compacted cache is direct for every beam.
+template <typename T>
+inline void kv_evict(
+    at::Tensor t_in,
+    at::Tensor t_out,
+    VLAPtr<long, 1, long>& beam_idx,
+    long L,
+    long sink,
+    long delta) {
+  RECORD_SCOPE(kv_evict, {t_in});
+#ifdef S_FIRST_KVC
+  auto B = t_in.size(1);
+  auto N = t_in.size(2);
+  auto H = t_in.size(3);
+  auto in = GetVLAPtr<T>(t_in, {B, N, H});
+  auto out = GetVLAPtr<T>(t_out, {B, N, H});
+#else
+  auto B = t_in.size(0);
+  auto N = t_in.size(1);
+  auto capacity = t_in.size(2);
+  auto H = t_in.size(3);
+  auto in = GetVLAPtr<T>(t_in, {N, capacity, H});
+  auto out = GetVLAPtr<T>(t_out, {N, capacity, H});
+#endif
+  auto new_L = L - delta;
+  auto cpy_tpp = CpyTPP<T>(H);
+
+  {
+    RECORD_OMP_TIME();
+#pragma omp parallel for collapse(3)
+    for (int s = 0; s < new_L; s++) {
+      for (int b = 0; b < B; b++) {
+        for (int n = 0; n < N; n++) {
+          long s1 = s < sink ? s : s + delta;
+          long bid = beam_idx[b][s1];
+#ifdef S_FIRST_KVC
+          cpy_tpp(in[s1][bid][n], out[s][b][n]);
+#else
+          cpy_tpp(in[bid][n][s1], out[b][n][s]);
+#endif
+        }
+      }
+    }
+  }
+}
+
+// KV cache buffers when KV_CACHE_OFFLOAD_DIR is set. They start out as
+// anonymous memory; leading (oldest) rows are written to an unlinked file and
+// remapped from it once they leave the resident window. Growing a cache maps
+// the same file instead of copying the rows already moved.
+struct KvOffloadFile {
+  int fd;
+  ~KvOffloadFile() {
+    close(fd);
+  }
+};
+
+struct KvOffloadMap {
+  size_t bytes;
+  size_t spilled; // leading bytes mapped from the file
+  std::shared_ptr<KvOffloadFile> file;
+};
+
+static std::mutex kv_offload_mutex;
+static std::unordered_map<void*, KvOffloadMap> kv_offload_maps;
+
+static void kv_offload_unmap(void* ptr) {
+  std::lock_guard<std::mutex> lock(kv_offload_mutex);
+  auto it = kv_offload_maps.find(ptr);
+  if (it == kv_offload_maps.end())
+    return;
+  munmap(ptr, it->second.bytes);
+  kv_offload_maps.erase(it);
+}
+
+static bool kv_offload_is_mapped(const at::Tensor& t) {
+  std::lock_guard<std::mutex> lock(kv_offload_mutex);
+  return kv_offload_maps.count(t.storage().data()) > 0;
+}
+
+// Returns a zero filled tensor, offloadable if KV_CACHE_OFFLOAD_DIR is set
+static at::Tensor kv_cache_new_zeros(
+    const at::Tensor& t_like,
+    at::IntArrayRef sizes) {
+  if (KV_CACHE_OFFLOAD_DIR == nullptr)
+    return t_like.new_zeros(sizes);
+  size_t bytes = t_like.element_size();
+  for (auto sz : sizes)
+    bytes *= sz;
+  void* ptr = mmap(
+      NULL,
+      bytes,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+  TPP_ASSERT(ptr != MAP_FAILED, "mmap failed for KV cache\n");
+  {
+    std::lock_guard<std::mutex> lock(kv_offload_mutex);
+    kv_offload_maps[ptr] = {bytes, 0, nullptr};
+  }
+  return torch::from_blob(ptr, sizes, kv_offload_unmap, t_like.options());
+}
+
+// Moves the first `rows` rows of an offloadable S_FIRST_KVC cache to its
+// file and asks the kernel to page them out. Rows are only written once as
+// the window moves, in steps of KV_CACHE_INC_SIZE tokens.
+static void kv_offload_spill(const at::Tensor& t, long rows) {
+  if (rows <= 0)
+    return;
+  std::lock_guard<std::mutex> lock(kv_offload_mutex);
+  auto it = kv_offload_maps.find(t.storage().data());
+  if (it == kv_offload_maps.end())
+    return;
+  auto& m = it->second;
+  static const size_t pg_sz = sysconf(_SC_PAGESIZE);
+  size_t row_bytes = t.stride(0) * t.element_size();
+  size_t end = rows * row_bytes / pg_sz * pg_sz;
+  if (end < m.spilled + KV_CACHE_INC_SIZE * row_bytes)
+    return;
+  if (!m.file) {
+    std::string path = std::string(KV_CACHE_OFFLOAD_DIR) + "/tpp_kvc_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    TPP_ASSERT(fd >= 0, "Unable to create KV cache file %s\n", path.c_str());
+    unlink(path.c_str());
+    m.file = std::make_shared<KvOffloadFile>();
+    m.file->fd = fd;
+  }
+  int fd = m.file->fd;
+  char* base = (char*)it->first;
+  TPP_ASSERT(
+      ftruncate(fd, end) == 0,
+      "Unable to resize KV cache file to %lu bytes\n",
+      end);
+  for (size_t off = m.spilled; off < end;) {
+    auto n = pwrite(fd, base + off, end - off, off);
+    TPP_ASSERT(n > 0, "Unable to write KV cache file\n");
+    off += n;
+  }
+  // Same contents, now backed by the file
+  void* ptr = mmap(
+      base + m.spilled,
+      end - m.spilled,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_FIXED,
+      fd,
+      m.spilled);
+  TPP_ASSERT(ptr != MAP_FAILED, "mmap failed for KV cache file\n");
+#ifdef MADV_PAGEOUT
+  madvise(ptr, end - m.spilled, MADV_PAGEOUT);
+#endif
+  m.spilled = end;
+}
+
+// Returns a copy of the first `rows` rows of an S_FIRST_KVC cache in a new
+// cache of the given sizes. Rows already moved to a file are mapped from it.
+static at::Tensor kv_cache_grow(
+    const at::Tensor& t_past,
+    at::IntArrayRef sizes,
+    long rows) {
+  auto t_new = kv_cache_new_zeros(t_past, sizes);
+  long mapped_rows = 0;
+  if (KV_CACHE_OFFLOAD_DIR != nullptr) {
+    std::lock_guard<std::mutex> lock(kv_offload_mutex);
+    auto it = kv_offload_maps.find(t_past.storage().data());
+    if (it != kv_offload_maps.end() && it->second.file) {
+      auto& m = kv_offload_maps[t_new.storage().data()];
+      m.spilled = it->second.spilled;
+      m.file = it->second.file;
+      void* ptr = mmap(
+          t_new.data_ptr(),
+          m.spilled,
+          PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_FIXED,
+          m.file->fd,
+          0);
+      TPP_ASSERT(ptr != MAP_FAILED, "mmap failed for KV cache file\n");
+      mapped_rows = m.spilled / (t_past.stride(0) * t_past.element_size());
+    }
+  }
+  t_new.slice(0, mapped_rows, rows, 1)
+      .copy_(t_past.slice(0, mapped_rows, rows, 1));
+  return t_new;
+}
+
+// Prepared weights shared by inference processes of one user on a host.
+// Each block gets a SysV segment keyed by a tag and the user id, the first
+// process creates and fills it, others map it read-only and drop their
+// private copies. The header records the checkpoint the weights came from,
+// so a segment left behind by an earlier run with another checkpoint isn't
+// reused, and the creator so that segments of dead creators are replaced.
+static const uint64_t WEIGHT_SHM_MAGIC = 0x5450505754534847ULL;
+
+struct WeightShmHeader {
+  uint64_t magic;
+  uint64_t layout_hash;
+  uint64_t checkpoint_hash;
+  uint64_t bytes;
+  int ready;
+  int owner_pid;
+};
+
+struct WeightShmSegment {
+  int shmid;
+  void* base;
+  ~WeightShmSegment() {
+    shmdt(base);
+    // Last process to detach removes the segment
+    struct shmid_ds ds;
+    if (shmctl(shmid, IPC_STAT, &ds) == 0 && ds.shm_nattch == 0)
+      shmctl(shmid, IPC_RMID, NULL);
+  }
+};
+
+static uint64_t fnv1a_hash(
+    const void* data,
+    size_t len,
+    uint64_t h = 14695981039346656037ULL) {
+  auto p = (const unsigned char*)data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// True if the process that created the segment is gone. The creator records
+// itself in the header right after attaching, until then the creating pid
+// kept by the kernel stands in.
+static bool shm_owner_dead(int shmid, const WeightShmHeader* hdr) {
+  int owner = __atomic_load_n(&hdr->owner_pid, __ATOMIC_ACQUIRE);
+  if (owner == 0) {
+    struct shmid_ds ds;
+    if (shmctl(shmid, IPC_STAT, &ds) != 0)
+      return false;
+    owner = ds.shm_cpid;
+  }
+  return kill(owner, 0) != 0 && errno == ESRCH;
+}
+
+// Moves the given tensors into the segment for tag, in place so that other
+// references (e.g. the python parameters) follow. Returns true if this
+// process created the segment or keeps its private copies because the key is
+// held by a segment it can't access. checkpoint identifies the weight
+// contents, segments of the same tag holding another checkpoint are replaced
+// if their creator is gone and rejected otherwise.
+static bool share_weights_shm(
+    const std::string& tag,
+    const std::string& checkpoint,
+    const std::vector<at::Tensor*>& wts) {
+  std::vector<at::Tensor*> list;
+  std::vector<c10::TensorImpl*> seen;
+  for (auto t : wts) {
+    // MXFP4 and block sparse tensors carry side tensors and stay private
+    if (!t->defined() || t->numel() == 0 || t->is_quantized() ||
+        t->layout() != at::kStrided)
+      continue;
+    auto impl = t->unsafeGetTensorImpl();
+    if (std::find(seen.begin(), seen.end(), impl) != seen.end())
+      continue;
+    seen.push_back(impl);
+    list.push_back(t);
+  }
+
+  const size_t align = 4096;
+  size_t bytes = align; // header page
+  uint64_t layout = fnv1a_hash(tag.data(), tag.size());
+  std::vector<size_t> offsets;
+  for (auto t : list) {
+    offsets.push_back(bytes);
+    size_t sz = t->numel() * t->element_size();
+    bytes += (sz + align - 1) / align * align;
+    auto sizes = t->sizes().vec();
+    auto st = t->scalar_type();
+    layout = fnv1a_hash(sizes.data(), sizes.size() * sizeof(int64_t), layout);
+    layout = fnv1a_hash(&st, sizeof(st), layout);
+  }
+  uint64_t ckpt = fnv1a_hash(checkpoint.data(), checkpoint.size());
+  int flags = 0600;
+#ifdef SHM_HUGETLB
+  if (TPP_WEIGHT_SHM_HUGETLB) {
+    const size_t hp_sz = 2 * 1024 * 1024;
+    flags |= SHM_HUGETLB;
+    bytes = (bytes + hp_sz - 1) / hp_sz * hp_sz;
+  }
+#endif
+  uid_t uid = getuid();
+  uint64_t key_hash = fnv1a_hash(&uid, sizeof(uid));
+  key_hash = fnv1a_hash(tag.data(), tag.size(), key_hash);
+  key_t key = (key_t)((key_hash & 0x3fffffff) | 0x40000000);
+
+  int shmid = -1;
+  bool creator = false;
+  void* base = nullptr;
+  WeightShmHeader* hdr = nullptr;
+  // A second round follows removal of a stale segment
+  for (int attempt = 0; attempt < 2 && base == nullptr; attempt++) {
+    shmid = shmget(key, bytes, flags | IPC_CREAT | IPC_EXCL);
+    creator = shmid >= 0;
+    if (!creator) {
+      TPP_ASSERT(
+          errno == EEXIST,
+          "Unable to create weight segment %s of size %lu (errno %d)\n",
+          tag.c_str(),
+          bytes,
+          errno);
+      shmid = shmget(key, 0, 0);
+      if (shmid < 0 && errno == EACCES) {
+        // Key collides with a segment of another user
+        printf(
+            "Warning: weight segment %s not accessible, keeping private "
+            "weights\n",
+            tag.c_str());
+        return true;
+      }
+      TPP_ASSERT(
+          shmid >= 0,
+          "Unable to get weight segment %s (errno %d)\n",
+          tag.c_str(),
+          errno);
+    }
+    base = shmat(shmid, NULL, creator ? 0 : SHM_RDONLY);
+    TPP_ASSERT(base != (void*)-1, "shmat failed for %s\n", tag.c_str());
+    hdr = (WeightShmHeader*)base;
+    if (creator) {
+      __atomic_store_n(&hdr->owner_pid, (int)getpid(), __ATOMIC_RELEASE);
+      break;
+    }
+    // Wait for the creator unless it is gone
+    long waited_ms = 0;
+    bool stale = false;
+    while (!__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE)) {
+      if (shm_owner_dead(shmid, hdr)) {
+        stale = true;
+        break;
+      }
+      TPP_ASSERT(
+          waited_ms < TPP_WEIGHT_SHM_TIMEOUT * 1000L,
+          "Timed out waiting for weight segment %s\n",
+          tag.c_str());
+      usleep(1000);
+      waited_ms++;
+    }
+    bool match = hdr->magic == WEIGHT_SHM_MAGIC &&
+        hdr->layout_hash == layout && hdr->checkpoint_hash == ckpt;
+    if (!stale && !match)
+      stale = shm_owner_dead(shmid, hdr);
+    if (stale) {
+      shmdt(base);
+      shmctl(shmid, IPC_RMID, NULL);
+      base = nullptr;
+    }
+  }
+  TPP_ASSERT(
+      base != nullptr, "Unable to set up weight segment %s\n", tag.c_str());
+  auto seg = std::make_shared<WeightShmSegment>();
+  seg->shmid = shmid;
+  seg->base = base;
+
+  if (creator) {
+    for (size_t i = 0; i < list.size(); i++) {
+      auto t_dst = torch::from_blob(
+          (char*)base + offsets[i], list[i]->sizes(), list[i]->options());
+      t_dst.copy_(*list[i]);
+    }
+    hdr->magic = WEIGHT_SHM_MAGIC;
+    hdr->layout_hash = layout;
+    hdr->checkpoint_hash = ckpt;
+    hdr->bytes = bytes;
+    __atomic_store_n(&hdr->ready, 1, __ATOMIC_RELEASE);
+  } else {
+    TPP_ASSERT(
+        hdr->magic == WEIGHT_SHM_MAGIC && hdr->layout_hash == layout,
+        "Weight segment %s has a different layout\n",
+        tag.c_str());
+    TPP_ASSERT(
+        hdr->checkpoint_hash == ckpt,
+        "Weight segment %s is in use with another checkpoint\n",
+        tag.c_str());
+  }
+
+  at::NoGradGuard no_grad;
+  for (size_t i = 0; i < list.size(); i++) {
+    auto t_shared = torch::from_blob(
+        (char*)base + offsets[i],
+        list[i]->sizes(),
+        [seg](void*) {},
+        list[i]->options());
+    list[i]->set_(t_shared);
+  }
+  return creator;
+}
+
 template <typename T>
 inline void apply_rotary_pos_emb_gptj(
     at::Tensor t_in,
@@ -330,6 +974,62 @@ inline void apply_rotary_pos_emb_llama(
   }
 }
 
+// Llama style rotary embedding with sin/cos computed from the positions,
+// inv_freq holds HR / 2 per dimension frequencies and mscale scales both
+// (YaRN attention factor). Each token's sin/cos are shared by all heads.
+template <typename T>
+inline void apply_rotary_pos_emb_llama_otf(
+    at::Tensor& t_in,
+    const std::vector<float>& inv_freq,
+    float mscale,
+    at::Tensor& t_pos,
+    long N,
+    long H) {
+  RECORD_SCOPE(rotary, {t_in, t_pos});
+  auto in_sizes = t_in.sizes(); // in[B][S][F]
+  auto HR = 2 * (long)inv_freq.size(); // rotary_dim
+  auto B = in_sizes[0];
+  auto S = in_sizes[1];
+  auto B_pos = t_pos.size(0);
+  auto COFF = HR / 2;
+
+  TPP_ASSERT(B_pos == 1 || B_pos == B, "position_ids shape not compatible\n");
+  // Sin/cos once per position with ATen's vectorized math, shared by all
+  // heads (and sequences when positions are)
+  auto t_freq = at::from_blob((void*)inv_freq.data(), {COFF}, at::kFloat);
+  auto t_theta = t_pos.to(at::kFloat).unsqueeze(-1) * t_freq;
+  auto t_cos = (t_theta.cos() * mscale).contiguous();
+  auto t_sin = (t_theta.sin() * mscale).contiguous();
+
+  auto in = GetVLAPtr<T>(t_in, {S, N, H}); // [B][S][N][H]
+  auto cos_pos = GetVLAPtr<float>(t_cos, {S, COFF}); // [MB][S][HR/2]
+  auto sin_pos = GetVLAPtr<float>(t_sin, {S, COFF});
+
+  {
+    RECORD_OMP_TIME();
+
+#pragma omp parallel for collapse(2)
+    for (int b = 0; b < B; b++) {
+      for (int s = 0; s < S; s++) {
+        int b_pos = (B_pos == 1 ? 0 : b);
+        float* cos = cos_pos[b_pos][s];
+        float* sin = sin_pos[b_pos][s];
+        for (int n = 0; n < N; n++) {
+#pragma omp simd
+          for (int h2 = 0; h2 < COFF; h2++) {
+            float in0 = in[b][s][n][h2];
+            float in1 = in[b][s][n][COFF + h2];
+            float out0 = in0 * cos[h2] - in1 * sin[h2];
+            float out1 = in1 * cos[h2] + in0 * sin[h2];
+            in[b][s][n][h2] = out0;
+            in[b][s][n][COFF + h2] = out1;
+          }
+        }
+      }
+    }
+  }
+}
+
 template <typename T, typename LT = T>
 inline void lyr_norm(
     at::Tensor t_in,
@@ -441,6 +1141,53 @@ inline at::Tensor llama_rms_norm(at::Tensor t_in, at::Tensor t_wt, float eps) {
   return t_out;
 }
 
+// Block sparse weights use torch compressed layouts with Nk block rows and Nc
+// block columns, keeping the sizes of the dense blocked weight. kBlockSparse
+// values are the kept blocks as is. kBlockSparseBitmask (1x1 BSR) values
+// hold one bit per block element followed by the packed nonzeros, padded to
+// the densest block, so that only the used prefix of each block is read.
+constexpr auto kBlockSparse = at::kSparseCsr;
+constexpr auto kBlockSparseBitmask = at::kSparseBsr;
+
+inline bool is_block_sparse(const at::Tensor& t) {
+  return t.layout() == kBlockSparse || t.layout() == kBlockSparseBitmask;
+}
+
+// Expands a bitmask compressed block of n elements (n % 64 == 0) into dst
+template <typename Tw>
+inline void expand_bitmask_block(const Tw* blk, Tw* dst, long n) {
+  auto mask = (const uint64_t*)blk;
+  auto src = blk + n / (8 * sizeof(Tw));
+  for (long w = 0; w < n / 64; w++, dst += 64) {
+    uint64_t m = mask[w];
+#ifdef __AVX512VBMI2__
+    if constexpr (sizeof(Tw) == 2) {
+      for (int i = 0; i < 64; i += 32) {
+        __mmask32 k = (__mmask32)(m >> i);
+        auto v = _mm512_maskz_expandloadu_epi16(k, src);
+        _mm512_storeu_si512(dst + i, v);
+        src += __builtin_popcount(k);
+      }
+      continue;
+    }
+#endif
+#ifdef __AVX512F__
+    if constexpr (sizeof(Tw) == 4) {
+      for (int i = 0; i < 64; i += 16) {
+        __mmask16 k = (__mmask16)(m >> i);
+        auto v = _mm512_maskz_expandloadu_ps(k, src);
+        _mm512_storeu_ps(dst + i, v);
+        src += __builtin_popcount(k);
+      }
+      continue;
+    }
+#endif
+    memset(dst, 0, 64 * sizeof(Tw));
+    for (; m; m &= m - 1)
+      dst[__builtin_ctzll(m)] = *src++;
+  }
+}
+
 template <typename T, typename TOUT>
 class TppBlockedLinearWBase {
  public:
@@ -458,6 +1205,12 @@ class TppBlockedLinearWBase {
   std::string loop_scheme;
   std::function<void(const VLAPtr<T, 2, long>&, long, long)>
       postOpCBs[nOutputShapes];
+  // Low rank adapter update, applied before the post op
+  std::function<void(const VLAPtr<T, 2, long>&, long, long)>
+      loraCBs[nOutputShapes];
+  // Produces the input (e.g. a layer norm) inside the GEMM parallel region,
+  // called by every thread with (tid, nThreads) ahead of a barrier
+  std::function<void(int, int)> prologueCB;
 
  public:
   TppBlockedLinearWBase(at::Tensor t_in, at::Tensor t_wt, at::Tensor t_bias) {
@@ -494,6 +1247,25 @@ class TppBlockedLinearWBase {
     postOpCBs[i] = f;
   }
 
+  void setLoRACB(
+      int i,
+      const std::function<void(const VLAPtr<Tout, 2, long>&, long, long)>& f) {
+    TPP_ASSERT(i < nOutputShapes, "Invalid Index");
+    loraCBs[i] = f;
+  }
+
+  void setPrologueCB(const std::function<void(int, int)>& f) {
+    prologueCB = f;
+  }
+
+  // To be called by every thread of the GEMM parallel region
+  void prologue() {
+    if (!prologueCB)
+      return;
+    prologueCB(omp_get_thread_num(), omp_get_num_threads());
+#pragma omp barrier
+  }
+
   at::Tensor new_empty(at::Tensor t_in) {
     auto sizes = t_in.sizes().vec();
     auto dim = t_in.dim();
@@ -543,7 +1315,10 @@ class TppBlockedLinearWBase {
  protected:
   template <typename GemmT>
   static GemmT _get(at::Tensor& t_in, at::Tensor& t_wt, at::Tensor& t_bias) {
-    static ska::flat_hash_map<std::string, GemmT*> gemm_cache;
+    // Per thread team master so that concurrently running block stacks
+    // don't share GEMM objects, freed when the thread exits
+    static thread_local ska::flat_hash_map<std::string, std::unique_ptr<GemmT>>
+        gemm_cache;
     long Nc, Hc, Nk, Hk, Ncb, BSb, rem;
     bool weight_reuse;
     std::tie(Nc, Hc, Nk, Hk, Ncb, BSb, rem, weight_reuse) =
@@ -552,7 +1327,7 @@ class TppBlockedLinearWBase {
     snprintf(
         hash,
         199,
-        "gemm_Nc%ld_Hc%ld_Nk%ld_Hk%ld_Bsb%ld_rem%ld_Ncb%ld_wr%d",
+        "gemm_Nc%ld_Hc%ld_Nk%ld_Hk%ld_Bsb%ld_rem%ld_Ncb%ld_wr%d_sp%d",
         Nc,
         Hc,
         Nk,
@@ -560,14 +1335,15 @@ class TppBlockedLinearWBase {
         BSb,
         rem,
         Ncb,
-        weight_reuse ? 1 : 0);
+        weight_reuse ? 1 : 0,
+        is_block_sparse(t_wt) ? 1 : 0);
     auto search = gemm_cache.find(hash);
     GemmT* gemm = NULL;
     if (search != gemm_cache.end())
-      gemm = search->second;
+      gemm = search->second.get();
     if (gemm == NULL) {
       gemm = new GemmT(t_in, t_wt, t_bias);
-      gemm_cache[hash] = gemm;
+      gemm_cache[hash].reset(gemm);
       // printf("Hash: %s\n", hash);
     }
     return *gemm;
@@ -590,12 +1366,14 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
   using Base::Ncb;
   using Base::Nk;
   using Base::loop_scheme;
+  using Base::loraCBs;
   using Base::postOpCBs;
   using Base::rem;
   using Base::weight_reuse;
 
  protected:
   SCOPEIT_DECL(BrgemmTPP<T, Tout, Tw>) brgemm_tpp, brgemm_tpp_rem;
+  SCOPEIT_DECL(BrgemmTPP<T, Tout, Tw>) brgemm_sp_tpp, brgemm_sp_tpp_rem;
 
  public:
   TppBlockedLinearW(at::Tensor t_in, at::Tensor t_wt, at::Tensor t_bias)
@@ -613,10 +1391,91 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
         BSb, Hk, Hc, Hc, Hk * Hc, C, Hk, K, 1.0, 0, Ncb, b_vnni)));
     brgemm_tpp_rem = SCOPEITGEMM((BrgemmTPP<T, Tout, Tw>(
         rem, Hk, Hc, Hc, Hk * Hc, C, Hk, K, 1.0, 0, Ncb, b_vnni)));
+    if (is_block_sparse(t_wt)) {
+      // Runs of kept blocks vary in length, so no batch reduce unrolling
+      brgemm_sp_tpp = SCOPEITGEMM((BrgemmTPP<T, Tout, Tw>(
+          BSb, Hk, Hc, Hc, Hk * Hc, C, Hk, K, 1.0, 0, 0, b_vnni)));
+      brgemm_sp_tpp_rem = SCOPEITGEMM((BrgemmTPP<T, Tout, Tw>(
+          rem, Hk, Hc, Hc, Hk * Hc, C, Hk, K, 1.0, 0, 0, b_vnni)));
+    }
 
     loop_scheme =
         weight_reuse ? GEMM_LOOP_SCHEME_REUSE : GEMM_LOOP_SCHEME_STREAMING;
   }
+
+  // Kept blocks of consecutive columns are contiguous in the values just
+  // like the matching input blocks, so every run takes one brgemm call and
+  // skipped blocks are never loaded. Bitmask blocks of a run are expanded
+  // into a per thread scratch first.
+  std::function<void(int, int, int)> sparseStepFunc(
+      at::Tensor& t_in,
+      at::Tensor& t_wt_V,
+      at::Tensor& t_bias,
+      at::Tensor& t_out,
+      long BS) {
+    auto in = GetVLAPtr<T>(t_in, {Nc, Hc});
+    auto bias = GetVLAPtr<T>(t_bias, {Hk});
+    auto out = GetVLAPtr<Tout>(t_out, {Nk, Hk});
+    bool with_bias = (t_bias.numel() > 0);
+    bool bitmask = t_wt_V.layout() == kBlockSparseBitmask;
+    auto t_vals = t_wt_V.values();
+    auto nnzb = std::max<long>(t_vals.size(0), 1);
+    auto crow = GetVLAPtr<int64_t>(t_wt_V.crow_indices());
+    auto col = GetVLAPtr<int64_t>(t_wt_V.col_indices());
+    auto vals = GetVLAPtr<Tw>(t_vals, {t_vals.numel() / nnzb});
+    auto nThreads = bitmask ? omp_get_max_threads() : 0;
+    auto t_scratch = t_vals.new_empty({nThreads, Ncb * Hc * Hk});
+    auto scratch = GetVLAPtr<Tw>(t_scratch, {Ncb * Hc * Hk});
+    auto func = [&, in, crow, col, vals, scratch, t_scratch, bias, out, BS,
+                 with_bias, bitmask ](int nc, int s1, int nk)
+        __attribute__((always_inline)) {
+      auto count = nc + Ncb < Nc ? Ncb : Nc - nc;
+      bool is_rem = (s1 + BSb > BS);
+      auto& gemm = is_rem ? brgemm_sp_tpp_rem : brgemm_sp_tpp;
+      if (nc == 0) {
+        if (with_bias) {
+          if (is_rem)
+            this->copy_bias_tpp_rem(bias[nk], out[s1][nk]);
+          else
+            this->copy_bias_tpp(bias[nk], out[s1][nk]);
+        } else {
+          if (is_rem)
+            this->zero_tpp_rem(out[s1][nk]);
+          else
+            this->zero_tpp(out[s1][nk]);
+        }
+      }
+      auto end = col + crow[nk + 1];
+      auto c = std::lower_bound(col + crow[nk], end, (int64_t)nc);
+      while (c < end && *c < nc + count) {
+        long len = 1;
+        while (c + len < end && c[len] == *c + len && *c + len < nc + count)
+          len++;
+        Tw* wt = vals[c - col];
+        if (bitmask) {
+          long n = Hc * Hk;
+          auto buf = scratch[omp_get_thread_num()];
+          for (long i = 0; i < len; i++)
+            expand_bitmask_block<Tw>(vals[c - col + i], buf + i * n, n);
+          wt = buf;
+        }
+        gemm(in[s1][*c], wt, out[s1][nk], len, !is_rem);
+        c += len;
+      }
+      if (!(nc + Ncb < Nc)) { // last nc iter
+        int i = is_rem ? 1 : 0;
+        if (loraCBs[i]) {
+          loraCBs[i](out, s1, nk);
+          if (!is_rem)
+            brgemm_tpp.config();
+        }
+        if (postOpCBs[i])
+          postOpCBs[i](out, s1, nk);
+      }
+    };
+    return func;
+  }
+
   std::function<void(int, int, int)> stepFunc(
       at::Tensor& t_in,
       at::Tensor& t_wt_V,
@@ -627,7 +1486,9 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
     auto bias = GetVLAPtr<T>(t_bias, {Hk});
     auto out = GetVLAPtr<Tout>(t_out, {Nk, Hk});
     bool with_bias = (t_bias.numel() > 0);
-    if (!t_wt_V.is_quantized()) {
+    if (is_block_sparse(t_wt_V)) {
+      return sparseStepFunc(t_in, t_wt_V, t_bias, t_out, BS);
+    } else if (!t_wt_V.is_quantized()) {
       auto wt_V = GetVLAPtr<Tw>(t_wt_V, {Nc, Hc * Hk});
       auto func = [&, in, wt_V, bias, out, BS, with_bias ](
           int nc, int s1, int nk) __attribute__((always_inline)) {
@@ -643,6 +1504,11 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
           }
           brgemm_tpp(in[s1][nc], wt_V[nk][nc], out[s1][nk], count, true);
           if (!(nc + Ncb < Nc)) { // last nc iter
+            if (loraCBs[0]) {
+              loraCBs[0](out, s1, nk);
+              // adapter brgemm releases the tile config
+              brgemm_tpp.config();
+            }
             if (postOpCBs[0])
               postOpCBs[0](out, s1, nk);
           }
@@ -656,6 +1522,8 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
           }
           brgemm_tpp_rem(in[s1][nc], wt_V[nk][nc], out[s1][nk], count, false);
           if (!(nc + Ncb < Nc)) { // last nc iter
+            if (loraCBs[1])
+              loraCBs[1](out, s1, nk);
             if (postOpCBs[1])
               postOpCBs[1](out, s1, nk);
           }
@@ -694,6 +1562,10 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
                 count,
                 true);
             if (!(nc + Ncb < Nc)) { // last nc iter
+              if (loraCBs[0]) {
+                loraCBs[0](out, s1, nk);
+                brgemm_tpp.config();
+              }
               if (postOpCBs[0])
                 postOpCBs[0](out, s1, nk);
             }
@@ -713,6 +1585,8 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
                 count,
                 false);
             if (!(nc + Ncb < Nc)) { // last nc iter
+              if (loraCBs[1])
+                loraCBs[1](out, s1, nk);
               if (postOpCBs[1])
                 postOpCBs[1](out, s1, nk);
             }
@@ -745,6 +1619,7 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
           },
           [&]() {
             TimerStart();
+            this->prologue();
             brgemm_tpp.config();
           },
           [&]() {
@@ -795,6 +1670,7 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
           },
           [&]() {
             TimerStart();
+            gemms[0].prologue();
             gemms[0].brgemm_tpp.config();
           },
           [&]() {
@@ -813,19 +1689,297 @@ class TppBlockedLinearW : public TppBlockedLinearWBase<T, TOUT> {
   }
 };
 
-class NullPostOp {
+// Symmetric int8 quantization of activation rows with one scale per row
+template <typename T>
+class QuantizeRowsInt8 {
  public:
-  template <typename GemmT>
-  constexpr void operator()(GemmT& gemm) {}
+  QuantizeRowsInt8() {}
+  QuantizeRowsInt8(long C)
+      : C(C), cvt_tpp(C), absmax_tpp(C), scale_tpp(C) {}
+  void operator()(T* in, int8_t* q, float* scl, long rows) {
+    float tmp[C];
+    for (long i = 0; i < rows; i++) {
+      float max = 0.0f;
+      cvt_tpp(in + i * C, tmp);
+      absmax_tpp(tmp, &max);
+      float scale = max > 0.0f ? max / 127.0f : 1.0f;
+      scl[i] = scale;
+      scale_tpp(tmp, tmp, 1.0f / scale);
+#pragma omp simd
+      for (long c = 0; c < C; c++) {
+        float val = std::min(std::max(std::nearbyint(tmp[c]), -127.0f), 127.0f);
+        q[i * C + c] = (int8_t)val;
+      }
+    }
+  }
+
+ private:
+  long C = 0;
+  ConvertTPP<T, float> cvt_tpp;
+  AbsMaxTPP<float> absmax_tpp;
+  ScaleTPP<float, float> scale_tpp;
 };
 
-class GeluPostOp {
+// W8A8 GEMM for PerChannelInt8Quantizer weights: input rows are quantized
+// by the threads of the GEMM parallel region after the prologue, int8
+// brgemm accumulates the full C reduction of a tile into a per thread int32
+// block and the epilogue applies the per token x per channel scales and
+// bias before LoRA and post ops
+template <typename T, typename TOUT = T>
+class TppBlockedLinearW8A8 : public TppBlockedLinearWBase<T, TOUT> {
  public:
-  template <typename GemmT>
-  void operator()(GemmT& gemm) {
-    using T = typename GemmT::Tout;
-    auto num_shapes = gemm.numOutputShapes();
-    for (int i = 0; i < num_shapes; i++) {
+  using Tin = T;
+  using Tout = TOUT;
+  using Tw = int8_t;
+  using Base = TppBlockedLinearWBase<Tin, Tout>;
+  using Base::BSb;
+  using Base::C;
+  using Base::Hc;
+  using Base::Hk;
+  using Base::K;
+  using Base::Nc;
+  using Base::Ncb;
+  using Base::Nk;
+  using Base::loop_scheme;
+  using Base::loraCBs;
+  using Base::postOpCBs;
+  using Base::rem;
+  using Base::weight_reuse;
+  using BrgemmI8 = BrgemmTPP<int8_t, int32_t, int8_t, int32_t>;
+
+ protected:
+  SCOPEIT_DECL(BrgemmI8) brgemm_tpp, brgemm_tpp_rem;
+  QuantizeRowsInt8<Tin> quant;
+  ConvertTPP<int32_t, float> acc_cvt_tpp;
+  MulTPP<float, float> wt_scl_tpp;
+  ScaleTPP<float, float> in_scl_tpp;
+  AddTPP<float, Tout, Tin> bias_tpp;
+  ConvertTPP<float, Tout> out_cvt_tpp;
+
+ public:
+  TppBlockedLinearW8A8(at::Tensor t_in, at::Tensor t_wt, at::Tensor t_bias)
+      : TppBlockedLinearWBase<Tin, Tout>(t_in, t_wt, t_bias) {
+    TPP_ASSERT(Hc % 4 == 0, "W8A8 needs Hc to be multiple of 4\n");
+    // A tile reduces over all of C at once so that its int32 accumulator
+    // can be per thread
+    Ncb = Nc;
+    brgemm_tpp = SCOPEITGEMM(
+        (BrgemmI8(BSb, Hk, Hc, Hc, Hk * Hc, C, Hk, Hk, 0.0, 0, Ncb)));
+    brgemm_tpp_rem = SCOPEITGEMM(
+        (BrgemmI8(rem, Hk, Hc, Hc, Hk * Hc, C, Hk, Hk, 0.0, 0, Ncb)));
+    quant = QuantizeRowsInt8<Tin>(C);
+    acc_cvt_tpp = ConvertTPP<int32_t, float>(Hk);
+    wt_scl_tpp = MulTPP<float, float>(Hk);
+    in_scl_tpp = ScaleTPP<float, float>(Hk);
+    bias_tpp = AddTPP<float, Tout, Tin>(Hk);
+    out_cvt_tpp = ConvertTPP<float, Tout>(Hk);
+
+    loop_scheme =
+        weight_reuse ? GEMM_LOOP_SCHEME_REUSE : GEMM_LOOP_SCHEME_STREAMING;
+  }
+
+  // Quantizes the calling thread's share of the BS input rows, to be called
+  // by every thread of the GEMM parallel region after prologue()
+  void quantizeInput(Tin* in, int8_t* qin, float* in_scl, long BS) {
+    int tid = omp_get_thread_num();
+    int nThreads = omp_get_num_threads();
+    long start = BS * tid / nThreads;
+    long end = BS * (tid + 1) / nThreads;
+    quant(in + start * C, qin + start * C, in_scl + start, end - start);
+  }
+
+  void dequant(
+      int32_t* acc,
+      float* in_scl,
+      float* wt_scl,
+      Tin* bias,
+      Tout* out,
+      long M) {
+    float tmp[Hk];
+    for (long i = 0; i < M; i++) {
+      acc_cvt_tpp(acc + i * Hk, tmp);
+      wt_scl_tpp(tmp, wt_scl, tmp);
+      in_scl_tpp(tmp, tmp, in_scl[i]);
+      if (bias)
+        bias_tpp(tmp, bias, out + i * K);
+      else
+        out_cvt_tpp(tmp, out + i * K);
+    }
+  }
+
+  std::function<void(int, int, int)> stepFunc(
+      at::Tensor& t_qin,
+      at::Tensor& t_in_scl,
+      at::Tensor& t_wt_V,
+      at::Tensor& t_bias,
+      at::Tensor& t_acc,
+      at::Tensor& t_out,
+      long BS) {
+    TPP_ASSERT(
+        t_wt_V.is_quantized() && t_wt_V.qscheme() == at::kPerChannelInt8,
+        "W8A8 expects per channel int8 weights\n");
+    auto quantizer = at::get_qtensorimpl(t_wt_V)->quantizer();
+    auto t_wt_scl =
+        static_cast<at::PerChannelInt8Quantizer*>(quantizer.get())->scales();
+    auto in = GetVLAPtr<int8_t>(t_qin, {Nc, Hc});
+    auto in_scl = GetVLAPtr<float>(t_in_scl);
+    auto wt_V = GetVLAPtr<int8_t>(t_wt_V, {Nc, Hc * Hk});
+    auto wt_scl = GetVLAPtr<float>(t_wt_scl, {Hk});
+    auto bias = GetVLAPtr<T>(t_bias, {Hk});
+    auto acc = GetVLAPtr<int32_t>(t_acc, {BSb * Hk});
+    auto out = GetVLAPtr<Tout>(t_out, {Nk, Hk});
+    bool with_bias = (t_bias.numel() > 0);
+    auto func = [&, in, in_scl, wt_V, wt_scl, bias, acc, out, BS, with_bias ](
+        int nc, int s1, int nk) __attribute__((always_inline)) {
+      bool is_rem = (s1 + BSb > BS);
+      auto b = with_bias ? bias[nk] : nullptr;
+      auto t_acc = acc[omp_get_thread_num()];
+      if (!is_rem) {
+        brgemm_tpp(in[s1][0], wt_V[nk][0], t_acc, Nc, true);
+        dequant(t_acc, &in_scl[s1], wt_scl[nk], b, out[s1][nk], BSb);
+        if (loraCBs[0]) {
+          loraCBs[0](out, s1, nk);
+          // adapter brgemm releases the tile config
+          brgemm_tpp.config();
+        }
+        if (postOpCBs[0])
+          postOpCBs[0](out, s1, nk);
+      } else {
+        brgemm_tpp_rem(in[s1][0], wt_V[nk][0], t_acc, Nc, false);
+        dequant(t_acc, &in_scl[s1], wt_scl[nk], b, out[s1][nk], rem);
+        if (loraCBs[1])
+          loraCBs[1](out, s1, nk);
+        if (postOpCBs[1])
+          postOpCBs[1](out, s1, nk);
+      }
+    };
+    return func;
+  }
+
+  void operator()(
+      at::Tensor t_in,
+      at::Tensor t_wt_V,
+      at::Tensor t_bias,
+      at::Tensor t_out) {
+    t_in = t_in.contiguous();
+    auto BS = t_in.numel() / this->C;
+    auto t_qin = t_in.new_empty(t_in.sizes(), at::kChar);
+    auto t_in_scl = t_in.new_empty({BS}, at::kFloat);
+    auto t_acc = t_in.new_empty({omp_get_max_threads(), BSb * Hk}, at::kInt);
+    auto in = t_in.data_ptr<Tin>();
+    auto qin = t_qin.data_ptr<int8_t>();
+    auto in_scl = t_in_scl.data_ptr<float>();
+    auto func = stepFunc(t_qin, t_in_scl, t_wt_V, t_bias, t_acc, t_out, BS);
+    {
+      RECORD_OMP_TIME();
+      auto gemm_loop = ThreadedLoop<3>(
+          {LoopSpecs{0, Nc, Ncb, false}, LoopSpecs{0L, BS, BSb}, LoopSpecs{Nk}},
+          loop_scheme);
+      gemm_loop(
+          [&](int* ind) {
+            int nc = ind[0], s1 = ind[1], nk = ind[2];
+            func(nc, s1, nk);
+          },
+          [&]() {
+            TimerStart();
+            this->prologue();
+            quantizeInput(in, qin, in_scl, BS);
+#pragma omp barrier
+            brgemm_tpp.config();
+          },
+          [&]() {
+            brgemm_tpp.release();
+            TimerEnd();
+          });
+    }
+  }
+
+  static void fused_gemm(
+      std::vector<TppBlockedLinearW8A8<T, Tout>>& gemms,
+      at::Tensor& t_in,
+      std::vector<at::Tensor>& t_wt_V,
+      std::vector<at::Tensor>& t_bias,
+      std::vector<at::Tensor>& t_out) {
+    int n_gemms = gemms.size();
+    long totalN = 0;
+    auto BS = t_in.numel() / gemms[0].C;
+    long Nc = gemms[0].Nc;
+    long Ncb = gemms[0].Ncb;
+    long BSb = gemms[0].BSb;
+    auto loop_scheme = gemms[0].loop_scheme;
+    // All gemms share the same quantized input
+    t_in = t_in.contiguous();
+    auto t_qin = t_in.new_empty(t_in.sizes(), at::kChar);
+    auto t_in_scl = t_in.new_empty({BS}, at::kFloat);
+    auto in = t_in.data_ptr<Tin>();
+    auto qin = t_qin.data_ptr<int8_t>();
+    auto in_scl = t_in_scl.data_ptr<float>();
+    std::vector<at::Tensor> t_acc;
+    std::vector<std::function<void(int, int, int)>> funcs;
+    for (int i = 0; i < n_gemms; i++) {
+      auto& g = gemms[i];
+      t_acc.push_back(
+          t_in.new_empty({omp_get_max_threads(), BSb * g.Hk}, at::kInt));
+      funcs.push_back(g.stepFunc(
+          t_qin, t_in_scl, t_wt_V[i], t_bias[i], t_acc[i], t_out[i], BS));
+      totalN += g.Nk;
+      TPP_ASSERT(
+          g.Nc == Nc && g.Ncb == Ncb && g.BSb == BSb,
+          "Fused QKV weight block mismatch\n");
+    }
+    {
+      RECORD_OMP_TIME();
+      auto gemm_loop = ThreadedLoop<3>(
+          {LoopSpecs{0, Nc, Ncb, false},
+           LoopSpecs{0L, BS, BSb},
+           LoopSpecs{totalN}},
+          loop_scheme);
+      gemm_loop(
+          [&](int* ind) {
+            int nc = ind[0], s1 = ind[1], nk = ind[2];
+            int i = 0;
+            while (nk >= gemms[i].Nk) {
+              nk -= gemms[i].Nk;
+              i++;
+            }
+            funcs[i](nc, s1, nk);
+          },
+          [&]() {
+            TimerStart();
+            gemms[0].prologue();
+            gemms[0].quantizeInput(in, qin, in_scl, BS);
+#pragma omp barrier
+            gemms[0].brgemm_tpp.config();
+          },
+          [&]() {
+            gemms[0].brgemm_tpp.release();
+            TimerEnd();
+          });
+    }
+  }
+
+  static TppBlockedLinearW8A8<T, Tout> get(
+      at::Tensor& t_in,
+      at::Tensor& t_wt,
+      at::Tensor& t_bias) {
+    return Base::template _get<TppBlockedLinearW8A8<T, Tout>>(
+        t_in, t_wt, t_bias);
+  }
+};
+
+class NullPostOp {
+ public:
+  template <typename GemmT>
+  constexpr void operator()(GemmT& gemm) {}
+};
+
+class GeluPostOp {
+ public:
+  template <typename GemmT>
+  void operator()(GemmT& gemm) {
+    using T = typename GemmT::Tout;
+    auto num_shapes = gemm.numOutputShapes();
+    for (int i = 0; i < num_shapes; i++) {
       long M, N, LD;
       std::tie(M, N, LD) = gemm.getOutputShape(i);
       auto gelu_tpp = SCOPEIT(GeluFwdTPP<T>(M, N, LD, LD), ACT);
@@ -948,6 +2102,297 @@ class Add2ScalePostOp {
   float scale;
 };
 
+// Low rank adapters of one linear layer stacked over nA adapters, A and B
+// are kept in VNNI layout as [nA, C/V, r, V] and [nA, r/V, K, V]
+struct LoRAWeights {
+  at::Tensor t_A, t_B, t_scale;
+  long nA, r;
+};
+
+inline LoRAWeights make_lora_weights(
+    at::Tensor t_A,
+    at::Tensor t_B,
+    at::Tensor t_scale) {
+  // t_A: [nA, C, r], t_B: [nA, r, K], t_scale: [nA]
+  TPP_ASSERT(
+      t_A.dim() == 3 && t_B.dim() == 3 && t_A.size(0) == t_B.size(0) &&
+          t_A.size(2) == t_B.size(1),
+      "LoRA weight shape mismatch\n");
+  TPP_ASSERT(
+      t_A.dtype() == t_B.dtype(), "LoRA A and B must have the same dtype\n");
+  LoRAWeights lora;
+  lora.nA = t_A.size(0);
+  lora.r = t_A.size(2);
+  long C = t_A.size(1);
+  long K = t_B.size(2);
+  long V = get_vnni_block_size(t_B.scalar_type());
+  TPP_ASSERT(lora.r % V == 0, "LoRA rank must be a multiple of %ld\n", V);
+  TPP_ASSERT(C % V == 0, "LoRA input size must be a multiple of %ld\n", V);
+  lora.t_A = t_A.view({lora.nA, C / V, V, lora.r})
+                 .permute({0, 1, 3, 2})
+                 .contiguous();
+  lora.t_B = t_B.view({lora.nA, lora.r / V, V, K})
+                 .permute({0, 1, 3, 2})
+                 .contiguous();
+  lora.t_scale = t_scale.to(at::kFloat).contiguous();
+  TPP_ASSERT(lora.t_scale.numel() == lora.nA, "Need one scale per adapter\n");
+  return lora;
+}
+
+// Expands per request adapter ids ([B] or [B, S]) to one id per token row,
+// rows with a negative id use the base weights only
+inline at::Tensor lora_row_ids(at::Tensor t_ids, at::Tensor t_HS) {
+  long B = t_HS.size(0);
+  long BS = t_HS.numel() / t_HS.size(-1);
+  t_ids = t_ids.to(at::kLong).reshape({-1});
+  if (t_ids.numel() != BS) {
+    TPP_ASSERT(
+        B % t_ids.numel() == 0, "Adapter ids do not match the batch size\n");
+    t_ids = t_ids.repeat_interleave(B / t_ids.numel())
+                .view({B, 1})
+                .expand({B, BS / B});
+  }
+  return t_ids.contiguous().view({-1});
+}
+
+// Adds scale[id] * (X A[id]) B[id] to each output row. X A is computed up
+// front into a [BS, r] buffer, one brgemm per chunk of consecutive rows of
+// the same adapter. The epilogue of a tile is a single brgemm when all its
+// rows use one adapter, else one per adapter over a copy of the block's
+// X A rows with the other adapters' rows zeroed, built once per block.
+template <typename PostOpT = NullPostOp>
+class LoRAPostOp {
+ public:
+  // Rows of X A computed by one brgemm
+  static constexpr long XA_ROWS = 32;
+
+  LoRAPostOp(
+      at::Tensor t_in,
+      LoRAWeights* lora,
+      at::Tensor t_ids,
+      PostOpT post_op = PostOpT())
+      : t_in(t_in), lora(lora), t_ids(t_ids), post_op(post_op) {}
+  template <typename GemmT>
+  void operator()(GemmT& gemm) {
+    using Tin = typename GemmT::Tin;
+    using Tout = typename GemmT::Tout;
+    post_op(gemm);
+    if (lora == nullptr || !t_ids.defined())
+      return;
+    auto nA = lora->nA;
+    auto r = lora->r;
+    auto C = t_in.size(-1);
+    auto BS = t_in.numel() / C;
+    long BSb, N, LD;
+    std::tie(BSb, N, LD) = gemm.getOutputShape(0);
+    TPP_ASSERT(t_ids.numel() == BS, "Need one adapter id per row\n");
+
+    // Range of adapter ids used by each row block, and chunks of up to
+    // XA_ROWS consecutive rows with the same adapter as (start, rows, id)
+    long nBlocks = (BS + BSb - 1) / BSb;
+    std::vector<long> lo(nBlocks, nA), hi(nBlocks, -1);
+    std::vector<std::array<long, 3>> chunks;
+    auto ids = t_ids.data_ptr<long>();
+    for (long s = 0; s < BS; s++) {
+      auto id = ids[s];
+      TPP_ASSERT(id < nA, "Invalid adapter id %ld\n", id);
+      if (id >= 0) {
+        lo[s / BSb] = std::min(lo[s / BSb], id);
+        hi[s / BSb] = std::max(hi[s / BSb], id);
+      }
+      if (s > 0 && ids[s - 1] == id && chunks.back()[1] < XA_ROWS)
+        chunks.back()[1]++;
+      else
+        chunks.push_back({s, 1, id});
+    }
+    if (*std::max_element(hi.begin(), hi.end()) < 0)
+      return;
+
+    auto t_XA = t_in.new_empty({BS, r});
+    {
+      RECORD_SCOPE(lora_xa, {t_in, lora->t_A});
+      auto t_in_c = t_in.contiguous();
+      auto in = GetVLAPtr<Tin>(t_in_c, {C});
+      auto A = GetVLAPtr<Tin>(lora->t_A, {C * r});
+      auto XA = GetVLAPtr<Tin>(t_XA, {r});
+      auto scl = lora->t_scale.data_ptr<float>();
+      std::map<long, BrgemmTPP<Tin, float>> xa_tpps;
+      for (auto& c : chunks) {
+        if (c[2] >= 0 && xa_tpps.count(c[1]) == 0)
+          xa_tpps[c[1]] =
+              BrgemmTPP<Tin, float>(c[1], r, C, 0, 0, C, r, r, 0.0, 0, 1);
+      }
+      auto scale_tpp = ScaleTPP<float, Tin>(r);
+      auto zero_tpp = SetZeroTPP<Tin>(r);
+#pragma omp parallel for
+      for (size_t n = 0; n < chunks.size(); n++) {
+        long s0 = chunks[n][0], rows = chunks[n][1], id = chunks[n][2];
+        if (id < 0) {
+          for (long s = s0; s < s0 + rows; s++)
+            zero_tpp(XA[s]);
+          continue;
+        }
+        float tmp[XA_ROWS * r];
+        xa_tpps.at(rows)(in[s0], A[id], tmp, 1);
+        for (long j = 0; j < rows; j++)
+          scale_tpp(tmp + j * r, XA[s0 + j], scl[id]);
+      }
+    }
+
+    // One masked copy of X A per adapter of each block mixing adapters
+    std::vector<long> moff(nBlocks, 0);
+    long nMasked = 0;
+    for (long b = 0; b < nBlocks; b++) {
+      moff[b] = nMasked;
+      if (hi[b] > lo[b])
+        nMasked += hi[b] - lo[b] + 1;
+    }
+    auto t_masked = t_in.new_zeros({nMasked, BSb, r});
+    std::vector<char> used(nMasked, 0);
+    if (nMasked > 0) {
+      RECORD_SCOPE(lora_mask, {t_XA});
+      auto XA = GetVLAPtr<Tin>(t_XA, {r});
+      auto masked = GetVLAPtr<Tin>(t_masked, {BSb, r});
+      auto cpy_tpp = CpyTPP<Tin>(r);
+#pragma omp parallel for
+      for (long b = 0; b < nBlocks; b++) {
+        if (hi[b] <= lo[b])
+          continue;
+        for (long j = 0; j < BSb && b * BSb + j < BS; j++) {
+          auto id = ids[b * BSb + j];
+          if (id < 0)
+            continue;
+          auto m = moff[b] + id - lo[b];
+          cpy_tpp(XA[b * BSb + j], masked[m][j]);
+          used[m] = 1;
+        }
+      }
+    }
+
+    const long V = get_vnni_block_size<Tin>();
+    auto XA = GetVLAPtr<Tin>(t_XA, {r});
+    auto masked = GetVLAPtr<Tin>(t_masked, {BSb, r});
+    auto B = GetVLAPtr<Tin>(lora->t_B, {r * LD});
+    auto num_shapes = gemm.numOutputShapes();
+    for (int i = 0; i < num_shapes; i++) {
+      long M;
+      std::tie(M, N, LD) = gemm.getOutputShape(i);
+      auto lora_tpp = SCOPEITGEMM((BrgemmTPP<Tin, Tout, Tin>(
+          M, N, r, 0, 0, r, LD, LD, 1.0, 0, 1)));
+      gemm.setLoRACB(
+          i,
+          [=](const VLAPtr<Tout, 2, long>& out, long x, long y) mutable {
+            auto b = x / BSb;
+            if (hi[b] < lo[b])
+              return;
+            if (hi[b] == lo[b]) {
+              lora_tpp(XA[x], &B[lo[b]][y * N * V], out[x][y], 1);
+              return;
+            }
+            for (long id = lo[b]; id <= hi[b]; id++) {
+              auto m = moff[b] + id - lo[b];
+              if (used[m])
+                lora_tpp(masked[m][0], &B[id][y * N * V], out[x][y], 1);
+            }
+          });
+    }
+    // keep the X A buffers alive for the gemm call
+    this->t_XA = t_XA;
+    this->t_masked = t_masked;
+  }
+
+ private:
+  at::Tensor t_in;
+  LoRAWeights* lora;
+  at::Tensor t_ids;
+  PostOpT post_op;
+  at::Tensor t_XA;
+  at::Tensor t_masked;
+};
+
+template <typename PostOpT = NullPostOp>
+inline LoRAPostOp<PostOpT> lora_op(
+    at::Tensor t_in,
+    LoRAWeights* lora,
+    at::Tensor t_ids,
+    PostOpT post_op = PostOpT()) {
+  return LoRAPostOp<PostOpT>(t_in, lora, t_ids, post_op);
+}
+
+// Layer norm of t_in into t_out (the GEMM input) computed in the GEMM
+// prologue, sparing the separate parallel region of lyr_norm
+template <typename PostOpT = NullPostOp>
+class LayerNormPreOp {
+ public:
+  LayerNormPreOp(
+      at::Tensor t_in,
+      at::Tensor t_gamma,
+      at::Tensor t_beta,
+      float eps,
+      at::Tensor t_out,
+      PostOpT post_op)
+      : t_in(t_in),
+        t_gamma(t_gamma),
+        t_beta(t_beta),
+        eps(eps),
+        t_out(t_out),
+        post_op(post_op) {}
+
+  template <typename GemmT>
+  void operator()(GemmT& gemm) {
+    using T = typename GemmT::Tin;
+    auto ldt = t_gamma.dtype();
+    if (ldt == t_in.dtype()) {
+      set_prologue<T, T>(gemm);
+    } else if (ldt == at::kFloat) {
+      set_prologue<T, float>(gemm);
+    } else if (ldt == at::kBFloat16) {
+      set_prologue<T, bfloat16>(gemm);
+    } else if (ldt == at::kHalf) {
+      set_prologue<T, half>(gemm);
+    } else {
+      TPP_ASSERT(false, "LayerNormPreOp: unsupported gamma dtype\n");
+    }
+    post_op(gemm);
+  }
+
+ private:
+  template <typename T, typename LT, typename GemmT>
+  void set_prologue(GemmT& gemm) {
+    auto K = t_in.size(-1);
+    auto BS = t_in.numel() / K;
+    auto in = GetVLAPtr<T>(t_in, {K});
+    auto gamma = GetVLAPtr<LT>(t_gamma);
+    auto beta = GetVLAPtr<LT>(t_beta);
+    auto out = GetVLAPtr<T>(t_out, {K});
+    auto ln_tpp = SCOPEIT((LayerNormFwdTPP<T, LT>(1, 1, K, eps)), LAYER_NORM);
+    gemm.setPrologueCB([=](int tid, int nThreads) mutable {
+      long start = BS * tid / nThreads;
+      long end = BS * (tid + 1) / nThreads;
+      for (long b = start; b < end; b++)
+        ln_tpp(in[b], gamma, beta, nullptr, nullptr, out[b]);
+    });
+  }
+
+  at::Tensor t_in;
+  at::Tensor t_gamma;
+  at::Tensor t_beta;
+  float eps;
+  at::Tensor t_out;
+  PostOpT post_op;
+};
+
+template <typename PostOpT = NullPostOp>
+inline LayerNormPreOp<PostOpT> ln_op(
+    at::Tensor t_in,
+    at::Tensor t_gamma,
+    at::Tensor t_beta,
+    float eps,
+    at::Tensor t_out,
+    PostOpT post_op = PostOpT()) {
+  return LayerNormPreOp<PostOpT>(t_in, t_gamma, t_beta, eps, t_out, post_op);
+}
+
 template <typename GemmT, typename CB>
 inline at::Tensor dispatch_gemm(
     CB& cb,
@@ -987,11 +2432,14 @@ inline at::Tensor call_gemm_with_post_op(
       } else {
         TPP_ASSERT(false, "Unsupported qdtype\n");
       }
+    } else if (t_wt.qscheme() == at::kPerChannelInt8) {
+      return dispatch_gemm<TppBlockedLinearW8A8<Tin, Tout>, CB>(
+          cb, t_in, t_wt, t_bias);
     } else {
       TPP_ASSERT(false, "Unsupported qscheme\n");
     }
-  } else if (t_wt.is_sparse_csr()) {
   } else {
+    // Block sparse weights dispatch on the dtype of their values
     auto dtype = t_wt.scalar_type();
     switch (dtype) {
       case at::kFloat:
@@ -1112,8 +2560,82 @@ inline at::Tensor remap_and_quantize_mxfp4(at::Tensor t) {
   return ret;
 }
 
+// Converts a dense blocked weight [Nk, Nc, ...] to kBlockSparse (format 1)
+// or kBlockSparseBitmask (format 2). Weights without zero blocks are kept
+// dense, and bitmask blocks that would not be smaller stay uncompressed.
+inline at::Tensor sparsify_wt(at::Tensor t, int format) {
+  if (t.dim() < 4 || t.is_quantized() || t.layout() != at::kStrided)
+    return t;
+  RECORD_SCOPE(fftkn, {t});
+  t = t.contiguous();
+  auto Nk = t.size(0);
+  auto Nc = t.size(1);
+  auto sizes = t.sizes().vec();
+  long n = t.numel() / (Nk * Nc);
+  auto t_nz = t.view({Nk, Nc, n}).ne(0);
+  auto t_keep = t_nz.any(-1);
+  long nnzb = t_keep.sum().item<long>();
+  if (nnzb == Nk * Nc && format != 2)
+    return t;
+  auto t_crow = at::zeros({Nk + 1}, at::kLong);
+  t_crow.slice(0, 1).copy_(t_keep.sum(1).cumsum(0));
+  auto t_col = t_keep.nonzero().select(1, 1).contiguous();
+  auto t_vals = t.view({Nk, Nc, n}).index({t_keep}).contiguous();
+  auto vsizes = sizes;
+  vsizes.erase(vsizes.begin(), vsizes.begin() + 2);
+  vsizes.insert(vsizes.begin(), nnzb);
+
+  long es = t.element_size();
+  long unit = n / sizes[2];
+  long mask_len = n / (8 * es);
+  long max_nnz = 0;
+  auto t_bnz = t_nz.index({t_keep}).contiguous();
+  if (format == 2 && nnzb > 0)
+    max_nnz = t_bnz.sum(-1).max().item<long>();
+  long L = (mask_len + max_nnz + unit - 1) / unit * unit;
+  if (format != 2 || n % 64 != 0 || L * es % 8 != 0 || L >= n) {
+    if (nnzb == Nk * Nc)
+      return t;
+    return at::sparse_csr_tensor(
+        t_crow,
+        t_col,
+        t_vals.view(vsizes),
+        sizes,
+        t_vals.options().layout(kBlockSparse));
+  }
+
+  auto t_bm = t_vals.new_zeros({nnzb, L});
+  auto src = (const char*)t_vals.data_ptr();
+  auto dst = (char*)t_bm.data_ptr();
+  auto nz = t_bnz.data_ptr<bool>();
+#pragma omp parallel for
+  for (long b = 0; b < nnzb; b++) {
+    auto mask = (uint64_t*)(dst + b * L * es);
+    auto p = dst + (b * L + mask_len) * es;
+    for (long i = 0; i < n; i++) {
+      if (!nz[b * n + i])
+        continue;
+      mask[i / 64] |= 1ULL << (i % 64);
+      memcpy(p, src + (b * n + i) * es, es);
+      p += es;
+    }
+  }
+  // 1x1 blocks with the padded block as dense dims
+  sizes[2] = L / unit;
+  vsizes = sizes;
+  vsizes[0] = nnzb;
+  vsizes[1] = 1;
+  vsizes.insert(vsizes.begin() + 2, 1);
+  return at::sparse_bsr_tensor(
+      t_crow,
+      t_col,
+      t_bm.view(vsizes),
+      sizes,
+      t_bm.options().layout(kBlockSparseBitmask));
+}
+
 template <typename T>
-inline at::Tensor wt_tensor_for_first_token(at::Tensor t) {
+inline at::Tensor remap_wt_for_first_token(at::Tensor t) {
   RECORD_SCOPE(fftkn, {t});
   auto dim = t.dim();
   if (dim < 5)
@@ -1153,11 +2675,20 @@ inline at::Tensor wt_tensor_for_first_token(at::Tensor t) {
   return t_new;
 }
 
-template <typename GemmT>
+template <typename T>
+inline at::Tensor wt_tensor_for_first_token(at::Tensor t) {
+  auto t_new = remap_wt_for_first_token<T>(t);
+  if (USE_INT8_GEMM && t_new.dim() >= 4 && !t_new.is_quantized())
+    t_new = quantize_int8_per_channel(t_new);
+  return t_new;
+}
+
+template <typename GemmT, typename CB = NullPostOp>
 inline std::vector<at::Tensor> fused_qkv_gemm_spl(
     at::Tensor t_in,
     std::vector<at::Tensor> t_wt,
-    std::vector<at::Tensor> t_bias) {
+    std::vector<at::Tensor> t_bias,
+    CB cb = CB()) {
   RECORD_SCOPE(fqkv_gemm, {t_in, t_wt[0]});
   t_in = t_in.contiguous();
   int n_gemms = t_wt.size();
@@ -1170,52 +2701,57 @@ inline std::vector<at::Tensor> fused_qkv_gemm_spl(
   if (n_gemms == 4) {
     GeluPostOp()(gemms[3]);
   }
+  // Only the first GEMM runs the prologue of the fused loop
+  cb(gemms[0]);
 
   GemmT::fused_gemm(gemms, t_in, t_wt, t_bias, t_out);
   return t_out;
 }
 
-template <typename Tin, typename Tout = Tin>
+template <typename Tin, typename Tout = Tin, typename CB = NullPostOp>
 inline std::vector<at::Tensor> fused_qkv_gemm(
     at::Tensor t_in,
     std::vector<at::Tensor> t_wts,
-    std::vector<at::Tensor> t_bias) {
+    std::vector<at::Tensor> t_bias,
+    CB cb = CB()) {
   auto& t_wt = t_wts[0];
   // Check and redispatch with specialized type
   if (t_wt.is_quantized()) {
     if (t_wt.qscheme() == at::kPerBlockMxFP) {
       if (t_wt.dtype() == at::kQUInt4x2) {
         return fused_qkv_gemm_spl<TppBlockedLinearW<Tin, uint8_t, Tout>>(
-            t_in, t_wts, t_bias);
+            t_in, t_wts, t_bias, cb);
       } else {
         TPP_ASSERT(false, "Unsupported qdtype\n");
       }
+    } else if (t_wt.qscheme() == at::kPerChannelInt8) {
+      return fused_qkv_gemm_spl<TppBlockedLinearW8A8<Tin, Tout>>(
+          t_in, t_wts, t_bias, cb);
     } else {
       TPP_ASSERT(false, "Unsupported qscheme\n");
     }
-  } else if (t_wt.is_sparse_csr()) {
-    TPP_ASSERT(false, "Sparse Tensor Types not supported yet\n");
   } else {
+    // Block sparse weights dispatch on the dtype of their values
     auto dtype = t_wt.scalar_type();
     switch (dtype) {
       case at::kFloat:
         return fused_qkv_gemm_spl<TppBlockedLinearW<Tin, float, Tout>>(
-            t_in, t_wts, t_bias);
+            t_in, t_wts, t_bias, cb);
         break;
       case at::kBFloat16:
         return fused_qkv_gemm_spl<TppBlockedLinearW<Tin, bfloat16, Tout>>(
-            t_in, t_wts, t_bias);
+            t_in, t_wts, t_bias, cb);
         break;
       case at::kHalf:
         return fused_qkv_gemm_spl<TppBlockedLinearW<Tin, half, Tout>>(
-            t_in, t_wts, t_bias);
+            t_in, t_wts, t_bias, cb);
       case at::kHFloat8:
         return fused_qkv_gemm_spl<TppBlockedLinearW<Tin, hfloat8, Tout>>(
-            t_in, t_wts, t_bias);
+            t_in, t_wts, t_bias, cb);
         break;
       case at::kBFloat8:
         return fused_qkv_gemm_spl<TppBlockedLinearW<Tin, bfloat8, Tout>>(
-            t_in, t_wts, t_bias);
+            t_in, t_wts, t_bias, cb);
         break;
       default:
         TPP_ASSERT(false, "Unsupported dtype\n");
@@ -1238,13 +2774,17 @@ struct AttnKernels {
   SCOPEIT_DECL(XformExtTPP<T>) vnni_tpp;
   SCOPEIT_DECL(SoftMaxFixUpTPP<T>) softmax_fixup;
 
+  // kv_ld is the distance of K/V rows, H unless they are strided views
   AttnKernels(
       long Sqb,
       long Skb,
       long H,
       int pad,
       int kl_in_vnni,
-      int vl_in_vnni) {
+      int vl_in_vnni,
+      long kv_ld = -1) {
+    if (kv_ld < 0)
+      kv_ld = H;
     // printf("Sqb: %ld, Skb: %ld, H: %ld, psd: %d, kl: %d, vl: %d\n", Sqb, Skb,
     // H, pad, kl_in_vnni, vl_in_vnni);
     if (Sqb == 0)
@@ -1271,15 +2811,37 @@ struct AttnKernels {
     }
     // [Skb-pad, H] --> [H, Skb]
     xform_tpp = SCOPEIT(
-        XformExtTPP<T>(Skb - pad, H, H, Skb, H, Skb, xform, true), XPOSE);
+        XformExtTPP<T>(Skb - pad, H, H, Skb, kv_ld, Skb, xform, true), XPOSE);
     if (vl_in_vnni != 0)
       vnni_tpp = SCOPEIT(
           XformExtTPP<T>(
-              Skb - pad, H, Skb, H, H, H, XformTPP::XFORM_N2V_TPP, true),
+              Skb - pad, H, Skb, H, kv_ld, H, XformTPP::XFORM_N2V_TPP, true),
           VNNI);
   }
 };
 
+// An integer t_AM is an implicit padding mask holding the number of valid
+// tokens of each sequence, valid tokens being the last ones out of Sk. Returns
+// the first valid key index per sequence and clears t_AM so that no explicit
+// mask is applied.
+inline std::vector<long> implicit_mask_kv_start(
+    at::Tensor& t_AM,
+    long B,
+    long Sk) {
+  std::vector<long> kv_start(B, 0);
+  if (t_AM.numel() == 0 || t_AM.is_floating_point())
+    return kv_start;
+  TPP_ASSERT(
+      t_AM.numel() == B, "Implicit mask must have one entry per sequence\n");
+  auto t_len = t_AM.to(at::kLong).contiguous();
+  auto len = GetVLAPtr<long>(t_len);
+  for (int b = 0; b < B; b++) {
+    kv_start[b] = std::min(std::max(Sk - len[b], 0L), Sk - 1);
+  }
+  t_AM = t_AM.new_empty({0});
+  return kv_start;
+}
+
 template <typename T>
 inline at::Tensor attn(
     at::Tensor t_QL,
@@ -1289,7 +2851,8 @@ inline at::Tensor attn(
     at::Tensor t_KL_cache,
     at::Tensor t_VL_cache,
     VLAPtr<long, 1, long>& beam_idx,
-    long offset) {
+    long offset,
+    WeightPrefetcher* wt_pf = nullptr) {
   RECORD_SCOPE(ac_gemm2, {t_QL, t_KL});
   auto t_CL = at::empty_like(t_QL);
   auto sizes = t_QL.sizes();
@@ -1324,6 +2887,9 @@ inline at::Tensor attn(
   // auto CSk = t_KL_cache.size(2);
 #endif
   // printf("CSk = %d, FSk = %d\n", (int)CSk, (int)FSk);
+  auto kv_start = implicit_mask_kv_start(t_AM, B, FSk);
+  if (t_AM.numel() == 0)
+    t_AM = t_QL.new_empty({0});
   const bool am_valid = (t_AM.numel() > 0);
 
   auto QL = GetVLAPtr<T>(t_QL, {Nq, Sq, H});
@@ -1384,7 +2950,7 @@ inline at::Tensor attn(
           int sk_off = sk1 * FSk_BS;
           for (int sk2 = 0; sk2 < FSk_BS; sk2++) {
             int sk = sk_off + sk2;
-            if (sk < FSk) {
+            if (sk < FSk && sk >= kv_start[b]) {
               int bid = beam_idx[b][sk];
               __m512 vas = _mm512_setzero_ps();
               for (int h = 0; h < nh; h++) {
@@ -1466,7 +3032,7 @@ inline at::Tensor attn(
           float* ASP = AS[sk1][b][nq];
           for (int sk2 = 0; sk2 < FSk_BS; sk2++) {
             int sk = sk_off + sk2;
-            if (sk < FSk) {
+            if (sk < FSk && sk >= kv_start[b]) {
               int bid = beam_idx[b][sk];
               __m512 vas = _mm512_set1_ps(ASP[sk2]);
               for (int h = 0; h < nh; h++) {
@@ -1492,27 +3058,32 @@ inline at::Tensor attn(
         }
       }
     }
-#pragma omp parallel for collapse(3)
-    for (int b = 0; b < B; b++) {
-      for (int nq = 0; nq < Nq; nq++) {
-        for (int h = 0; h < nh; h++) {
-          auto vec = _mm512_setzero_ps();
+#pragma omp parallel
+    {
+#pragma omp for collapse(3) nowait
+      for (int b = 0; b < B; b++) {
+        for (int nq = 0; nq < Nq; nq++) {
+          for (int h = 0; h < nh; h++) {
+            auto vec = _mm512_setzero_ps();
 #ifndef PER_THREAD_COPY
-          for (int sk1 = 0; sk1 < nbFSk; sk1++) {
-            vec = _mm512_add_ps(
-                vec, _mm512_loadu_ps_auto(&tmpCL[sk1][b][nq][h * 16]));
-          }
+            for (int sk1 = 0; sk1 < nbFSk; sk1++) {
+              vec = _mm512_add_ps(
+                  vec, _mm512_loadu_ps_auto(&tmpCL[sk1][b][nq][h * 16]));
+            }
 #else
-          for (int tid = 0; tid < nThreads; tid++) {
-            if (accFlags[tid][b][nq] == 0)
-              continue;
-            vec = _mm512_add_ps(
-                vec, _mm512_loadu_ps_auto(&tmpCL[tid][b][nq][h * 16]));
-          }
+            for (int tid = 0; tid < nThreads; tid++) {
+              if (accFlags[tid][b][nq] == 0)
+                continue;
+              vec = _mm512_add_ps(
+                  vec, _mm512_loadu_ps_auto(&tmpCL[tid][b][nq][h * 16]));
+            }
 #endif
-          _mm512_storeu_ps_auto(&CL[b][nq][0][h * 16], vec);
+            _mm512_storeu_ps_auto(&CL[b][nq][0][h * 16], vec);
+          }
         }
       }
+      if (wt_pf)
+        wt_pf->issue(omp_get_thread_num(), omp_get_num_threads());
     }
   }
 #else // S_FIRST_KVC is not define
@@ -1548,7 +3119,7 @@ inline at::Tensor attn(
           int sk_off = sk1 * FSk_BS;
           for (int sk2 = 0; sk2 < FSk_BS; sk2++) {
             int sk = sk_off + sk2;
-            if (sk < FSk) {
+            if (sk < FSk && sk >= kv_start[b]) {
               int bid = beam_idx[b][sk];
               __m512 vas = _mm512_setzero_ps();
               for (int h = 0; h < nh; h++) {
@@ -1619,7 +3190,7 @@ inline at::Tensor attn(
           float* ASP = AS[b][nq][sk1];
           for (int sk2 = 0; sk2 < FSk_BS; sk2++) {
             int sk = sk_off + sk2;
-            if (sk < FSk) {
+            if (sk < FSk && sk >= kv_start[b]) {
               int bid = beam_idx[b][sk];
               __m512 vas = _mm512_set1_ps(ASP[sk2]);
               for (int h = 0; h < nh; h++) {
@@ -1638,18 +3209,23 @@ inline at::Tensor attn(
         }
       }
     }
-#pragma omp parallel for collapse(3)
-    for (int nq = 0; nq < Nq; nq++) {
-      for (int b = 0; b < B; b++) {
-        for (int h = 0; h < nh; h++) {
-          auto vec = _mm512_setzero_ps();
-          for (int sk1 = 0; sk1 < nbFSk; sk1++) {
-            vec = _mm512_add_ps(
-                vec, _mm512_loadu_ps_auto(&tmpCL[b][nq][sk1][h * 16]));
+#pragma omp parallel
+    {
+#pragma omp for collapse(3) nowait
+      for (int nq = 0; nq < Nq; nq++) {
+        for (int b = 0; b < B; b++) {
+          for (int h = 0; h < nh; h++) {
+            auto vec = _mm512_setzero_ps();
+            for (int sk1 = 0; sk1 < nbFSk; sk1++) {
+              vec = _mm512_add_ps(
+                  vec, _mm512_loadu_ps_auto(&tmpCL[b][nq][sk1][h * 16]));
+            }
+            _mm512_storeu_ps_auto(&CL[b][nq][0][h * 16], vec);
           }
-          _mm512_storeu_ps_auto(&CL[b][nq][0][h * 16], vec);
         }
       }
+      if (wt_pf)
+        wt_pf->issue(omp_get_thread_num(), omp_get_num_threads());
     }
   }
 #endif
@@ -1694,6 +3270,8 @@ inline at::Tensor attn(
             as *= one_by_sqrt_H;
             if (am_valid) {
               as += AM[b][sk];
+            } else if (sk < kv_start[b]) {
+              as = -1e10;
             }
             max = std::max(max, as);
             AS[sk] = as;
@@ -1737,6 +3315,8 @@ inline at::Tensor attn(
         }
       }
     }
+    if (wt_pf)
+      wt_pf->issue(omp_get_thread_num(), omp_get_num_threads());
     TimerEnd();
   }
 #endif
@@ -1798,6 +3378,8 @@ inline at::Tensor attn(
                 AS[sk] *= one_by_sqrt_H;
                 if (am_valid) {
                   AS[sk] += AM[b][sk];
+                } else if (sk < kv_start[b]) {
+                  AS[sk] = -1e10;
                 }
               }
               for (int sk = FSk; sk < FSk_aligned; sk++) {
@@ -1840,6 +3422,8 @@ inline at::Tensor attn(
             // (t3-t0)*1e6);
           }
         }
+        if (wt_pf)
+          wt_pf->issue(omp_get_thread_num(), omp_get_num_threads());
         TimerEnd();
         // auto t01 = getTime();
         // if (tid == 0) printf("MHA: s= %ld  %10g\n", FSk, (t01-t00)*1e6);
@@ -1885,6 +3469,8 @@ inline at::Tensor attn(
                 AS[b][nq][sk] *= one_by_sqrt_H;
                 if (am_valid) {
                   AS[b][nq][sk] += AM[b][sk];
+                } else if (sk < kv_start[b]) {
+                  AS[b][nq][sk] = -1e10;
                 }
               }
             }
@@ -1898,7 +3484,7 @@ inline at::Tensor attn(
 #pragma omp parallel
         {
           TimerStart();
-#pragma omp for collapse(2)
+#pragma omp for collapse(2) nowait
           for (int nq = 0; nq < Nq; nq++) {
             for (int b = 0; b < B; b++) {
               int nkv = Nq_per_kv == 1 ? nq : nq / Nq_per_kv;
@@ -1927,6 +3513,8 @@ inline at::Tensor attn(
               }
             }
           }
+          if (wt_pf)
+            wt_pf->issue(omp_get_thread_num(), omp_get_num_threads());
           TimerEnd();
         }
       }
@@ -1937,12 +3525,61 @@ inline at::Tensor attn(
   return t_CL;
 }
 
+// Transposes K and converts V to VNNI in the SK_BLOCK_SIZE blocks used by
+// attn, for K/V that are reused across calls. Returns [B, N, Sk, H] views of
+// [B, N, Sk_pad, H] tensors to be passed to attn with kv_formatted = true.
+template <typename T>
+inline std::vector<at::Tensor> attn_format_kv(
+    at::Tensor t_KL,
+    at::Tensor t_VL) {
+  RECORD_SCOPE(k_trans, {t_KL, t_VL});
+  auto sizes = t_KL.sizes();
+  long B = sizes[0];
+  long N = sizes[1];
+  long Sk = sizes[2];
+  long H = sizes[3];
+  const long VBS = get_vnni_block_size<T>();
+  long Sk_pad = (Sk + VBS - 1) & ~(VBS - 1);
+  const long Skb = SK_BLOCK_SIZE;
+  long krem = Sk % Skb;
+  int pad = Sk_pad - Sk;
+
+  auto t_KL_TV = t_KL.new_empty({B, N, Sk_pad, H});
+  auto t_VL_V = t_VL;
+  if (VBS != 1) {
+    t_VL_V = t_VL.new_empty({B, N, Sk_pad, H});
+  }
+  auto KL = GetVLAPtr<T>(t_KL, {N, Sk, H});
+  auto KL_TV = GetVLAPtr<T>(t_KL_TV, {N, Sk_pad, H});
+  auto VL = GetVLAPtr<T>(t_VL, {N, Sk, H});
+  auto VL_V = GetVLAPtr<T>(t_VL_V, {N, Sk_pad, H});
+  AttnKernels<T, T> attn_kern[2] = {
+      AttnKernels<T, T>(1, Skb, H, 0, 1, 1),
+      AttnKernels<T, T>(1, krem + pad, H, pad, 1, 1),
+  };
+
+#pragma omp parallel for collapse(3)
+  for (int n = 0; n < N; n++) {
+    for (int b = 0; b < B; b++) {
+      for (int sk = 0; sk < Sk; sk += Skb) {
+        int kid = (sk + Skb > Sk) ? 1 : 0;
+        attn_kern[kid].xform_tpp(KL[b][n][sk], KL_TV[b][n][sk]);
+        if (VBS != 1)
+          attn_kern[kid].vnni_tpp(VL[b][n][sk], VL_V[b][n][sk]);
+      }
+    }
+  }
+  return {t_KL_TV.narrow(2, 0, Sk), t_VL_V.narrow(2, 0, Sk)};
+}
+
 template <typename T, typename Tv>
 inline at::Tensor attn(
     at::Tensor t_QL,
     at::Tensor t_KL,
     at::Tensor t_AM,
-    at::Tensor t_VL) {
+    at::Tensor t_VL,
+    bool causal = true,
+    bool kv_formatted = false) {
   RECORD_SCOPE(ac_gemm1, {t_QL, t_KL});
   auto t_CL = at::empty_like(t_QL);
   auto sizes = t_QL.sizes();
@@ -1960,22 +3597,51 @@ inline at::Tensor attn(
   long offset = Sk - Sq;
   constexpr long Sqb = 64;
   long qrem = Sq % Sqb;
-  bool inline_trans = ((Sq + Sqb - 1) / Sqb == 1);
+  bool inline_trans = !kv_formatted && ((Sq + Sqb - 1) / Sqb == 1);
+  auto kv_start = implicit_mask_kv_start(t_AM, B, Sk);
+  if (t_AM.numel() == 0)
+    t_AM = t_QL.new_empty({0});
   const bool am_valid = (t_AM.numel() > 0);
   bool am_is_2d = am_valid && t_AM.size(2) != 1;
 
   int vl_in_vnni = 1; //(Sk % 2 == 0 ? 1 : 0);
   const long VBS = (vl_in_vnni ? get_vnni_block_size<T>() : 1);
   long Sk_pad = (Sk + VBS - 1) & ~(VBS - 1);
-  const long Skb = (!inline_trans ? 2048 : SK_BLOCK_SIZE);
+  const long Skb =
+      (!inline_trans && !kv_formatted ? 2048 : SK_BLOCK_SIZE);
   long krem = Sk % Skb;
   int pad = Sk_pad - Sk;
 
-  auto t_KL_TV = t_KL.new_empty({B, Nkv, Sk_pad, H});
-  auto t_VL_V = t_VL;
-  if (VBS != 1) {
-    t_VL_V = t_VL.new_empty({B, Nkv, Sk_pad, H});
+  at::Tensor t_KL_TV, t_VL_V = t_VL;
+  if (kv_formatted) {
+    TPP_ASSERT(
+        t_KL.stride(1) == Sk_pad * H && t_VL.stride(1) == Sk_pad * H,
+        "K/V not from attn_format_kv\n");
+    t_KL_TV = t_KL;
+  } else {
+    t_KL_TV = t_KL.new_empty({B, Nkv, Sk_pad, H});
+    if (VBS != 1) {
+      t_VL_V = t_VL.new_empty({B, Nkv, Sk_pad, H});
+    } else if (!t_VL.is_contiguous()) {
+      t_VL_V = t_VL.contiguous();
+    }
   }
+  // K/V rows may be strided along Sk, e.g. views of an S first cache, they
+  // are only read by the transpose and VNNI kernels
+  TPP_ASSERT(
+      t_KL.stride(3) == 1 && t_KL.strides() == t_VL.strides(),
+      "K/V must have unit stride heads and the same layout\n");
+  const long kv_sb = t_KL.stride(0);
+  const long kv_sn = t_KL.stride(1);
+  const long kv_ld = t_KL.stride(2);
+  auto KL_base = (T*)t_KL.data_ptr();
+  auto VL_base = (Tv*)t_VL.data_ptr();
+  auto KL = [=](long b, long n, long s) {
+    return KL_base + b * kv_sb + n * kv_sn + s * kv_ld;
+  };
+  auto VL = [=](long b, long n, long s) {
+    return VL_base + b * kv_sb + n * kv_sn + s * kv_ld;
+  };
   if (am_valid && Sk != Sk_pad) {
     // TPP_ASSERT(am_is_2d == false, "2D AM not supported yet\n");
     if (!am_is_2d) {
@@ -1989,32 +3655,31 @@ inline at::Tensor attn(
     }
   }
   auto QL = GetVLAPtr<T>(t_QL, {Nq, Sq, H});
-  auto KL = GetVLAPtr<T>(t_KL, {Nkv, Sk, H});
   auto KL_TV = GetVLAPtr<T>(t_KL_TV, {Nkv, Sk_pad, H});
-  auto VL = GetVLAPtr<Tv>(t_VL, {Nkv, Sk, H});
   auto VL_V = GetVLAPtr<Tv>(t_VL_V, {Nkv, Sk_pad, H});
   auto CL = GetVLAPtr<T>(t_CL, {Nq, Sq, H});
   auto AM = GetVLAPtr<T>(t_AM, {Sk_pad});
   auto AM2 = GetVLAPtr<T>(t_AM, {Sq, Sk_pad});
   int kl_in_vnni = 1;
+  int vi = vl_in_vnni;
 
   AttnKernels<T, Tv> attn_kern[4] = {
-      AttnKernels<T, Tv>(Sqb, Skb, H, 0, kl_in_vnni, vl_in_vnni),
-      AttnKernels<T, Tv>(Sqb, krem + pad, H, pad, kl_in_vnni, vl_in_vnni),
-      AttnKernels<T, Tv>(qrem, Skb, H, 0, kl_in_vnni, vl_in_vnni),
-      AttnKernels<T, Tv>(qrem, krem + pad, H, pad, kl_in_vnni, vl_in_vnni),
+      AttnKernels<T, Tv>(Sqb, Skb, H, 0, kl_in_vnni, vi, kv_ld),
+      AttnKernels<T, Tv>(Sqb, krem + pad, H, pad, kl_in_vnni, vi, kv_ld),
+      AttnKernels<T, Tv>(qrem, Skb, H, 0, kl_in_vnni, vi, kv_ld),
+      AttnKernels<T, Tv>(qrem, krem + pad, H, pad, kl_in_vnni, vi, kv_ld),
   };
 
-  if (!inline_trans) {
+  if (!inline_trans && !kv_formatted) {
     RECORD_SCOPE(k_trans, {t_QL, t_KL});
 #pragma omp parallel for collapse(3)
     for (int n = 0; n < Nkv; n++) {
       for (int b = 0; b < B; b++) {
         for (int sk = 0; sk < Sk; sk += Skb) {
           int kid = (sk + Skb > Sk) ? 1 : 0;
-          attn_kern[kid].xform_tpp(KL[b][n][sk], KL_TV[b][n][sk]);
+          attn_kern[kid].xform_tpp(KL(b, n, sk), KL_TV[b][n][sk]);
           if (VBS != 1)
-            attn_kern[kid].vnni_tpp(VL[b][n][sk], VL_V[b][n][sk]);
+            attn_kern[kid].vnni_tpp(VL(b, n, sk), VL_V[b][n][sk]);
         }
       }
     }
@@ -2041,14 +3706,31 @@ inline at::Tensor attn(
               T k_tmp[kbs * H];
               if (inline_trans) {
                 // ak.xform_tpp(KL[b][n][sk], KL_TV[b][n][sk]);
-                ak.xform_tpp(KL[b][nkv][sk], k_tmp);
+                ak.xform_tpp(KL(b, nkv, sk), k_tmp);
                 k_ptr = k_tmp;
               }
               ak.a_gemm_tpp(QL[b][nq][sq], k_ptr, AS[0], 1);
-              for (int sq1 = 0; sq1 < qbs; sq1++) {
-                auto qval = sq + sq1 + offset;
-                for (int sk1 = qval + 1; sk1 < sk + kbs; sk1++) {
-                  AS[sq1][sk1 - sk] = -1e9f;
+              if (causal) {
+                for (int sq1 = 0; sq1 < qbs; sq1++) {
+                  auto qval = sq + sq1 + offset;
+                  for (int sk1 = qval + 1; sk1 < sk + kbs; sk1++) {
+                    AS[sq1][sk1 - sk] = -1e9f;
+                  }
+                }
+              } else if (!am_valid && sk + kbs > Sk) {
+                // VNNI padding columns
+                for (int sq1 = 0; sq1 < qbs; sq1++) {
+                  for (int sk1 = Sk; sk1 < sk + kbs; sk1++) {
+                    AS[sq1][sk1 - sk] = -1e9f;
+                  }
+                }
+              }
+              if (kv_start[b] > sk) {
+                long sk_end = std::min(kv_start[b], sk + kbs);
+                for (int sq1 = 0; sq1 < qbs; sq1++) {
+                  for (int sk1 = sk; sk1 < sk_end; sk1++) {
+                    AS[sq1][sk1 - sk] = -1e9f;
+                  }
                 }
               }
               ak.scale_tpp(AS[0], AS[0], one_by_sqrt_H);
@@ -2075,7 +3757,7 @@ inline at::Tensor attn(
               Tv v_tmp[kbs * H];
               if (inline_trans && VBS != 1) {
                 // ak.vnni_tpp(VL[b][n][sk], VL_V[b][n][sk]);
-                ak.vnni_tpp(VL[b][nkv][sk], v_tmp);
+                ak.vnni_tpp(VL(b, nkv, sk), v_tmp);
                 v_ptr = v_tmp;
               }
               ak.c_gemm_tpp(AST[0], v_ptr, tmp, 1);
@@ -2115,9 +3797,46 @@ struct __attribute__((visibility("hidden"))) LLMBlock
  public:
   std::string name;
   long H;
+  // Weights to be warmed up while decode attention is running, per OS thread
+  // as a block may be run concurrently by prefill and decode thread teams
+  static inline thread_local WeightPrefetcher wt_prefetcher;
+  // Rotary table used to re-rotate cached keys when the KV window slides
+  enum {
+    ROPE_NONE,
+    ROPE_GPTJ,
+    ROPE_LLAMA,
+    ROPE_LLAMA_OTF
+  } rope_style = ROPE_NONE;
+  at::Tensor t_rope_EP;
+  std::vector<float> rope_inv_freq;
 
   LLMBlock(std::string name, long H) : name(name), H(H) {}
 
+  // Prepared weight tensors of the block, used for sharing across processes
+  virtual std::vector<at::Tensor*> weight_tensors() {
+    return {};
+  }
+
+  // Maps the prepared weights from a host wide shared memory segment named
+  // by tag, creating and filling it if this is the first process.
+  // checkpoint identifies the weights (e.g. path and revision).
+  bool share_weights(std::string tag, std::string checkpoint) {
+    return share_weights_shm(tag, checkpoint, weight_tensors());
+  }
+
+  // Remaps first token weights up front so that they get shared too
+  template <typename cls>
+  void remap_for_sharing(cls* self) {
+    if (!TPP_CACHE_REMAPPED_WEIGHTS || self->first_token_remapped)
+      return;
+    auto dt = self->t_Wq.dtype();
+    if (dt == at::kBFloat16) {
+      self->template remap_for_first_token<bfloat16>();
+    } else if (dt == at::kFloat) {
+      self->template remap_for_first_token<float>();
+    }
+  }
+
   bool check_weight_reuse(at::Tensor& t_in) {
     long BS = t_in.numel() / t_in.size(-1);
     if (BS >= FT_OPT_SIZE) {
@@ -2163,6 +3882,63 @@ struct __attribute__((visibility("hidden"))) LLMBlock
     return ret;
   }
 
+  // Tokens evicted from the KV cache of a sequence, kept in the indirect
+  // cache tuple after the key/value buffers. Positions and masks passed in
+  // by the model always cover the full sequence.
+  static long cache_evicted(std::vector<at::Tensor>& t_cache) {
+    if (t_cache.size() < 7 || t_cache[3].item<long>() == 0)
+      return 0;
+    return t_cache[6].item<long>();
+  }
+
+  // Maps sequence positions to positions within the (possibly evicted) cache
+  at::Tensor cache_positions(
+      at::Tensor t_pid,
+      std::vector<at::Tensor>& t_cache) {
+    long kv_evicted = cache_evicted(t_cache);
+    if (kv_evicted == 0 || t_pid.numel() == 0)
+      return t_pid;
+    return t_pid - kv_evicted;
+  }
+
+  // Rotates cached keys back by delta positions, t_keys is a slice of the
+  // key cache in its native layout
+  template <typename T>
+  void shift_key_positions(at::Tensor t_keys, long delta) {
+    if (rope_style == ROPE_NONE)
+      return;
+#ifdef S_FIRST_KVC
+    auto t_in = t_keys; // [S][B][N][H]
+#else
+    auto t_in = t_keys.permute({0, 2, 1, 3}).contiguous(); // [B][S][N][H]
+#endif
+    auto N = t_in.size(2);
+    auto H = t_in.size(3);
+    auto t_in3 = t_in.view({t_in.size(0), t_in.size(1), N * H});
+    auto t_pos = at::zeros({1, t_in.size(1)}, at::kLong);
+    at::Tensor t_ep;
+    if (rope_style == ROPE_GPTJ) {
+      // [MP][HR] with sin in the first half
+      TPP_ASSERT(delta < t_rope_EP.size(0), "Invalid KV shift %ld\n", delta);
+      t_ep = t_rope_EP.slice(0, delta, delta + 1).clone();
+      t_ep.slice(1, 0, t_ep.size(1) / 2).neg_();
+      apply_rotary_pos_emb_gptj<T>(t_in3, t_ep, t_pos, N, H);
+    } else if (rope_style == ROPE_LLAMA) {
+      // [2][MP][HR] as cos, sin
+      TPP_ASSERT(delta < t_rope_EP.size(1), "Invalid KV shift %ld\n", delta);
+      t_ep = t_rope_EP.slice(1, delta, delta + 1).clone();
+      t_ep[1].neg_();
+      apply_rotary_pos_emb_llama<T>(t_in3, t_ep, t_pos, N, H);
+    } else {
+      t_pos.fill_(-delta);
+      apply_rotary_pos_emb_llama_otf<T>(
+          t_in3, rope_inv_freq, 1.0f, t_pos, N, H);
+    }
+#ifndef S_FIRST_KVC
+    t_keys.copy_(t_in.permute({0, 2, 1, 3}));
+#endif
+  }
+
   template <typename T>
   std::vector<at::Tensor> self_mha(
       at::Tensor t_QL,
@@ -2177,6 +3953,7 @@ struct __attribute__((visibility("hidden"))) LLMBlock
     auto t_value_past = t_dummy;
     auto t_beam_idx = t_dummy_int;
     auto t_offset = t_dummy_int;
+    auto t_evicted = at::zeros({}, at::kLong);
     auto B = t_QL.size(0);
     auto S = t_QL.size(1);
     // auto N = self->N;
@@ -2198,6 +3975,8 @@ struct __attribute__((visibility("hidden"))) LLMBlock
           "Updated indirect kv_cache tuple should be of minimum length 6\n");
       t_key_past = t_cache[4];
       t_value_past = t_cache[5];
+      if (csz > 6 && offset > 0)
+        t_evicted = t_cache[6];
     } else if (csz > 0) {
       offset = t_key_past.size(2);
     }
@@ -2233,11 +4012,11 @@ struct __attribute__((visibility("hidden"))) LLMBlock
       t_CL = attn<T, T>(t_QL, t_KL, t_am, t_VL);
       auto capacity = S + KV_CACHE_INC_SIZE;
 #ifdef S_FIRST_KVC
-      t_key_past = t_KL.new_zeros({capacity, B, Nkv, H});
-      t_value_past = t_VL.new_zeros({capacity, B, Nkv, H});
+      t_key_past = kv_cache_new_zeros(t_KL, {capacity, B, Nkv, H});
+      t_value_past = kv_cache_new_zeros(t_VL, {capacity, B, Nkv, H});
 #else
-      t_key_past = t_KL.new_zeros({B, Nkv, capacity, H});
-      t_value_past = t_VL.new_zeros({B, Nkv, capacity, H});
+      t_key_past = kv_cache_new_zeros(t_KL, {B, Nkv, capacity, H});
+      t_value_past = kv_cache_new_zeros(t_VL, {B, Nkv, capacity, H});
 #endif
       // t_beam_idx = t_beam_idx.new_zeros({capacity, B});
       t_beam_idx =
@@ -2256,7 +4035,15 @@ struct __attribute__((visibility("hidden"))) LLMBlock
                  .permute({0, 2, 1, 3})
                  .contiguous()
                  .view({B, S, Nq * H});
-      return {t_CL, t_KL, t_VL, t_beam_idx, t_offset, t_key_past, t_value_past};
+      return {
+          t_CL,
+          t_KL,
+          t_VL,
+          t_beam_idx,
+          t_offset,
+          t_key_past,
+          t_value_past,
+          t_evicted};
       // printf("old offset = %d, new_offset = %ld\n", offset,
       // t_offset.item<long>());
     } else {
@@ -2265,34 +4052,46 @@ struct __attribute__((visibility("hidden"))) LLMBlock
 #else
       auto capacity = t_key_past.size(2);
 #endif
-      if (capacity <= offset) {
+      if (KV_CACHE_OFFLOAD_DIR != nullptr &&
+          !kv_offload_is_mapped(t_key_past)) {
+        // Cache was created by the model, move it to offloadable memory
+        auto t_key_past_new =
+            kv_cache_new_zeros(t_key_past, t_key_past.sizes());
+        t_key_past_new.copy_(t_key_past);
+        t_key_past = t_key_past_new;
+        auto t_value_past_new =
+            kv_cache_new_zeros(t_value_past, t_value_past.sizes());
+        t_value_past_new.copy_(t_value_past);
+        t_value_past = t_value_past_new;
+      }
+      if (capacity < offset + S) {
         printf(
             "Warning: Reallocating kv cache, consider increasing KV_CACHE_INC_SIZE (%d)\n",
             KV_CACHE_INC_SIZE);
-        auto new_capacity = offset + KV_CACHE_INC_SIZE;
+        auto new_capacity = offset + S + KV_CACHE_INC_SIZE - 1;
 #ifdef S_FIRST_KVC
-        auto t_key_past_new = t_key_past.new_empty({new_capacity, B, Nkv, H});
-        t_key_past_new.slice(0, 0, offset, 1).copy_(t_key_past);
-        t_key_past = t_key_past_new;
-
-        auto t_value_past_new =
-            t_value_past.new_empty({new_capacity, B, Nkv, H});
-        t_value_past_new.slice(0, 0, offset, 1).copy_(t_value_past);
-        t_value_past = t_value_past_new;
+        t_key_past =
+            kv_cache_grow(t_key_past, {new_capacity, B, Nkv, H}, offset);
+        t_value_past =
+            kv_cache_grow(t_value_past, {new_capacity, B, Nkv, H}, offset);
 #else
-        auto t_key_past_new = t_key_past.new_empty({B, Nkv, new_capacity, H});
-        t_key_past_new.slice(2, 0, offset, 1).copy_(t_key_past);
+        auto t_key_past_new =
+            kv_cache_new_zeros(t_key_past, {B, Nkv, new_capacity, H});
+        t_key_past_new.slice(2, 0, offset, 1)
+            .copy_(t_key_past.slice(2, 0, offset, 1));
         t_key_past = t_key_past_new;
 
         auto t_value_past_new =
-            t_value_past.new_empty({B, Nkv, new_capacity, H});
-        t_value_past_new.slice(2, 0, offset, 1).copy_(t_value_past);
+            kv_cache_new_zeros(t_value_past, {B, Nkv, new_capacity, H});
+        t_value_past_new.slice(2, 0, offset, 1)
+            .copy_(t_value_past.slice(2, 0, offset, 1));
         t_value_past = t_value_past_new;
 #endif
 
         auto t_beam_idx_new =
             at::arange(B).unsqueeze(0).expand({new_capacity, B}).contiguous();
-        t_beam_idx_new.slice(0, 0, offset, 1).copy_(t_beam_idx);
+        t_beam_idx_new.slice(0, 0, offset, 1)
+            .copy_(t_beam_idx.slice(0, 0, offset, 1));
         t_beam_idx = t_beam_idx_new;
       }
 
@@ -2304,13 +4103,13 @@ struct __attribute__((visibility("hidden"))) LLMBlock
       // << "B: " << B << " offset:" << offset << std::endl;
 
       at::Tensor t_new_beam_idx;
-      if (csz > 6) {
-        t_new_beam_idx = t_cache[6];
+      if (csz > 7) {
+        t_new_beam_idx = t_cache[7];
       } else {
         t_new_beam_idx = t_beam_idx.new_empty({B, offset + 1});
       }
       auto beam_idx = GetVLAPtr<long>(t_new_beam_idx, {offset + 1});
-      if (csz <= 6) {
+      if (csz <= 7) {
         auto b_ptr = GetVLAPtr<long>(t_beam_idx, {B});
         for (auto i = 0; i < B; i++) {
           beam_idx[i][offset] = i;
@@ -2322,14 +4121,131 @@ struct __attribute__((visibility("hidden"))) LLMBlock
         }
       }
 
+      if (S > 1) {
+        // Prefill of new tokens on top of an existing (e.g. restored prefix)
+        // cache. Resolve beams so the cached prefix is direct and run causal
+        // attention of the new tokens over prefix + new tokens.
+        TPP_ASSERT(
+            KV_WINDOW_SIZE == 0 && t_evicted.item<long>() == 0,
+            "Continuing a prefill is not supported with KV_WINDOW_SIZE\n");
+        if (B > 1) {
+          auto t_key_new = kv_cache_new_zeros(t_key_past, t_key_past.sizes());
+          auto t_value_new =
+              kv_cache_new_zeros(t_value_past, t_value_past.sizes());
+          kv_evict<T>(t_key_past, t_key_new, beam_idx, offset, 0, 0);
+          kv_evict<T>(t_value_past, t_value_new, beam_idx, offset, 0, 0);
+          t_key_past = t_key_new;
+          t_value_past = t_value_new;
+          t_beam_idx = at::arange(B)
+                           .unsqueeze(0)
+                           .expand({t_beam_idx.size(0), B})
+                           .contiguous();
+        }
+        auto L = offset + S;
+#ifdef S_FIRST_KVC
+        t_key_past.slice(0, offset, L, 1).copy_(t_KL.permute({2, 0, 1, 3}));
+        t_value_past.slice(0, offset, L, 1).copy_(t_VL.permute({2, 0, 1, 3}));
+        t_KL = t_key_past.slice(0, 0, L, 1).permute({1, 2, 0, 3});
+        t_VL = t_value_past.slice(0, 0, L, 1).permute({1, 2, 0, 3});
+#else
+        t_key_past.slice(2, offset, L, 1).copy_(t_KL);
+        t_value_past.slice(2, offset, L, 1).copy_(t_VL);
+        t_KL = t_key_past.slice(2, 0, L, 1);
+        t_VL = t_value_past.slice(2, 0, L, 1);
+#endif
+        t_CL = attn<T, T>(t_QL, t_KL, t_am, t_VL);
+        t_CL = t_CL.view({B, Nq, S, H})
+                   .permute({0, 2, 1, 3})
+                   .contiguous()
+                   .view({B, S, Nq * H});
+#ifdef S_FIRST_KVC
+        kv_offload_spill(t_key_past, L - KV_RESIDENT_SIZE);
+        kv_offload_spill(t_value_past, L - KV_RESIDENT_SIZE);
+#endif
+        t_offset = t_offset + S;
+        return {
+            t_CL,
+            t_KL,
+            t_VL,
+            t_beam_idx,
+            t_offset,
+            t_key_past,
+            t_value_past,
+            t_evicted};
+      }
+
+      long kv_evicted = t_evicted.item<long>();
+      if (kv_evicted > 0 && t_am.numel() > 0 && !t_am.is_floating_point()) {
+        // Padding may be split between sink and window tokens which can't be
+        // described by valid lengths, use an explicit mask
+        auto t_pos = at::arange(offset + 1);
+        t_pos.slice(0, KV_SINK_TOKENS).add_(kv_evicted);
+        auto t_pad =
+            (offset + 1 + kv_evicted) - t_am.to(at::kLong).view({B, 1});
+        t_am = t_QL.new_zeros({B, 1, 1, offset + 1});
+        t_am.masked_fill_(
+            (t_pos.view({1, -1}) < t_pad).view({B, 1, 1, -1}), -10000.0);
+      }
+      if (KV_WINDOW_SIZE > 0 && t_am.is_floating_point() &&
+          t_am.numel() > 0 && t_am.size(-1) > offset + 1) {
+        // Mask covers the full sequence, keep the sink tokens and the
+        // retained recent window
+        auto Lm = t_am.size(-1);
+        auto recent = offset + 1 - KV_SINK_TOKENS;
+        t_am = at::cat(
+            {t_am.narrow(-1, 0, KV_SINK_TOKENS),
+             t_am.narrow(-1, Lm - recent, recent)},
+            -1);
+      }
+
       t_CL = attn<T>(
-          t_QL, t_KL, t_am, t_VL, t_key_past, t_value_past, beam_idx, offset);
+          t_QL,
+          t_KL,
+          t_am,
+          t_VL,
+          t_key_past,
+          t_value_past,
+          beam_idx,
+          offset,
+          wt_prefetcher.empty() ? nullptr : &wt_prefetcher);
+#ifdef S_FIRST_KVC
+      // Tokens that left the resident window move to the backing file
+      kv_offload_spill(t_key_past, offset - KV_RESIDENT_SIZE);
+      kv_offload_spill(t_value_past, offset - KV_RESIDENT_SIZE);
+#endif
       t_CL = t_CL.view({B, Nq, S, H})
                  .permute({0, 2, 1, 3})
                  .contiguous()
                  .view({B, S, Nq * H});
       t_offset = t_offset + 1;
       S = t_offset.item<long>();
+      if (KV_WINDOW_SIZE > 0 &&
+          S >= KV_SINK_TOKENS + KV_WINDOW_SIZE + KV_EVICT_CHUNK) {
+        long delta = S - KV_SINK_TOKENS - KV_WINDOW_SIZE;
+        auto t_key_new = kv_cache_new_zeros(t_key_past, t_key_past.sizes());
+        auto t_value_new =
+            kv_cache_new_zeros(t_value_past, t_value_past.sizes());
+        kv_evict<T>(t_key_past, t_key_new, beam_idx, S, KV_SINK_TOKENS, delta);
+        kv_evict<T>(
+            t_value_past, t_value_new, beam_idx, S, KV_SINK_TOKENS, delta);
+        t_key_past = t_key_new;
+        t_value_past = t_value_new;
+        S -= delta;
+#ifdef S_FIRST_KVC
+        shift_key_positions<T>(
+            t_key_past.slice(0, KV_SINK_TOKENS, S, 1), delta);
+        auto capacity = t_key_past.size(0);
+#else
+        shift_key_positions<T>(
+            t_key_past.slice(2, KV_SINK_TOKENS, S, 1), delta);
+        auto capacity = t_key_past.size(2);
+#endif
+        // Beams were resolved while compacting
+        t_beam_idx =
+            at::arange(B).unsqueeze(0).expand({capacity, B}).contiguous();
+        t_offset.fill_(S);
+        t_evicted = t_evicted + delta;
+      }
 #ifdef S_FIRST_KVC
       t_KL = t_key_past.slice(0, 0, S, 1).permute({1, 2, 0, 3});
       t_VL = t_value_past.slice(0, 0, S, 1).permute({1, 2, 0, 3});
@@ -2340,7 +4256,15 @@ struct __attribute__((visibility("hidden"))) LLMBlock
       // printf("old offset = %d, new_offset = %ld\n", offset,
       // t_offset.item<long>());
       // std::cout << "t_key_past = " << t_key_past.sizes() << std::endl;
-      return {t_CL, t_KL, t_VL, t_beam_idx, t_offset, t_key_past, t_value_past};
+      return {
+          t_CL,
+          t_KL,
+          t_VL,
+          t_beam_idx,
+          t_offset,
+          t_key_past,
+          t_value_past,
+          t_evicted};
     }
   }
 };
@@ -2387,6 +4311,8 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
     t_Bo = params[i++];
 
     t_EP = params[i++]; // embed_positions
+    rope_style = ROPE_GPTJ;
+    t_rope_EP = t_EP;
 
     if (USE_MXFP4) {
       if (t_Wq.dtype() == at::kBFloat16) {
@@ -2400,6 +4326,18 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
       t_Wp = remap_and_quantize_mxfp4(t_Wp);
       t_Wi = remap_and_quantize_mxfp4(t_Wi);
       t_Wo = remap_and_quantize_mxfp4(t_Wo);
+    } else if (SPARSE_WT_FORMAT) {
+      if (t_Wq.dtype() == at::kBFloat16) {
+        remap_for_first_token<bfloat16>();
+      } else {
+        remap_for_first_token<float>();
+      }
+      t_Wq = sparsify_wt(t_Wq, SPARSE_WT_FORMAT);
+      t_Wk = sparsify_wt(t_Wk, SPARSE_WT_FORMAT);
+      t_Wv = sparsify_wt(t_Wv, SPARSE_WT_FORMAT);
+      t_Wp = sparsify_wt(t_Wp, SPARSE_WT_FORMAT);
+      t_Wi = sparsify_wt(t_Wi, SPARSE_WT_FORMAT);
+      t_Wo = sparsify_wt(t_Wo, SPARSE_WT_FORMAT);
     }
 
     N = t_Wq.size(0) * t_Wq.size(3) / H;
@@ -2422,6 +4360,13 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
     first_token_remapped = true;
   }
 
+  virtual std::vector<at::Tensor*> weight_tensors() override {
+    remap_for_sharing(this);
+    return {&t_G,    &t_B,    &t_Wq,   &t_Wk,   &t_Wv,   &t_Wp,
+            &t_Wi,   &t_Bi,   &t_Wo,   &t_Bo,   &t_EP,   &t_Wq_1,
+            &t_Wk_1, &t_Wv_1, &t_Wp_1, &t_Wi_1, &t_Wo_1};
+  }
+
   virtual std::vector<at::Tensor> forward(
       std::vector<at::Tensor> t_inp,
       std::vector<at::Tensor> t_cache,
@@ -2437,7 +4382,7 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
     auto t_HS = t_inp[0];
     RECORD_SCOPE(pt_op, {t_HS});
     auto t_am = t_inp[1];
-    auto t_pid = t_inp[2];
+    auto t_pid = cache_positions(t_inp[2], t_cache);
 
     bool weight_reuse = check_weight_reuse(t_HS);
 
@@ -2462,6 +4407,14 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
       t_Wo = this->t_Wo_1;
     }
 
+    wt_prefetcher.clear();
+    if (!weight_reuse) {
+      wt_prefetcher.add(t_Wp);
+      if (FUSED_QKV_GEMM != 2)
+        wt_prefetcher.add(t_Wi);
+      wt_prefetcher.add(t_Wo);
+    }
+
     auto t_null = t_HS.new_empty({0});
     auto t_res = t_HS;
     t_HS = lyr_norm<T>(t_HS, t_G, t_B, eps);
@@ -2484,10 +4437,13 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
       auto t_CL = outputs[0];
       auto t_SO = proj_gemm(t_CL, t_Wp, t_null);
       auto t_I = i_gemm(GeluPostOp(), t_HS, t_Wi, t_Bi);
-      auto t_Out = o_gemm(Add2ScalePostOp(t_SO, t_res, scale), t_I, t_Wo, t_Bo);
-      if (my_size > 1) {
-        allreduce(t_Out);
-      }
+      auto t_Out = o_gemm(
+          Add2ScalePostOp(t_SO, t_res, scale),
+          t_I,
+          t_Wo,
+          t_Bo,
+          allreduce_buffer(t_res));
+      t_Out = allreduce_staged(t_Out);
 
       outputs[0] = t_Out;
 
@@ -2510,10 +4466,13 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
       auto t_CL = outputs[0];
       auto t_SO = proj_gemm(t_CL, t_Wp, t_null);
       auto t_I = i_gemm(GeluPostOp(), t_HS, t_Wi, t_Bi);
-      auto t_Out = o_gemm(Add2ScalePostOp(t_SO, t_res, scale), t_I, t_Wo, t_Bo);
-      if (my_size > 1) {
-        allreduce(t_Out);
-      }
+      auto t_Out = o_gemm(
+          Add2ScalePostOp(t_SO, t_res, scale),
+          t_I,
+          t_Wo,
+          t_Bo,
+          allreduce_buffer(t_res));
+      t_Out = allreduce_staged(t_Out);
 
       outputs[0] = t_Out;
 
@@ -2536,10 +4495,13 @@ struct __attribute__((visibility("hidden"))) GPTJBlock : LLMBlock {
 
       auto t_CL = outputs[0];
       auto t_SO = proj_gemm(t_CL, t_Wp, t_null);
-      auto t_Out = o_gemm(Add2ScalePostOp(t_SO, t_res, scale), t_I, t_Wo, t_Bo);
-      if (my_size > 1) {
-        allreduce(t_Out);
-      }
+      auto t_Out = o_gemm(
+          Add2ScalePostOp(t_SO, t_res, scale),
+          t_I,
+          t_Wo,
+          t_Bo,
+          allreduce_buffer(t_res));
+      t_Out = allreduce_staged(t_Out);
 
       outputs[0] = t_Out;
 
@@ -2610,6 +4572,18 @@ struct __attribute__((visibility("hidden"))) OPTDecoderLayer : LLMBlock {
       t_Wp = remap_and_quantize_mxfp4(t_Wp);
       t_Wi = remap_and_quantize_mxfp4(t_Wi);
       t_Wo = remap_and_quantize_mxfp4(t_Wo);
+    } else if (SPARSE_WT_FORMAT) {
+      if (t_Wq.dtype() == at::kBFloat16) {
+        remap_for_first_token<bfloat16>();
+      } else {
+        remap_for_first_token<float>();
+      }
+      t_Wq = sparsify_wt(t_Wq, SPARSE_WT_FORMAT);
+      t_Wk = sparsify_wt(t_Wk, SPARSE_WT_FORMAT);
+      t_Wv = sparsify_wt(t_Wv, SPARSE_WT_FORMAT);
+      t_Wp = sparsify_wt(t_Wp, SPARSE_WT_FORMAT);
+      t_Wi = sparsify_wt(t_Wi, SPARSE_WT_FORMAT);
+      t_Wo = sparsify_wt(t_Wo, SPARSE_WT_FORMAT);
     }
 
     N = t_Wq.size(0) * t_Wq.size(3) / H;
@@ -2634,6 +4608,14 @@ struct __attribute__((visibility("hidden"))) OPTDecoderLayer : LLMBlock {
     first_token_remapped = true;
   }
 
+  virtual std::vector<at::Tensor*> weight_tensors() override {
+    remap_for_sharing(this);
+    return {&t_G1,   &t_B1,   &t_G2,   &t_B2,   &t_Wq,   &t_Bq,
+            &t_Wk,   &t_Bk,   &t_Wv,   &t_Bv,   &t_Wp,   &t_Bp,
+            &t_Wi,   &t_Bi,   &t_Wo,   &t_Bo,   &t_Wq_1, &t_Wk_1,
+            &t_Wv_1, &t_Wp_1, &t_Wi_1, &t_Wo_1};
+  }
+
   virtual std::vector<at::Tensor> forward(
       std::vector<at::Tensor> t_inp,
       std::vector<at::Tensor> t_cache,
@@ -2674,10 +4656,17 @@ struct __attribute__((visibility("hidden"))) OPTDecoderLayer : LLMBlock {
       t_Wo = this->t_Wo_1;
     }
 
+    wt_prefetcher.clear();
+    if (!weight_reuse)
+      wt_prefetcher.add(t_Wp);
+
     auto t_null = t_HS.new_empty({0}); // at::Tensor().to(t_HS.dtype());
 
     auto t_res = t_HS;
-    if (do_layer_norm_before) {
+    // Layer norms feeding a GEMM run in its prologue, as part of the fused
+    // QKV pass before attention and of FC1 (with bias and ReLU) after it
+    bool fuse_ln = FUSED_QKV_GEMM == 2;
+    if (do_layer_norm_before && !fuse_ln) {
       t_HS = lyr_norm<T>(t_HS, t_G1, t_B1, eps1);
     }
     auto qkv_gemm = GemmCaller<T>(SCOPE_ARG(qkv_gemm));
@@ -2690,6 +4679,16 @@ struct __attribute__((visibility("hidden"))) OPTDecoderLayer : LLMBlock {
       t_QL = qkv_gemm(t_HS, t_Wq, t_Bq);
       t_KL = qkv_gemm(t_HS, t_Wk, t_Bk);
       t_VL = qkv_gemm(t_HS, t_Wv, t_Bv);
+    } else if (do_layer_norm_before && fuse_ln) {
+      auto t_ln = at::empty_like(t_HS);
+      auto t_qkv_outs = fused_qkv_gemm<T>(
+          t_ln,
+          {t_Wq, t_Wk, t_Wv},
+          {t_Bq, t_Bk, t_Bv},
+          ln_op(t_HS, t_G1, t_B1, eps1, t_ln));
+      t_QL = t_qkv_outs[0];
+      t_KL = t_qkv_outs[1];
+      t_VL = t_qkv_outs[2];
     } else {
       auto t_qkv_outs =
           fused_qkv_gemm<T>(t_HS, {t_Wq, t_Wk, t_Wv}, {t_Bq, t_Bk, t_Bv});
@@ -2703,21 +4702,38 @@ struct __attribute__((visibility("hidden"))) OPTDecoderLayer : LLMBlock {
     auto t_CL = outputs[0];
     t_HS = proj_gemm(AddScalePostOp(t_res, scale), t_CL, t_Wp, t_Bp);
 
+    wt_prefetcher.clear();
+    if (!weight_reuse)
+      wt_prefetcher.add(t_Wi);
+
     if (my_size > 1) {
-      allreduce(t_HS);
+      allreduce_and_prefetch(t_HS, &wt_prefetcher);
     }
 
-    if (!do_layer_norm_before) {
+    if (!do_layer_norm_before && !fuse_ln) {
       t_HS = lyr_norm<T>(t_HS, t_G1, t_B1, eps1);
     }
 
     t_res = t_HS;
 
-    if (do_layer_norm_before) {
+    if (do_layer_norm_before && !fuse_ln) {
       t_HS = lyr_norm<T>(t_HS, t_G2, t_B2, eps2);
     }
 
-    t_HS = i_gemm(ReluPostOp(), t_HS, t_Wi, t_Bi);
+    if (fuse_ln) {
+      auto t_ln = at::empty_like(t_HS);
+      if (do_layer_norm_before) {
+        auto op = ln_op(t_HS, t_G2, t_B2, eps2, t_ln, ReluPostOp());
+        t_HS = i_gemm(op, t_ln, t_Wi, t_Bi);
+      } else {
+        // Post norm output is also the residual
+        auto op = ln_op(t_HS, t_G1, t_B1, eps1, t_ln, ReluPostOp());
+        t_HS = i_gemm(op, t_ln, t_Wi, t_Bi);
+        t_res = t_ln;
+      }
+    } else {
+      t_HS = i_gemm(ReluPostOp(), t_HS, t_Wi, t_Bi);
+    }
     t_HS = o_gemm(AddScalePostOp(t_res, scale), t_HS, t_Wo, t_Bo);
 
     if (my_size > 1) {
@@ -2738,6 +4754,355 @@ struct __attribute__((visibility("hidden"))) OPTDecoderLayer : LLMBlock {
   }
 };
 
+// Decoder layer of encoder-decoder models (BART, mBART, Whisper): causal
+// self attention over the indirect KV cache, cross attention over encoder
+// K/V that are computed once and then kept as the last two cache entries,
+// and an MLP. Pre or post layer norm as selected by do_layer_norm_before.
+struct __attribute__((visibility("hidden"))) CrossAttnDecoderLayer
+    : LLMBlock {
+ public:
+  at::Tensor t_Wq, t_Wk, t_Wv, t_Wp; // self attention
+  at::Tensor t_Bq, t_Bk, t_Bv, t_Bp;
+  at::Tensor t_Wcq, t_Wck, t_Wcv, t_Wcp; // cross attention
+  at::Tensor t_Bcq, t_Bck, t_Bcv, t_Bcp;
+  at::Tensor t_Wi, t_Wo; // fc1 and fc2
+  at::Tensor t_Bi, t_Bo;
+  at::Tensor t_G1, t_B1; // layernorm of self attention
+  at::Tensor t_G2, t_B2; // layernorm of cross attention
+  at::Tensor t_G3, t_B3; // layernorm of MLP
+  at::Tensor t_Wq_1, t_Wk_1, t_Wv_1, t_Wp_1;
+  at::Tensor t_Wcq_1, t_Wck_1, t_Wcv_1, t_Wcp_1;
+  at::Tensor t_Wi_1, t_Wo_1;
+  bool first_token_remapped = false;
+  float eps;
+  long N, H;
+  bool do_layer_norm_before;
+  bool act_gelu;
+
+  CrossAttnDecoderLayer(
+      std::vector<at::Tensor> params,
+      double eps,
+      long H,
+      bool do_layer_norm_before,
+      std::string activation)
+      : LLMBlock("cross_attn_fwd", H),
+        eps(eps),
+        H(H),
+        do_layer_norm_before(do_layer_norm_before) {
+    TPP_ASSERT(
+        activation == "gelu" || activation == "relu",
+        "Unsupported activation %s\n",
+        activation.c_str());
+    act_gelu = (activation == "gelu");
+    int i = 0;
+    t_G1 = params[i++]; // ln_gamma, lnorm of self attention
+    t_B1 = params[i++]; // ln_beta
+    t_G2 = params[i++]; // ln_gamma, lnorm of cross attention
+    t_B2 = params[i++]; // ln_beta
+    t_G3 = params[i++]; // ln_gamma, lnorm of mlp
+    t_B3 = params[i++]; // ln_beta
+
+    t_Wq = params[i++]; // self_attn q_proj
+    t_Bq = params[i++];
+    t_Wk = params[i++]; // self_attn k_proj
+    t_Bk = params[i++];
+    t_Wv = params[i++]; // self_attn v_proj
+    t_Bv = params[i++];
+    t_Wp = params[i++]; // self_attn out_proj
+    t_Bp = params[i++];
+
+    t_Wcq = params[i++]; // encoder_attn q_proj
+    t_Bcq = params[i++];
+    t_Wck = params[i++]; // encoder_attn k_proj
+    t_Bck = params[i++];
+    t_Wcv = params[i++]; // encoder_attn v_proj
+    t_Bcv = params[i++];
+    t_Wcp = params[i++]; // encoder_attn out_proj
+    t_Bcp = params[i++];
+
+    t_Wi = params[i++]; // fc1
+    t_Bi = params[i++];
+    t_Wo = params[i++]; // fc2
+    t_Bo = params[i++];
+
+    if (USE_MXFP4) {
+      if (t_Wq.dtype() == at::kBFloat16) {
+        remap_for_first_token<bfloat16>();
+      } else {
+        remap_for_first_token<float>();
+      }
+      t_Wq = remap_and_quantize_mxfp4(t_Wq);
+      t_Wk = remap_and_quantize_mxfp4(t_Wk);
+      t_Wv = remap_and_quantize_mxfp4(t_Wv);
+      t_Wp = remap_and_quantize_mxfp4(t_Wp);
+      t_Wcq = remap_and_quantize_mxfp4(t_Wcq);
+      t_Wck = remap_and_quantize_mxfp4(t_Wck);
+      t_Wcv = remap_and_quantize_mxfp4(t_Wcv);
+      t_Wcp = remap_and_quantize_mxfp4(t_Wcp);
+      t_Wi = remap_and_quantize_mxfp4(t_Wi);
+      t_Wo = remap_and_quantize_mxfp4(t_Wo);
+    } else if (SPARSE_WT_FORMAT) {
+      if (t_Wq.dtype() == at::kBFloat16) {
+        remap_for_first_token<bfloat16>();
+      } else {
+        remap_for_first_token<float>();
+      }
+      t_Wq = sparsify_wt(t_Wq, SPARSE_WT_FORMAT);
+      t_Wk = sparsify_wt(t_Wk, SPARSE_WT_FORMAT);
+      t_Wv = sparsify_wt(t_Wv, SPARSE_WT_FORMAT);
+      t_Wp = sparsify_wt(t_Wp, SPARSE_WT_FORMAT);
+      t_Wcq = sparsify_wt(t_Wcq, SPARSE_WT_FORMAT);
+      t_Wck = sparsify_wt(t_Wck, SPARSE_WT_FORMAT);
+      t_Wcv = sparsify_wt(t_Wcv, SPARSE_WT_FORMAT);
+      t_Wcp = sparsify_wt(t_Wcp, SPARSE_WT_FORMAT);
+      t_Wi = sparsify_wt(t_Wi, SPARSE_WT_FORMAT);
+      t_Wo = sparsify_wt(t_Wo, SPARSE_WT_FORMAT);
+    }
+
+    N = t_Wq.size(0) * t_Wq.size(3) / H;
+    auto dt = t_Wq.dtype();
+    if (my_rank == 0) {
+      std::cout << "my_size=" << my_size << " N=" << N << " H=" << H
+                << " wt dt=" << dt << std::endl;
+    }
+  }
+
+  template <typename Tw>
+  void remap_for_first_token() {
+    auto dtype = c10::CppTypeToScalarType<Tw>::value;
+    t_Wq_1 = wt_tensor_for_first_token<Tw>(t_Wq.to(dtype));
+    t_Wk_1 = wt_tensor_for_first_token<Tw>(t_Wk.to(dtype));
+    t_Wv_1 = wt_tensor_for_first_token<Tw>(t_Wv.to(dtype));
+    t_Wp_1 = wt_tensor_for_first_token<Tw>(t_Wp.to(dtype));
+    t_Wcq_1 = wt_tensor_for_first_token<Tw>(t_Wcq.to(dtype));
+    t_Wck_1 = wt_tensor_for_first_token<Tw>(t_Wck.to(dtype));
+    t_Wcv_1 = wt_tensor_for_first_token<Tw>(t_Wcv.to(dtype));
+    t_Wcp_1 = wt_tensor_for_first_token<Tw>(t_Wcp.to(dtype));
+    t_Wi_1 = wt_tensor_for_first_token<Tw>(t_Wi.to(dtype));
+    t_Wo_1 = wt_tensor_for_first_token<Tw>(t_Wo.to(dtype));
+    first_token_remapped = true;
+  }
+
+  virtual std::vector<at::Tensor*> weight_tensors() override {
+    remap_for_sharing(this);
+    return {&t_G1,    &t_B1,    &t_G2,    &t_B2,    &t_G3,    &t_B3,
+            &t_Wq,    &t_Bq,    &t_Wk,    &t_Bk,    &t_Wv,    &t_Bv,
+            &t_Wp,    &t_Bp,    &t_Wcq,   &t_Bcq,   &t_Wck,   &t_Bck,
+            &t_Wcv,   &t_Bcv,   &t_Wcp,   &t_Bcp,   &t_Wi,    &t_Bi,
+            &t_Wo,    &t_Bo,    &t_Wq_1,  &t_Wk_1,  &t_Wv_1,  &t_Wp_1,
+            &t_Wcq_1, &t_Wck_1, &t_Wcv_1, &t_Wcp_1, &t_Wi_1,  &t_Wo_1};
+  }
+
+  virtual std::vector<at::Tensor> forward(
+      std::vector<at::Tensor> t_inp,
+      std::vector<at::Tensor> t_cache,
+      bool use_cache) override {
+    return this->template forward_common<CrossAttnDecoderLayer>(
+        t_inp, t_cache, use_cache);
+  }
+
+  // Attention of the decoder queries over the static encoder K/V, which are
+  // [B, Nkv, Se, H] as formatted by attn_format_kv, no causal masking
+  template <typename T>
+  at::Tensor cross_mha(
+      at::Tensor t_QL,
+      at::Tensor t_KL,
+      at::Tensor t_VL,
+      at::Tensor t_am) {
+    RECORD_SCOPE(mha, {t_QL, t_KL});
+    auto B = t_QL.size(0);
+    auto S = t_QL.size(1);
+    t_QL = t_QL.view({B, S, -1, H}).permute({0, 2, 1, 3}).contiguous();
+    auto Nq = t_QL.size(1);
+    auto t_CL = attn<T, T>(t_QL, t_KL, t_am, t_VL, false, true);
+    return t_CL.view({B, Nq, S, H})
+        .permute({0, 2, 1, 3})
+        .contiguous()
+        .view({B, S, Nq * H});
+  }
+
+  template <typename T>
+  std::vector<at::Tensor> _forward(
+      std::vector<at::Tensor>& t_inp,
+      std::vector<at::Tensor>& t_cache,
+      bool use_cache) {
+    auto t_HS = t_inp[0];
+    RECORD_SCOPE(pt_op, {t_HS});
+    auto t_am = t_inp[1];
+    auto t_enc_HS = t_inp[2]; // empty once cross K/V are cached
+    auto t_enc_am = t_inp[3];
+    auto B = t_HS.size(0);
+
+    std::vector<at::Tensor> t_self_cache;
+    at::Tensor t_cross_KL, t_cross_VL;
+    if (t_enc_HS.numel() == 0) {
+      int csz = t_cache.size();
+      TPP_ASSERT(csz >= 2, "Missing cross attention K/V in the cache\n");
+      t_self_cache.assign(t_cache.begin(), t_cache.end() - 2);
+      t_cross_KL = t_cache[csz - 2];
+      t_cross_VL = t_cache[csz - 1];
+    }
+
+    bool weight_reuse = check_weight_reuse(t_HS);
+
+    float scale = 1.0 / my_size;
+
+    auto t_Wq = this->t_Wq;
+    auto t_Wk = this->t_Wk;
+    auto t_Wv = this->t_Wv;
+    auto t_Wp = this->t_Wp;
+    auto t_Wcq = this->t_Wcq;
+    auto t_Wcp = this->t_Wcp;
+    auto t_Wi = this->t_Wi;
+    auto t_Wo = this->t_Wo;
+
+    if (weight_reuse && TPP_CACHE_REMAPPED_WEIGHTS) {
+      if (!first_token_remapped)
+        remap_for_first_token<T>();
+
+      t_Wq = this->t_Wq_1;
+      t_Wk = this->t_Wk_1;
+      t_Wv = this->t_Wv_1;
+      t_Wp = this->t_Wp_1;
+      t_Wcq = this->t_Wcq_1;
+      t_Wcp = this->t_Wcp_1;
+      t_Wi = this->t_Wi_1;
+      t_Wo = this->t_Wo_1;
+    }
+
+    wt_prefetcher.clear();
+    if (!weight_reuse)
+      wt_prefetcher.add(t_Wp);
+
+    auto qkv_gemm = GemmCaller<T>(SCOPE_ARG(qkv_gemm));
+    auto proj_gemm = GemmCaller<T>(SCOPE_ARG(proj_gemm));
+    auto i_gemm = GemmCaller<T>(SCOPE_ARG(i_gemm));
+    auto o_gemm = GemmCaller<T>(SCOPE_ARG(o_gemm));
+
+    if (t_enc_HS.numel() > 0) {
+      // Encoder K/V, computed only on the first call
+      auto t_Wck = this->t_Wck;
+      auto t_Wcv = this->t_Wcv;
+      if (check_weight_reuse(t_enc_HS) && TPP_CACHE_REMAPPED_WEIGHTS) {
+        if (!first_token_remapped)
+          remap_for_first_token<T>();
+        t_Wck = this->t_Wck_1;
+        t_Wcv = this->t_Wcv_1;
+      }
+      auto Be = t_enc_HS.size(0);
+      auto Se = t_enc_HS.size(1);
+      t_cross_KL = qkv_gemm(t_enc_HS, t_Wck, t_Bck);
+      t_cross_VL = qkv_gemm(t_enc_HS, t_Wcv, t_Bcv);
+      t_cross_KL =
+          t_cross_KL.view({Be, Se, -1, H}).permute({0, 2, 1, 3}).contiguous();
+      t_cross_VL =
+          t_cross_VL.view({Be, Se, -1, H}).permute({0, 2, 1, 3}).contiguous();
+      if (Be != B) {
+        // Encoder output not expanded for beams yet, done once as the
+        // expanded K/V are returned in the cache
+        TPP_ASSERT(B % Be == 0, "Batch mismatch with encoder K/V\n");
+        t_cross_KL = t_cross_KL.repeat_interleave(B / Be, 0);
+        t_cross_VL = t_cross_VL.repeat_interleave(B / Be, 0);
+      }
+      // Transposed K and VNNI V are cached so that decoding steps don't
+      // redo them over the whole encoder length
+      auto t_cross_kv = attn_format_kv<T>(t_cross_KL, t_cross_VL);
+      t_cross_KL = t_cross_kv[0];
+      t_cross_VL = t_cross_kv[1];
+    }
+    TPP_ASSERT(
+        t_cross_KL.size(0) == B, "Batch mismatch with cached encoder K/V\n");
+
+    auto t_res = t_HS;
+    if (do_layer_norm_before) {
+      t_HS = lyr_norm<T>(t_HS, t_G1, t_B1, eps);
+    }
+
+    at::Tensor t_QL, t_KL, t_VL;
+    if (FUSED_QKV_GEMM == 0) {
+      t_QL = qkv_gemm(t_HS, t_Wq, t_Bq);
+      t_KL = qkv_gemm(t_HS, t_Wk, t_Bk);
+      t_VL = qkv_gemm(t_HS, t_Wv, t_Bv);
+    } else {
+      auto t_qkv_outs =
+          fused_qkv_gemm<T>(t_HS, {t_Wq, t_Wk, t_Wv}, {t_Bq, t_Bk, t_Bv});
+      t_QL = t_qkv_outs[0];
+      t_KL = t_qkv_outs[1];
+      t_VL = t_qkv_outs[2];
+    }
+
+    auto outputs = self_mha<T>(t_QL, t_KL, t_VL, t_am, t_self_cache);
+
+    auto t_CL = outputs[0];
+    t_HS = proj_gemm(AddScalePostOp(t_res, scale), t_CL, t_Wp, t_Bp);
+
+    wt_prefetcher.clear();
+    if (!weight_reuse) {
+      wt_prefetcher.add(t_Wcq);
+      wt_prefetcher.add(t_Wcp);
+    }
+
+    if (my_size > 1) {
+      allreduce_and_prefetch(t_HS, &wt_prefetcher);
+    }
+
+    if (!do_layer_norm_before) {
+      t_HS = lyr_norm<T>(t_HS, t_G1, t_B1, eps);
+    }
+
+    t_res = t_HS;
+    if (do_layer_norm_before) {
+      t_HS = lyr_norm<T>(t_HS, t_G2, t_B2, eps);
+    }
+
+    t_QL = qkv_gemm(t_HS, t_Wcq, t_Bcq);
+    t_CL = cross_mha<T>(t_QL, t_cross_KL, t_cross_VL, t_enc_am);
+    t_HS = proj_gemm(AddScalePostOp(t_res, scale), t_CL, t_Wcp, t_Bcp);
+
+    wt_prefetcher.clear();
+    if (!weight_reuse)
+      wt_prefetcher.add(t_Wi);
+
+    if (my_size > 1) {
+      allreduce_and_prefetch(t_HS, &wt_prefetcher);
+    }
+
+    if (!do_layer_norm_before) {
+      t_HS = lyr_norm<T>(t_HS, t_G2, t_B2, eps);
+    }
+
+    t_res = t_HS;
+    if (do_layer_norm_before) {
+      t_HS = lyr_norm<T>(t_HS, t_G3, t_B3, eps);
+    }
+
+    if (act_gelu) {
+      t_HS = i_gemm(GeluPostOp(), t_HS, t_Wi, t_Bi);
+    } else {
+      t_HS = i_gemm(ReluPostOp(), t_HS, t_Wi, t_Bi);
+    }
+    t_HS = o_gemm(AddScalePostOp(t_res, scale), t_HS, t_Wo, t_Bo);
+
+    if (my_size > 1) {
+      allreduce(t_HS);
+    }
+
+    if (!do_layer_norm_before) {
+      t_HS = lyr_norm<T>(t_HS, t_G3, t_B3, eps);
+    }
+
+    outputs[0] = t_HS;
+
+    if (use_cache) {
+      outputs.push_back(t_cross_KL);
+      outputs.push_back(t_cross_VL);
+      return outputs;
+    } else {
+      return {t_HS};
+    }
+  }
+};
+
 struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
  public:
   at::Tensor t_Wq, t_Wk, t_Wv, t_Wp;
@@ -2750,6 +5115,13 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
   float eps;
   long Nq, Nkv, H;
   long max_positions, rotary_dim;
+  // Rotary scaling for on the fly rotary embedding
+  std::string rope_type;
+  float rope_theta, rope_factor, rope_mscale;
+  long rope_orig_max_pos;
+  float rope_beta_fast, rope_beta_slow;
+  // Per layer low rank adapters keyed by projection name
+  std::unordered_map<std::string, LoRAWeights> lora_weights;
 
   LlamaDecoderLayer(
       std::vector<at::Tensor> params,
@@ -2776,7 +5148,14 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
     t_Wu = params[i++]; // fc_up
     t_Wd = params[i++]; // fc_down
 
-    t_EP = params[i++]; // embed_positions
+    t_EP = params[i++]; // embed_positions, empty for on the fly rotary
+    if (t_EP.numel() > 0) {
+      rope_style = ROPE_LLAMA;
+      t_rope_EP = t_EP;
+    } else {
+      rope_style = ROPE_LLAMA_OTF;
+      set_rope_scaling("default", 10000.0, 1.0, max_positions, 32.0, 1.0);
+    }
 
     if (USE_MXFP4) {
       if (t_Wq.dtype() == at::kBFloat16) {
@@ -2791,6 +5170,19 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
       t_Wg = remap_and_quantize_mxfp4(t_Wg);
       t_Wu = remap_and_quantize_mxfp4(t_Wu);
       t_Wd = remap_and_quantize_mxfp4(t_Wd);
+    } else if (SPARSE_WT_FORMAT) {
+      if (t_Wq.dtype() == at::kBFloat16) {
+        remap_for_first_token<bfloat16>();
+      } else {
+        remap_for_first_token<float>();
+      }
+      t_Wq = sparsify_wt(t_Wq, SPARSE_WT_FORMAT);
+      t_Wk = sparsify_wt(t_Wk, SPARSE_WT_FORMAT);
+      t_Wv = sparsify_wt(t_Wv, SPARSE_WT_FORMAT);
+      t_Wp = sparsify_wt(t_Wp, SPARSE_WT_FORMAT);
+      t_Wg = sparsify_wt(t_Wg, SPARSE_WT_FORMAT);
+      t_Wu = sparsify_wt(t_Wu, SPARSE_WT_FORMAT);
+      t_Wd = sparsify_wt(t_Wd, SPARSE_WT_FORMAT);
     }
 
     Nq = t_Wq.size(0) * t_Wq.size(3) / H;
@@ -2802,6 +5194,116 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
     }
   }
 
+  // Configures on the fly rotary embedding (no embed_positions table), type
+  // is one of default, linear, ntk, dynamic (NTK) or yarn
+  void set_rope_scaling(
+      std::string type,
+      double theta,
+      double factor,
+      long orig_max_pos,
+      double beta_fast,
+      double beta_slow) {
+    TPP_ASSERT(
+        rope_style == ROPE_LLAMA_OTF,
+        "Rotary scaling requires an empty embed_positions table\n");
+    TPP_ASSERT(
+        type == "default" || type == "linear" || type == "ntk" ||
+            type == "dynamic" || type == "yarn",
+        "Unsupported rope scaling type %s\n",
+        type.c_str());
+    // Cached keys are re-rotated by a fixed shift when the window slides,
+    // which doesn't hold for frequencies that change with the length
+    TPP_ASSERT(
+        type != "dynamic" || KV_WINDOW_SIZE == 0,
+        "Dynamic rope scaling is not supported with KV_WINDOW_SIZE\n");
+    rope_type = type;
+    rope_theta = theta;
+    rope_factor = factor;
+    rope_orig_max_pos = orig_max_pos;
+    rope_beta_fast = beta_fast;
+    rope_beta_slow = beta_slow;
+    rope_mscale = 1.0;
+    if (type == "yarn" && factor > 1.0)
+      rope_mscale = 0.1 * std::log(factor) + 1.0;
+    rope_inv_freq = compute_rope_inv_freq(0);
+  }
+
+  // Sets stacked adapters for one projection (q, k, v, o, gate, up or
+  // down), A: [nA, C, r], B: [nA, r, K], scale: [nA]. Empty A removes them.
+  void set_lora(
+      std::string name,
+      at::Tensor t_A,
+      at::Tensor t_B,
+      at::Tensor t_scale) {
+    TPP_ASSERT(
+        name == "q" || name == "k" || name == "v" || name == "o" ||
+            name == "gate" || name == "up" || name == "down",
+        "Unknown LoRA target %s\n",
+        name.c_str());
+    if (t_A.numel() == 0) {
+      lora_weights.erase(name);
+    } else {
+      lora_weights[name] = make_lora_weights(t_A, t_B, t_scale);
+    }
+  }
+
+  // Inverse frequencies for sequences of seq_len tokens, only dynamic NTK
+  // depends on it. Returned by value as blocks may run from several threads.
+  std::vector<float> compute_rope_inv_freq(long seq_len) {
+    long dim = rotary_dim;
+    float base = rope_theta;
+    if (rope_type == "ntk") {
+      base = rope_theta * std::pow(rope_factor, (float)dim / (dim - 2));
+    } else if (rope_type == "dynamic" && seq_len > rope_orig_max_pos) {
+      base = rope_theta *
+          std::pow(rope_factor * seq_len / rope_orig_max_pos -
+                       (rope_factor - 1),
+                   (float)dim / (dim - 2));
+    }
+    std::vector<float> inv_freq(dim / 2);
+    for (long i = 0; i < dim / 2; i++) {
+      inv_freq[i] = 1.0f / std::pow(base, (float)(2 * i) / dim);
+    }
+    if (rope_type == "linear") {
+      for (auto& f : inv_freq)
+        f /= rope_factor;
+    } else if (rope_type == "yarn") {
+      // Interpolate low frequencies, extrapolate high ones with a linear
+      // ramp in between
+      auto correction_dim = [&](float num_rot) {
+        return dim * std::log(rope_orig_max_pos / (num_rot * 2 * M_PI)) /
+            (2 * std::log(base));
+      };
+      float low = std::max(std::floor(correction_dim(rope_beta_fast)), 0.0f);
+      float high =
+          std::min(std::ceil(correction_dim(rope_beta_slow)), dim - 1.0f);
+      if (low == high)
+        high += 0.001f;
+      for (long i = 0; i < dim / 2; i++) {
+        float ramp = std::min(std::max((i - low) / (high - low), 0.0f), 1.0f);
+        float extrapolation = 1.0f - ramp;
+        float f = inv_freq[i];
+        inv_freq[i] =
+            f / rope_factor * (1.0f - extrapolation) + f * extrapolation;
+      }
+    }
+    return inv_freq;
+  }
+
+  template <typename T>
+  void rotary(
+      at::Tensor& t_in,
+      at::Tensor& t_pid,
+      long N,
+      const std::vector<float>& inv_freq) {
+    if (rope_style == ROPE_LLAMA) {
+      apply_rotary_pos_emb_llama<T>(t_in, t_EP, t_pid, N, H);
+    } else {
+      apply_rotary_pos_emb_llama_otf<T>(
+          t_in, inv_freq, rope_mscale, t_pid, N, H);
+    }
+  }
+
   template <typename Tw>
   void remap_for_first_token() {
     auto dtype = c10::CppTypeToScalarType<Tw>::value;
@@ -2815,6 +5317,13 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
     first_token_remapped = true;
   }
 
+  virtual std::vector<at::Tensor*> weight_tensors() override {
+    remap_for_sharing(this);
+    return {&t_Gi,   &t_Wq,   &t_Wk,   &t_Wv,   &t_Wp,   &t_Gpa,
+            &t_Wg,   &t_Wu,   &t_Wd,   &t_EP,   &t_Wq_1, &t_Wk_1,
+            &t_Wv_1, &t_Wp_1, &t_Wg_1, &t_Wu_1, &t_Wd_1};
+  }
+
   virtual std::vector<at::Tensor> forward(
       std::vector<at::Tensor> t_inp,
       std::vector<at::Tensor> t_cache,
@@ -2831,7 +5340,7 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
     auto t_HS = t_inp[0];
     RECORD_SCOPE(pt_op, {t_HS});
     auto t_am = t_inp[1];
-    auto t_pid = t_inp[2];
+    auto t_pid = cache_positions(t_inp[2], t_cache);
 
     bool weight_reuse = check_weight_reuse(t_HS);
 
@@ -2858,8 +5367,30 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
       t_Wd = this->t_Wd_1;
     }
 
+    wt_prefetcher.clear();
+    if (!weight_reuse)
+      wt_prefetcher.add(t_Wp);
+
+    std::vector<float> dyn_inv_freq;
+    if (rope_style == ROPE_LLAMA_OTF && rope_type == "dynamic") {
+      dyn_inv_freq = compute_rope_inv_freq(t_pid.max().item<long>() + 1);
+    }
+    auto& inv_freq = dyn_inv_freq.empty() ? rope_inv_freq : dyn_inv_freq;
+
     auto t_null = t_HS.new_empty({0});
     auto t_res = t_HS;
+
+    // Adapter id per token row, inputs[3] when adapters are loaded
+    at::Tensor t_lora_ids;
+    if (!lora_weights.empty() && t_inp.size() > 3 && t_inp[3].numel() > 0)
+      t_lora_ids = lora_row_ids(t_inp[3], t_HS);
+    auto lora = [&](const std::string& name) -> LoRAWeights* {
+      auto it = lora_weights.find(name);
+      if (!t_lora_ids.defined() || it == lora_weights.end())
+        return nullptr;
+      return &it->second;
+    };
+
     t_HS = llama_rms_norm<T>(t_HS, t_Gi, eps);
 
     auto qkv_gemm = GemmCaller<T>(SCOPE_ARG(qkv_gemm));
@@ -2868,45 +5399,69 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
     auto o_gemm = GemmCaller<T>(SCOPE_ARG(o_gemm));
 
     at::Tensor t_QL, t_KL, t_VL;
-    if (FUSED_QKV_GEMM == 0) {
-      t_QL = qkv_gemm(t_HS, t_Wq, t_null);
-      apply_rotary_pos_emb_llama<T>(t_QL, t_EP, t_pid, Nq, H);
-
-      t_KL = qkv_gemm(t_HS, t_Wk, t_null);
-      apply_rotary_pos_emb_llama<T>(t_KL, t_EP, t_pid, Nkv, H);
-
-      t_VL = qkv_gemm(t_HS, t_Wv, t_null);
+    bool qkv_lora = lora("q") || lora("k") || lora("v");
+    if (FUSED_QKV_GEMM == 0 || qkv_lora) {
+      t_QL = qkv_gemm(
+          lora_op(t_HS, lora("q"), t_lora_ids), t_HS, t_Wq, t_null);
+      rotary<T>(t_QL, t_pid, Nq, inv_freq);
+
+      t_KL = qkv_gemm(
+          lora_op(t_HS, lora("k"), t_lora_ids), t_HS, t_Wk, t_null);
+      rotary<T>(t_KL, t_pid, Nkv, inv_freq);
+
+      t_VL = qkv_gemm(
+          lora_op(t_HS, lora("v"), t_lora_ids), t_HS, t_Wv, t_null);
     } else {
       auto t_qkv_outs =
           fused_qkv_gemm<T>(t_HS, {t_Wq, t_Wk, t_Wv}, {t_null, t_null, t_null});
       t_QL = t_qkv_outs[0];
       t_KL = t_qkv_outs[1];
       t_VL = t_qkv_outs[2];
-      apply_rotary_pos_emb_llama<T>(t_QL, t_EP, t_pid, Nq, H);
-      apply_rotary_pos_emb_llama<T>(t_KL, t_EP, t_pid, Nkv, H);
+      rotary<T>(t_QL, t_pid, Nq, inv_freq);
+      rotary<T>(t_KL, t_pid, Nkv, inv_freq);
     }
 
     auto outputs = self_mha<T>(t_QL, t_KL, t_VL, t_am, t_cache);
 
     auto t_CL = outputs[0];
 
-    auto t_SO = proj_gemm(AddScalePostOp(t_res, scale), t_CL, t_Wp, t_null);
+    auto t_SO = proj_gemm(
+        lora_op(t_CL, lora("o"), t_lora_ids, AddScalePostOp(t_res, scale)),
+        t_CL,
+        t_Wp,
+        t_null);
+
+    wt_prefetcher.clear();
+    if (!weight_reuse) {
+      wt_prefetcher.add(t_Wg);
+      wt_prefetcher.add(t_Wu);
+    }
 
     if (my_size > 1) {
-      allreduce(t_SO);
+      allreduce_and_prefetch(t_SO, &wt_prefetcher);
     }
 
     t_res = t_SO;
 
     t_HS = llama_rms_norm<T>(t_SO, t_Gpa, eps);
 
-    auto t_I = i_gemm(SiluPostOp(), t_HS, t_Wg, t_null);
-    t_I = i_gemm(MulPostOp(t_I), t_HS, t_Wu, t_null);
-    auto t_Out = o_gemm(AddScalePostOp(t_res, scale), t_I, t_Wd, t_null);
-
-    if (my_size > 1) {
-      allreduce(t_Out);
-    }
+    auto t_I = i_gemm(
+        lora_op(t_HS, lora("gate"), t_lora_ids, SiluPostOp()),
+        t_HS,
+        t_Wg,
+        t_null);
+    t_I = i_gemm(
+        lora_op(t_HS, lora("up"), t_lora_ids, MulPostOp(t_I)),
+        t_HS,
+        t_Wu,
+        t_null);
+    auto t_Out = o_gemm(
+        lora_op(t_I, lora("down"), t_lora_ids, AddScalePostOp(t_res, scale)),
+        t_I,
+        t_Wd,
+        t_null,
+        allreduce_buffer(t_res));
+    t_Out = allreduce_staged(t_Out);
 
     outputs[0] = t_Out;
 
@@ -2918,6 +5473,141 @@ struct __attribute__((visibility("hidden"))) LlamaDecoderLayer : LLMBlock {
   }
 };
 
+// Runs a stack of blocks over its own KV caches on a dedicated thread with
+// its own OpenMP team, so that two stacks (e.g. the draft and target models
+// of speculative decoding) make progress concurrently. Inputs are those of
+// the blocks ([HS, am, pid, ...]) and the result is the last hidden state.
+class BlockStackRunner {
+ public:
+  BlockStackRunner(
+      std::vector<c10::intrusive_ptr<LLMBlock>> blocks,
+      std::vector<long> cores)
+      : blocks(blocks) {
+    reset();
+    worker = std::thread([this, cores]() { this->worker_loop(cores); });
+  }
+
+  ~BlockStackRunner() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  void launch(std::vector<at::Tensor> inputs) {
+    std::lock_guard<std::mutex> lock(mtx);
+    TPP_ASSERT(!busy, "BlockStackRunner: previous launch not waited for\n");
+    job = inputs;
+    busy = true;
+    done = false;
+    cv.notify_all();
+  }
+
+  bool ready() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return !busy || done;
+  }
+
+  at::Tensor wait() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this] { return !busy || done; });
+    busy = false;
+    if (error) {
+      auto e = error;
+      error = nullptr;
+      std::rethrow_exception(e);
+    }
+    return result;
+  }
+
+  // Tokens held in the KV caches
+  long length() {
+    std::lock_guard<std::mutex> lock(mtx);
+    TPP_ASSERT(!busy, "BlockStackRunner: busy\n");
+    return caches[0][3].item<long>();
+  }
+
+  // Drops cached tokens beyond len, e.g. rejected speculative tokens. The
+  // attention only reads up to the offset so the stale entries are simply
+  // overwritten later.
+  void rollback(long len) {
+    std::lock_guard<std::mutex> lock(mtx);
+    TPP_ASSERT(!busy, "BlockStackRunner: busy\n");
+    for (auto& c : caches) {
+      TPP_ASSERT(len <= c[3].item<long>(), "Can't roll forward\n");
+      c[3] = at::full({}, len, at::kLong);
+    }
+  }
+
+  void reset() {
+    TPP_ASSERT(!busy, "BlockStackRunner: busy\n");
+    // Start from empty indirect caches so the blocks allocate them with
+    // KV_CACHE_INC_SIZE headroom on the first call
+    auto t_dummy = at::empty({0});
+    auto t_offset = at::zeros({}, at::kLong);
+    caches.assign(
+        blocks.size(), {t_dummy, t_dummy, t_dummy, t_offset, t_dummy, t_dummy});
+  }
+
+ private:
+  void worker_loop(std::vector<long> cores) {
+    set_thread_team(cores);
+    at::NoGradGuard no_grad;
+    while (true) {
+      std::vector<at::Tensor> inputs;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return stop || (busy && !done); });
+        if (stop)
+          return;
+        inputs = job;
+      }
+      at::Tensor t_out;
+      std::exception_ptr err = nullptr;
+      try {
+        for (size_t i = 0; i < blocks.size(); i++) {
+          auto outputs = blocks[i]->forward(inputs, caches[i], true);
+          inputs[0] = outputs[0];
+          caches[i] =
+              std::vector<at::Tensor>(outputs.begin() + 1, outputs.end());
+        }
+        t_out = inputs[0];
+      } catch (...) {
+        err = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        result = t_out;
+        error = err;
+        done = true;
+      }
+      cv.notify_all();
+    }
+  }
+
+  std::vector<c10::intrusive_ptr<LLMBlock>> blocks;
+  std::vector<std::vector<at::Tensor>> caches;
+  std::thread worker;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<at::Tensor> job;
+  at::Tensor result;
+  std::exception_ptr error = nullptr;
+  bool busy = false;
+  bool done = false;
+  bool stop = false;
+};
+
+// Blocks are created through torch.classes, get at the C++ object behind
+// the script object
+static c10::intrusive_ptr<LLMBlock> to_llm_block(py::object obj) {
+  auto ivalue = py::cast<torch::jit::Object>(obj)._ivalue();
+  auto capsule = ivalue->getSlot(0).toCapsule();
+  return c10::static_intrusive_pointer_cast<LLMBlock>(capsule);
+}
+
 static at::Tensor fc_plain_wrap(
     at::Tensor t_in,
     at::Tensor t_wt,
@@ -2967,35 +5657,135 @@ static at::Tensor fc_plain_wrap(
 REGISTER_SUBMODULE(_fused_llm_infer, m) {
   m.def("fc_plain", &fc_plain_wrap, "TPP fc_plain");
   m.def("set_pg", &set_pg);
+  m.def("set_node_pgs", &set_node_pgs);
   m.def("allreduce", &allreduce);
+  m.def("allreduce_async", &allreduce_async);
+  m.def("allgather", [](at::Tensor t_in, std::vector<long> split_sizes) {
+    return allgather(t_in, split_sizes);
+  });
+  m.def("reduce_scatter", &reduce_scatter);
+  m.def("broadcast", &broadcast);
+  m.def("shm_barrier_stats", &shm_barrier_stats, py::arg("reset") = false);
+  m.def("set_shm_buffer_size", &shm_set_buffer_size);
   m.def("remap_indices", &remap_indices);
   m.def("get_batch_dim_in_kv_cache", &get_batch_dim_in_kv_cache);
+  m.def("set_thread_team", &set_thread_team);
+  m.def("get_pg_size", []() { return my_size; });
+  py::class_<SHMQueue>(m, "SHMQueue")
+      .def(py::init<std::string, long, long>())
+      .def(
+          "send",
+          &SHMQueue::send,
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "recv",
+          &SHMQueue::recv,
+          py::call_guard<py::gil_scoped_release>());
+  py::class_<BlockStackRunner>(m, "BlockStackRunner")
+      .def(py::init(
+          [](std::vector<py::object> blocks, std::vector<long> cores) {
+            std::vector<c10::intrusive_ptr<LLMBlock>> llm_blocks;
+            for (auto& b : blocks)
+              llm_blocks.push_back(to_llm_block(b));
+            return new BlockStackRunner(llm_blocks, cores);
+          }))
+      .def("launch", &BlockStackRunner::launch)
+      .def(
+          "wait",
+          &BlockStackRunner::wait,
+          py::call_guard<py::gil_scoped_release>())
+      .def("ready", &BlockStackRunner::ready)
+      .def("length", &BlockStackRunner::length)
+      .def("rollback", &BlockStackRunner::rollback)
+      .def("reset", &BlockStackRunner::reset);
   py::class_<LLMBlock>(m, "LLMBlock").def("forward", &LLMBlock::forward);
   py::class_<GPTJBlock>(m, "GPTJBlock")
       .def(py::init<std::vector<at::Tensor>, double, long, long, long>())
-      .def("forward", &GPTJBlock::forward);
+      .def(
+          "forward",
+          &GPTJBlock::forward,
+          py::call_guard<py::gil_scoped_release>())
+      .def("share_weights", &GPTJBlock::share_weights);
   py::class_<OPTDecoderLayer>(m, "OPTDecoderLayer")
       .def(py::init<std::vector<at::Tensor>, double, double, long, bool>())
-      .def("forward", &OPTDecoderLayer::forward);
+      .def(
+          "forward",
+          &OPTDecoderLayer::forward,
+          py::call_guard<py::gil_scoped_release>())
+      .def("share_weights", &OPTDecoderLayer::share_weights);
+  py::class_<CrossAttnDecoderLayer>(m, "CrossAttnDecoderLayer")
+      .def(py::init<std::vector<at::Tensor>, double, long, bool, std::string>())
+      .def(
+          "forward",
+          &CrossAttnDecoderLayer::forward,
+          py::call_guard<py::gil_scoped_release>())
+      .def("share_weights", &CrossAttnDecoderLayer::share_weights);
   py::class_<LlamaDecoderLayer>(m, "LlamaDecoderLayer")
       .def(py::init<std::vector<at::Tensor>, double, long, long, long>())
-      .def("forward", &LlamaDecoderLayer::forward);
+      .def(
+          "forward",
+          &LlamaDecoderLayer::forward,
+          py::call_guard<py::gil_scoped_release>())
+      .def("set_rope_scaling", &LlamaDecoderLayer::set_rope_scaling)
+      .def("set_lora", &LlamaDecoderLayer::set_lora)
+      .def("share_weights", &LlamaDecoderLayer::share_weights);
 }
 
 TORCH_LIBRARY(tpp_llm, m) {
   m.def("fc_plain", &fc_plain_wrap);
   m.def("set_pg", &set_pg);
   m.def("allreduce", &allreduce);
+  m.def("reduce_scatter", &reduce_scatter);
+  m.def("broadcast", &broadcast);
   m.def("remap_indices", &remap_indices);
   m.def("get_batch_dim_in_kv_cache", &get_batch_dim_in_kv_cache);
+  m.def("set_thread_team", &set_thread_team);
   m.class_<LLMBlock>("LLMBlock").def("forward", &LLMBlock::forward);
   m.class_<GPTJBlock>("GPTJBlock")
       .def(torch::init<std::vector<at::Tensor>, double, long, long, long>())
-      .def("forward", &GPTJBlock::forward);
+      .def("forward", &GPTJBlock::forward)
+      .def(
+          "share_weights",
+          [](const c10::intrusive_ptr<GPTJBlock>& self,
+             std::string tag,
+             std::string checkpoint) {
+            return self->share_weights(tag, checkpoint);
+          });
   m.class_<OPTDecoderLayer>("OPTDecoderLayer")
       .def(torch::init<std::vector<at::Tensor>, double, double, long, bool>())
-      .def("forward", &OPTDecoderLayer::forward);
+      .def("forward", &OPTDecoderLayer::forward)
+      .def(
+          "share_weights",
+          [](const c10::intrusive_ptr<OPTDecoderLayer>& self,
+             std::string tag,
+             std::string checkpoint) {
+            return self->share_weights(tag, checkpoint);
+          });
+  m.class_<CrossAttnDecoderLayer>("CrossAttnDecoderLayer")
+      .def(torch::init<
+           std::vector<at::Tensor>,
+           double,
+           long,
+           bool,
+           std::string>())
+      .def("forward", &CrossAttnDecoderLayer::forward)
+      .def(
+          "share_weights",
+          [](const c10::intrusive_ptr<CrossAttnDecoderLayer>& self,
+             std::string tag,
+             std::string checkpoint) {
+            return self->share_weights(tag, checkpoint);
+          });
   m.class_<LlamaDecoderLayer>("LlamaDecoderLayer")
       .def(torch::init<std::vector<at::Tensor>, double, long, long, long>())
-      .def("forward", &LlamaDecoderLayer::forward);
+      .def("forward", &LlamaDecoderLayer::forward)
+      .def("set_rope_scaling", &LlamaDecoderLayer::set_rope_scaling)
+      .def("set_lora", &LlamaDecoderLayer::set_lora)
+      .def(
+          "share_weights",
+          [](const c10::intrusive_ptr<LlamaDecoderLayer>& self,
+             std::string tag,
+             std::string checkpoint) {
+            return self->share_weights(tag, checkpoint);
+          });
 }
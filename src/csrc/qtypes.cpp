@@ -21,6 +21,7 @@
 #include "qtypes.h"
 #include "utils.h"
 #include "vla.h"
+#include "xsmm_functors.h"
 
 template <typename TIN>
 struct MxFP4Quant {
@@ -251,8 +252,114 @@ Tensor& PerBlockMxFPQuantizer::dequantize_out(
   return rtensor;
 }
 
+Tensor PerChannelInt8Quantizer::quantize(const Tensor& rtensor) {
+  Tensor qtensor = new_qtensor(
+      q_sizes(),
+      rtensor.options().dtype(scalar_type_),
+      intrusive_from_this());
+  auto Nk = q_sizes_[0];
+  auto Nc = q_sizes_[1];
+  auto Hc = q_sizes_[2] * 4;
+  auto Hk = q_sizes_[3];
+  // Bring VNNI packed input back to [Nk, Nc, Hc, Hk]
+  auto t_in = rtensor.to(kFloat);
+  if (t_in.dim() == 5)
+    t_in = t_in.permute({0, 1, 2, 4, 3});
+  t_in = t_in.reshape({Nk, Nc, Hc, Hk}).contiguous();
+  auto in = GetVLAPtr<float>(t_in, {Nc, Hc, Hk});
+  auto t_rscl = at::empty({Nk, Hk}, kFloat);
+  auto scl = GetVLAPtr<float>(scales_, {Hk});
+  auto rscl = GetVLAPtr<float>(t_rscl, {Hk});
+  auto out = GetVLAPtr<int8_t>(qtensor, {Nc, Hc / 4, Hk, 4});
+
+  // Channel scales from the absolute max over the rows of each block
+#pragma omp parallel for
+  for (int nk = 0; nk < Nk; nk++) {
+    float max[Hk];
+    std::fill_n(max, Hk, 0.0f);
+    for (int nc = 0; nc < Nc; nc++) {
+      for (int c = 0; c < Hc; c++) {
+#pragma omp simd
+        for (int hk = 0; hk < Hk; hk++)
+          max[hk] = std::max(max[hk], fabsf(in[nk][nc][c][hk]));
+      }
+    }
+    for (int hk = 0; hk < Hk; hk++) {
+      float scale = max[hk] > 0.0f ? max[hk] / 127.0f : 1.0f;
+      scl[nk][hk] = scale;
+      rscl[nk][hk] = 1.0f / scale;
+    }
+  }
+
+  auto mul_tpp = MulTPP<float, float>(Hk);
+#pragma omp parallel for collapse(2)
+  for (int nk = 0; nk < Nk; nk++) {
+    for (int nc = 0; nc < Nc; nc++) {
+      float tmp[Hk];
+      for (int c = 0; c < Hc; c++) {
+        mul_tpp(in[nk][nc][c], rscl[nk], tmp);
+#pragma omp simd
+        for (int hk = 0; hk < Hk; hk++) {
+          float val =
+              std::min(std::max(std::nearbyint(tmp[hk]), -127.0f), 127.0f);
+          out[nk][nc][c / 4][hk][c % 4] = (int8_t)val;
+        }
+      }
+    }
+  }
+  return qtensor;
+}
+
+Tensor PerChannelInt8Quantizer::dequantize(const Tensor& qtensor) {
+  Tensor rtensor =
+      at::empty(qtensor.sizes(), qtensor.options().dtype(at::kFloat));
+  return dequantize_out(rtensor, qtensor);
+}
+
+Tensor& PerChannelInt8Quantizer::dequantize_out(
+    Tensor& rtensor,
+    const Tensor& qtensor) {
+  rtensor.resize_(qtensor.sizes());
+  TORCH_CHECK(
+      rtensor.is_contiguous() && rtensor.scalar_type() == kFloat,
+      "Dequantize out should be a contiguous Float Tensor; instead got type ",
+      rtensor.scalar_type());
+  auto Nk = q_sizes_[0];
+  auto Nc = q_sizes_[1];
+  auto Hc4 = q_sizes_[2];
+  auto Hk = q_sizes_[3];
+  auto in = GetVLAPtr<int8_t>(qtensor, {Nc, Hc4, Hk, 4});
+  auto scl = GetVLAPtr<float>(scales_, {Hk});
+  auto out = GetVLAPtr<float>(rtensor, {Nc, Hc4, Hk, 4});
+
+#pragma omp parallel for collapse(2)
+  for (int nk = 0; nk < Nk; nk++) {
+    for (int nc = 0; nc < Nc; nc++) {
+      for (int c = 0; c < Hc4; c++) {
+        for (int hk = 0; hk < Hk; hk++) {
+          for (int v = 0; v < 4; v++) {
+            out[nk][nc][c][hk][v] = in[nk][nc][c][hk][v] * scl[nk][hk];
+          }
+        }
+      }
+    }
+  }
+  return rtensor;
+}
+
 } // namespace at
 
+at::Tensor quantize_int8_per_channel(const at::Tensor& self) {
+  auto quantizer = c10::make_intrusive<at::PerChannelInt8Quantizer>(self);
+  return quantizer->quantize(self);
+}
+
+at::Tensor q_per_channel_int8_scales(const at::Tensor& self) {
+  auto quantizer = at::get_qtensorimpl(self)->quantizer();
+  TORCH_CHECK(quantizer->qscheme() == at::kPerChannelInt8);
+  return static_cast<at::PerChannelInt8Quantizer*>(quantizer.get())->scales();
+}
+
 at::Tensor quantize_mxfp_(
     const at::Tensor& self,
     int64_t block_size,
@@ -325,4 +432,6 @@ REGISTER_SUBMODULE(_qtype, m) {
   m.def("q_per_block_block_size", &q_per_block_block_size);
   m.def("q_per_block_axis", &q_per_block_axis);
   m.def("q_get_ptr", &q_get_ptr);
+  m.def("quantize_int8_per_channel", &quantize_int8_per_channel);
+  m.def("q_per_channel_int8_scales", &q_per_channel_int8_scales);
 }
@@ -10,6 +10,7 @@ namespace at {
 // TODO: reusing unused QScheme here, fix it later
 constexpr auto kPerBlockAffine = kPerTensorSymmetric;
 constexpr auto kPerBlockMxFP = kPerChannelSymmetric;
+constexpr auto kPerChannelInt8 = kPerChannelAffineFloatQParams;
 
 inline int64_t get_elements_per_byte(at::ScalarType t) {
   // NOLINTNEXTLINE(cppcoreguidelines-init-variables)
@@ -270,8 +271,53 @@ struct TORCH_API PerBlockMxFPQuantizer : public at::PerBlockQuantizer {
   const bool is_vnni_;
 };
 
+// Symmetric int8 with one float scale per output channel. Takes a blocked
+// weight [Nk, Nc, Hc, Hk] or [Nk, Nc, Hc/V, Hk, V] and produces the VNNI4
+// layout [Nk, Nc, Hc/4, Hk, 4] used by int8 brgemm, scales are [Nk, Hk]
+struct TORCH_API PerChannelInt8Quantizer : public Quantizer {
+  explicit PerChannelInt8Quantizer(const Tensor& t_in) : Quantizer(kQInt8) {
+    auto sizes = t_in.sizes();
+    TPP_ASSERT(
+        t_in.dim() == 4 || t_in.dim() == 5, "Expected blocked weight\n");
+    auto Hc = sizes[2] * (t_in.dim() == 5 ? sizes[4] : 1);
+    TPP_ASSERT(Hc % 4 == 0, "Shape not compatible for VNNI4\n");
+    q_sizes_ = {sizes[0], sizes[1], Hc / 4, sizes[3], 4};
+    scales_ = t_in.new_empty({sizes[0], sizes[3]}, kFloat);
+  }
+
+  QScheme qscheme() const override {
+    return kPerChannelInt8;
+  }
+
+  Tensor scales() const {
+    return scales_;
+  }
+
+  IntArrayRef q_sizes() const {
+    return IntArrayRef(q_sizes_.data(), q_sizes_.size());
+  }
+
+  Tensor quantize(const Tensor& tensor) override;
+  Tensor dequantize(const Tensor& qtensor) override;
+  Tensor& dequantize_out(Tensor& rtensor, const Tensor& qtensor) override;
+
+  bool equalTo(QuantizerPtr other) const override {
+    if (!other.get() || other->qscheme() != kPerChannelInt8) {
+      return false;
+    }
+    auto* other_int8 = static_cast<PerChannelInt8Quantizer*>(other.get());
+    return scales().equal(other_int8->scales());
+  }
+
+ protected:
+  std::vector<int64_t> q_sizes_;
+  Tensor scales_;
+};
+
 } // namespace at
 
+at::Tensor quantize_int8_per_channel(const at::Tensor& self);
+
 at::Tensor quantize_mxfp4(
     const at::Tensor& self,
     int64_t block_size,
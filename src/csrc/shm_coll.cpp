@@ -9,8 +9,25 @@
  ******************************************************************************/
 
 #include "shm_coll.h"
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <omp.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
 #include "utils.h"
 #include "xsmm_functors.h"
 
@@ -20,6 +37,27 @@ static const long TPP_SHM_BUF_SIZE =
 // Using master port to distinguist multiple distributed instances for setting
 // up shared memory
 static const long master_port = env2int("MASTER_PORT", 0);
+// Pause iterations a rank spins in the SHM barrier before sleeping on a futex
+static const long TPP_SHM_BARRIER_SPIN =
+    env2int("TPP_SHM_BARRIER_SPIN", 10000);
+// Format fp32 allreduce contributions are exchanged in: 0 - fp32, 1 - bf16,
+// 2 - fp8 e5m2, 3 - fp8 e4m3 (scaled per block). Accumulation stays in fp32.
+static const int TPP_SHM_WIRE_DTYPE = env2int("TPP_SHM_WIRE_DTYPE", 0);
+// Force an allreduce algorithm (see SHMBuffer::ALGO_*), -1 selects by size
+static const int TPP_SHM_ALLREDUCE_ALGO =
+    env2int("TPP_SHM_ALLREDUCE_ALGO", -1);
+// Time the allreduce algorithms of each dtype when the first buffer of a
+// group size is created and select by the measured crossovers, otherwise by
+// DIRECT_THRESHOLD
+static const int TPP_SHM_CALIB = env2int("TPP_SHM_CALIB", 1);
+static const long TPP_SHM_CALIB_MAX_BYTES =
+    env2int("TPP_SHM_CALIB_MAX_BYTES", 4 * 1024 * 1024);
+// Prefer the NUMA node of the owning rank for its SHM segment
+static const int TPP_SHM_NUMA = env2int("TPP_SHM_NUMA", 1);
+// Back SHM segments with 2MB huge pages, falls back to small pages
+static const int TPP_SHM_HUGETLB = env2int("TPP_SHM_HUGETLB", 0);
+// OpenMP team size of the helper thread running async collectives
+static const int TPP_SHM_ASYNC_THREADS = env2int("TPP_SHM_ASYNC_THREADS", 4);
 using namespace tpp;
 namespace shm_tpp {
 template <typename T, int S = BS>
@@ -50,65 +88,300 @@ TppOps<half> getOps<half>() {
 }
 } // namespace shm_tpp
 
+static void parallel_copy(void* dst, const void* src, size_t bytes) {
+  const size_t chunk = 256 * 1024;
+  long nChunks = (bytes + chunk - 1) / chunk;
+#pragma omp parallel for
+  for (long i = 0; i < nChunks; i++) {
+    size_t off = i * chunk;
+    memcpy(
+        (char*)dst + off, (const char*)src + off, std::min(chunk, bytes - off));
+  }
+}
+
+static inline long futex_wait(volatile int* addr, int val) {
+  return syscall(SYS_futex, (int*)addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static inline long futex_wake(volatile int* addr) {
+  return syscall(SYS_futex, (int*)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Time ranks spend waiting in SHMBuffer::barrier(), across all instances.
+// Updated by the calling threads and the async helper threads.
+static struct BarrierStats {
+  long calls = 0;
+  long sleeps = 0;
+  double total = 0.0;
+  double max = 0.0;
+  std::mutex mtx;
+
+  void add(double t, long nsleeps) {
+    std::lock_guard<std::mutex> lk(mtx);
+    calls++;
+    sleeps += nsleeps;
+    total += t;
+    max = std::max(max, t);
+  }
+} barrier_stats;
+
+// Runs the async collectives of one SHMBuffer in submission order on a
+// helper thread with its own OpenMP team of TPP_SHM_ASYNC_THREADS threads
+class SHMAsyncRunner {
+ public:
+  SHMAsyncRunner() : thread([this]() { loop(); }) {}
+
+  ~SHMAsyncRunner() {
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      stop = true;
+    }
+    cv.notify_one();
+    thread.join();
+  }
+
+  std::shared_future<void> submit(std::function<void()> fn) {
+    auto task = std::make_shared<std::packaged_task<void()>>(fn);
+    auto fut = task->get_future().share();
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      tasks.push_back(task);
+      pending++;
+    }
+    cv.notify_one();
+    return fut;
+  }
+
+  void drain() {
+    std::unique_lock<std::mutex> lk(mtx);
+    done_cv.wait(lk, [&]() { return pending == 0; });
+  }
+
+ private:
+  void loop() {
+    omp_set_num_threads(TPP_SHM_ASYNC_THREADS);
+    while (true) {
+      std::shared_ptr<std::packaged_task<void()>> task;
+      {
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, [&]() { return stop || !tasks.empty(); });
+        if (tasks.empty())
+          return;
+        task = tasks.front();
+        tasks.pop_front();
+      }
+      (*task)();
+      {
+        std::lock_guard<std::mutex> lk(mtx);
+        pending--;
+      }
+      done_cv.notify_all();
+    }
+  }
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable done_cv;
+  std::deque<std::shared_ptr<std::packaged_task<void()>>> tasks;
+  long pending = 0;
+  bool stop = false;
+  std::thread thread;
+};
+
+// Completion handle of an async SHM collective
+class SHMWork : public c10d::Work {
+ public:
+  SHMWork(
+      std::shared_future<void> fut,
+      c10::intrusive_ptr<c10::ivalue::Future> future,
+      at::Tensor t)
+      : c10d::Work(-1, c10d::OpType::ALLREDUCE),
+        fut(fut),
+        future(future),
+        t(t) {}
+
+  bool isCompleted() override {
+    return fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+
+  bool wait(std::chrono::milliseconds timeout) override {
+    if (timeout == c10d::kNoTimeout) {
+      fut.wait();
+    } else {
+      TPP_ASSERT(
+          fut.wait_for(timeout) == std::future_status::ready,
+          "SHM collective timed out\n");
+    }
+    fut.get();
+    return true;
+  }
+
+  std::vector<at::Tensor> result() override {
+    return {t};
+  }
+
+  // Completed with [t] by the helper thread, e.g. for DDP comm hooks
+  c10::intrusive_ptr<c10::ivalue::Future> getFuture() override {
+    return future;
+  }
+
+ private:
+  std::shared_future<void> fut;
+  c10::intrusive_ptr<c10::ivalue::Future> future;
+  at::Tensor t;
+};
+
+// Sense reversing barrier state. Ranks announce arrival in their own flag
+// line, rank 0 collects them and flips the sense the others are watching.
+// Waiting is bounded spinning followed by a futex sleep.
+struct BarrierShm {
+  struct alignas(64) Line {
+    volatile int v;
+  };
+  Line sense; // futex word for ranks waiting on release
+  Line sense_waiters;
+  Line arrive_seq; // futex word for rank 0 waiting on arrivals
+  Line master_waiting;
+  // Followed by one flag Line per rank
+
+  static size_t bytes(int nRanks) {
+    return sizeof(BarrierShm) + nRanks * sizeof(Line);
+  }
+  Line* flags() {
+    return (Line*)(this + 1);
+  }
+};
+
 class SHMBuffer {
  public:
-  static int SHMID;
-  static int BARID;
-  static const int MAX_RANKS = 64;
   static const int DIRECT_THRESHOLD = 32 * 1024;
   c10::intrusive_ptr<c10d::ProcessGroup> pg;
   int rank;
   int size;
   size_t bufsz;
-  int shmid[MAX_RANKS];
+  std::vector<int> shmid;
   int barid;
-  void* shm_data[MAX_RANKS];
-  void* scratch_data[MAX_RANKS];
+  std::vector<void*> shm_data;
+  std::vector<void*> scratch_data;
   void* bar_data;
-  volatile int* bar1;
-  volatile int* bar2;
+  BarrierShm* bar;
+  BarrierShm::Line* flags;
+  int local_sense = 0;
+  std::unique_ptr<SHMAsyncRunner> async_runner;
+  // NUMA node of each rank, and the order in which ranks read their peers:
+  // self, then same node peers, then the rest, each group starting after
+  // rank so that readers spread over the buffers
+  std::vector<int> numa_node;
+  std::vector<int> peers;
 
-  SHMBuffer(size_t bufsz_, c10::intrusive_ptr<c10d::ProcessGroup> pg) : pg(pg) {
-    bufsz = ((bufsz_ + 4095) / 4096) * 4096 * 2;
+  // Segment size for a staging size of sz, staging and scratch areas are
+  // page (huge page) aligned
+  static size_t segmentBytes(size_t sz) {
+    size_t pg_sz = TPP_SHM_HUGETLB ? 2 * 1024 * 1024 : 4096;
+    return ((sz + pg_sz - 1) / pg_sz) * pg_sz * 2;
+  }
+
+  static int currentNumaNode() {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+      return -1;
+    return node;
+  }
+
+  // Pages of a SysV segment follow its shared policy no matter which rank
+  // touches them first
+  static void bindToNode(void* addr, size_t len, int node) {
+    unsigned long mask[16] = {0};
+    if (node < 0 || node >= (int)(sizeof(mask) * 8))
+      return;
+    mask[node / 64] = 1UL << (node % 64);
+    if (syscall(
+            SYS_mbind, addr, len, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0))
+      printf("mbind of SHM buffer to node %d failed\n", node);
+  }
+
+  // Segments are created without a key and attached by id, the ids are
+  // exchanged over pg. Instances of different groups, models or jobs on
+  // one machine can't collide that way.
+  SHMBuffer(size_t bufsz_, c10::intrusive_ptr<c10d::ProcessGroup> pg)
+      : pg(pg) {
+    bufsz = segmentBytes(bufsz_);
     rank = pg->getRank();
     size = pg->getSize();
+    shmid.resize(size);
+    shm_data.resize(size);
+    scratch_data.resize(size);
     /* each process creates its own shared memory */
-    // printf("SHM At %d r: %d  s: %d\n", __LINE__, rank, size);
-    shmid[rank] = shmget(SHMID + rank, bufsz, IPC_CREAT | 0666);
+    int my_id = -1;
+    if (TPP_SHM_HUGETLB)
+      my_id = shmget(IPC_PRIVATE, bufsz, IPC_CREAT | SHM_HUGETLB | 0600);
+    if (my_id < 0)
+      my_id = shmget(IPC_PRIVATE, bufsz, IPC_CREAT | 0600);
     TPP_ASSERT(
-        shmid[rank] >= 0,
-        "shmid cannot create shared memory of size %lu\n",
-        bufsz);
+        my_id >= 0, "shmid cannot create shared memory of size %lu\n", bufsz);
+    int my_barid = -1;
     if (rank == 0) {
-      barid = shmget(BARID, 4096, IPC_CREAT | 0666);
-      TPP_ASSERT(barid >= 0, "barid cannot create shared memory");
+      my_barid =
+          shmget(IPC_PRIVATE, BarrierShm::bytes(size), IPC_CREAT | 0600);
+      TPP_ASSERT(my_barid >= 0, "barid cannot create shared memory");
     }
-    pg->barrier()->wait();
+    int my_node = TPP_SHM_NUMA ? currentNumaNode() : -1;
+    auto ids = exchange_ids({my_id, my_barid, my_node});
+    barid = ids[0][1];
     /* each process attaches itself with other processes */
     for (int i = 0; i < size; i++) {
-      if (i != rank)
-        shmid[i] = shmget(SHMID + i, bufsz, 0666);
-      TPP_ASSERT(shmid[i] >= 0, "shmid cannot get shared memory\n");
-    }
-    if (rank != 0) {
-      barid = shmget(BARID, 4096, IPC_CREAT | 0666);
-      TPP_ASSERT(barid >= 0, "barid cannot create shared memory\n");
-    }
-    for (int i = 0; i < size; i++) {
+      shmid[i] = ids[i][0];
+      numa_node.push_back(ids[i][2]);
       shm_data[i] = shmat(shmid[i], NULL, 0);
-      TPP_ASSERT(shm_data[i], "shmat failed\n");
+      TPP_ASSERT(shm_data[i] != (void*)-1, "shmat failed\n");
       scratch_data[i] = (void*)((char*)shm_data[i] + bufsz / 2);
     }
+    // Before anyone touches the segment
+    if (my_node >= 0)
+      bindToNode(shm_data[rank], bufsz, my_node);
+    for (int r = 0; r < size; r++)
+      peers.push_back((r + rank) % size);
+    std::stable_partition(peers.begin() + 1, peers.end(), [&](int r) {
+      return numa_node[r] == numa_node[rank];
+    });
     bar_data = shmat(barid, NULL, 0);
-    TPP_ASSERT(bar_data, "barat failed\n");
-    bar1 = (int*)bar_data;
-    *bar1 = 0;
-    bar2 = bar1 + 128;
-    *bar2 = 0;
+    TPP_ASSERT(bar_data != (void*)-1, "barat failed\n");
+    bar = (BarrierShm*)bar_data;
+    flags = bar->flags();
+    if (rank == 0)
+      memset(bar_data, 0, BarrierShm::bytes(size));
     pg->barrier()->wait();
     shmctl(shmid[rank], IPC_RMID, NULL);
-    shmctl(barid, IPC_RMID, NULL);
-    printf("Shm buffer allocated with size %lu\n", bufsz);
+    if (rank == 0)
+      shmctl(barid, IPC_RMID, NULL);
+    printf("Shm buffer allocated with size %lu on node %d\n", bufsz, my_node);
+    // Grid for GRID2D, cols the divisor of size closest to sqrt(size)
+    for (int c = 1; c * c <= size; c++) {
+      if (size % c == 0)
+        grid_cols = size / c;
+    }
+    if (TPP_SHM_ALLREDUCE_ALGO < 0 && TPP_SHM_CALIB) {
+      calibrate<float>();
+      calibrate<bfloat16>();
+      calibrate<half>();
+    }
+  }
+
+  // Allgather of a few ints per rank over pg
+  std::vector<std::vector<int>> exchange_ids(std::vector<int> mine) {
+    long n = mine.size();
+    auto t_in = at::tensor(mine, at::kInt);
+    std::vector<std::vector<at::Tensor>> t_out(1);
+    for (int i = 0; i < size; i++)
+      t_out[0].push_back(at::empty({n}, at::kInt));
+    std::vector<at::Tensor> t_in_vec = {t_in};
+    pg->allgather(t_out, t_in_vec)->wait();
+    std::vector<std::vector<int>> ret;
+    for (int i = 0; i < size; i++) {
+      auto p = t_out[0][i].data_ptr<int>();
+      ret.emplace_back(p, p + n);
+    }
+    return ret;
   }
 
   void cleanup_shm() {
@@ -120,52 +393,209 @@ class SHMBuffer {
   }
 
   ~SHMBuffer() {
+    async_runner.reset();
     cleanup_shm();
   }
 
+  std::shared_future<void> submitAsync(std::function<void()> fn) {
+    if (!async_runner)
+      async_runner.reset(new SHMAsyncRunner());
+    return async_runner->submit(fn);
+  }
+
+  // Collectives issued from the calling thread must not interleave with
+  // queued async ones on the same buffer
+  void drainAsync() {
+    if (async_runner)
+      async_runner->drain();
+  }
+
+  // Per group state. Holding the group keeps its address, the map key,
+  // from being reused by a later group.
+  struct GroupState {
+    c10::intrusive_ptr<c10d::ProcessGroup> pg;
+    size_t size_hint = 0; // see shm_set_buffer_size()
+    SHMBuffer* inst = nullptr;
+  };
+
+  static std::map<c10d::ProcessGroup*, GroupState>& groups() {
+    static std::map<c10d::ProcessGroup*, GroupState> states;
+    return states;
+  }
+
+  static std::mutex& groupsMutex() {
+    static std::mutex mtx;
+    return mtx;
+  }
+
+  static void setSizeHint(
+      c10::intrusive_ptr<c10d::ProcessGroup> pg,
+      size_t bytes) {
+    std::lock_guard<std::mutex> lk(groupsMutex());
+    auto& state = groups()[pg.get()];
+    state.pg = pg;
+    state.size_hint = bytes;
+  }
+
+  // One instance per process group, reallocated when the group asks for
+  // a different size. Creation is collective over the group, like the
+  // collectives leading to it. Unless called for an async collective,
+  // pending async collectives of the group are completed first.
   static SHMBuffer* getInst(
-      size_t sz,
-      c10::intrusive_ptr<c10d::ProcessGroup> pg) {
-    static size_t buf_sz = 0;
-    static SHMBuffer* inst = nullptr;
-
-    // TODO: check for same pg as well
-    if (buf_sz < sz) {
-      if (inst != nullptr) {
-        delete inst;
-        inst = nullptr;
-      }
+      c10::intrusive_ptr<c10d::ProcessGroup> pg,
+      bool drain = true) {
+    std::lock_guard<std::mutex> lk(groupsMutex());
+    auto& state = groups()[pg.get()];
+    state.pg = pg;
+    size_t sz = state.size_hint > 0 ? state.size_hint : TPP_SHM_BUF_SIZE;
+    size_t want = segmentBytes(sz);
+    auto& inst = state.inst;
+    if (inst != nullptr && (drain || inst->bufsz != want))
+      inst->drainAsync();
+    if (inst != nullptr &&
+        (inst->bufsz != want || inst->size != pg->getSize())) {
+      delete inst;
+      inst = nullptr;
+    }
+    if (inst == nullptr) {
       inst = new SHMBuffer(sz, pg);
       TPP_ASSERT(inst != nullptr, "Unable to create shm buffer\n");
-      buf_sz = sz;
     }
     return inst;
   }
 
+  // Spins for up to TPP_SHM_BARRIER_SPIN pauses until done() and then
+  // sleeps on the futex word, which the releasing side bumps or sets before
+  // waking the sleepers flagged in waiting
+  template <typename F>
+  long wait_until(F done, volatile int* word, volatile int* waiting) {
+    long sleeps = 0;
+    for (long i = 0; i < TPP_SHM_BARRIER_SPIN; i++) {
+      if (done())
+        return sleeps;
+      _mm_pause();
+    }
+    while (!done()) {
+      __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+      int val = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+      if (!done()) {
+        futex_wait(word, val);
+        sleeps++;
+      }
+      __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    return sleeps;
+  }
+
   void barrier() {
-    static uint32_t count = 0;
-    if (count % 2) {
-      __sync_fetch_and_add(bar1, 1);
-      while ((*bar1 % size) != 0)
-        ;
+    auto t0 = getTime();
+    local_sense ^= 1;
+    int s = local_sense;
+    long sleeps = 0;
+    __atomic_store_n(&flags[rank].v, s, __ATOMIC_SEQ_CST);
+    if (rank == 0) {
+      sleeps = wait_until(
+          [&]() {
+            for (int r = 1; r < size; r++) {
+              if (__atomic_load_n(&flags[r].v, __ATOMIC_ACQUIRE) != s)
+                return false;
+            }
+            return true;
+          },
+          &bar->arrive_seq.v,
+          &bar->master_waiting.v);
+      __atomic_store_n(&bar->sense.v, s, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&bar->sense_waiters.v, __ATOMIC_SEQ_CST))
+        futex_wake(&bar->sense.v);
     } else {
-      __sync_fetch_and_add(bar2, 1);
-      while ((*bar2 % size) != 0)
-        ;
+      if (__atomic_load_n(&bar->master_waiting.v, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&bar->arrive_seq.v, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&bar->arrive_seq.v);
+      }
+      sleeps = wait_until(
+          [&]() {
+            return __atomic_load_n(&bar->sense.v, __ATOMIC_ACQUIRE) == s;
+          },
+          &bar->sense.v,
+          &bar->sense_waiters.v);
     }
-    count++;
+    barrier_stats.add(getTime() - t0, sleeps);
   }
 
+  // Tensor shaped like t in this rank's staging area, allreducing it skips
+  // the copy in. Only valid until the next collective on this buffer.
   at::Tensor getTensor(at::Tensor t) {
     size_t sz = t.numel() * t.element_size();
-    TPP_ASSERT(sz <= bufsz, "Requested tensor size too big\n");
+    TPP_ASSERT(sz <= bufsz / 2, "Requested tensor size too big\n");
     auto ptr = shm_data[rank];
     auto t_new = torch::from_blob(ptr, t.sizes(), t.options());
     return t_new;
   }
 
+  bool isStaged(at::Tensor t) {
+    return t.data_ptr() == shm_data[rank] &&
+        (size_t)(t.numel() * t.element_size()) <= bufsz / 2;
+  }
+
+  // Allreduce algorithms for messages that fit the staging area, all run
+  // after every rank copied its input in:
+  // DIRECT - every rank reduces the whole message from all ranks
+  // SLICE  - rank r reduces slice r, then everyone gathers the slices
+  // TREE   - binary tree of fp32 partial sums, log2(size) + 1 barriers but
+  //          only one remote read per rank and round, for tiny messages
+  // GRID2D - ranks on a rows x cols grid reduce along their row, then
+  //          along their column, each phase touching fewer remote buffers
+  //          than SLICE does with many ranks
+  enum { ALGO_DIRECT, ALGO_SLICE, ALGO_TREE, ALGO_GRID2D, NUM_ALGOS };
+  static const char* algoName(int algo) {
+    static const char* names[NUM_ALGOS] = {"direct", "slice", "tree", "grid2d"};
+    return names[algo];
+  }
+  // Best algorithm by dtype and ceil(log2(bytes)), filled by calibrate()
+  std::map<at::ScalarType, std::vector<int>> algo_tables;
+  int grid_cols = 0;
+
+  // Tables by group size and dtype, shared by all buffers of the process.
+  // Only used while constructing buffers, under groupsMutex().
+  static std::map<std::pair<int, int>, std::vector<int>>& calibCache() {
+    static std::map<std::pair<int, int>, std::vector<int>> cache;
+    return cache;
+  }
+
+  bool algoFits(int algo, long numel) {
+    // TREE and GRID2D keep fp32 partial sums in the scratch area
+    if (algo == ALGO_TREE || algo == ALGO_GRID2D) {
+      if ((size_t)numel * sizeof(float) > bufsz / 2)
+        return false;
+    }
+    if (algo == ALGO_GRID2D)
+      return grid_cols > 1 && grid_cols < size;
+    return true;
+  }
+
+  template <typename T>
+  int selectAlgo(long numel, long nBytes) {
+    int algo = TPP_SHM_ALLREDUCE_ALGO;
+    auto it = algo_tables.find(c10::CppTypeToScalarType<T>::value);
+    if (algo < 0 && it != algo_tables.end()) {
+      auto& algo_table = it->second;
+      int lg = 0;
+      while ((1L << lg) < nBytes)
+        lg++;
+      lg = std::min(lg, (int)algo_table.size() - 1);
+      algo = algo_table[lg];
+    }
+    if (algo < 0 || algo >= NUM_ALGOS)
+      algo = numel <= DIRECT_THRESHOLD ? ALGO_DIRECT : ALGO_SLICE;
+    if (!algoFits(algo, numel))
+      algo = ALGO_SLICE;
+    return algo;
+  }
+
+  // Result goes to out, which may be t itself. Inputs from getTensor() are
+  // reduced in place without copying them in first.
   template <typename T>
-  void allreduce_impl(at::Tensor t) {
+  void allreduce_impl(at::Tensor t, T* out, int algo = -1) {
     auto numel = t.numel();
     auto nBytes = numel * t.element_size();
     TPP_ASSERT((size_t)nBytes <= bufsz / 2, "Too large allreduce size");
@@ -178,9 +608,8 @@ class SHMBuffer {
     bool need_copy = ptr != shm_data[rank];
     auto ops = shm_tpp::getOps<T>();
     auto& cpy_tpp = ops.cpy_tpp;
-    auto& ucvt_tpp = ops.ucvt_tpp;
-    auto& dcvt_tpp = ops.dcvt_tpp;
-    auto& add_tpp = ops.add_tpp;
+    if (algo < 0)
+      algo = selectAlgo<T>(numel, nBytes);
 
     if (need_copy) {
       auto src = ptr;
@@ -198,120 +627,953 @@ class SHMBuffer {
 
     barrier();
 
-    if (numel <= DIRECT_THRESHOLD) {
-      auto dst = (T*)scratch_data[rank];
-      auto lsrc = (T*)shm_data[rank];
+    if (algo == ALGO_DIRECT) {
+      reduce_direct<T>(out, numel, nThreads);
+    } else if (algo == ALGO_TREE) {
+      reduce_tree<T>(out, numel, nThreads);
+    } else if (algo == ALGO_GRID2D) {
+      reduce_grid2d<T>(out, numel, nThreads);
+    } else {
+      reduce_slice<T>(out, numel, nThreads);
+    }
+  }
+
+  template <typename T>
+  void reduce_direct(T* out, long numel, int nThreads) {
+    auto ops = shm_tpp::getOps<T>();
+    auto& cpy_tpp = ops.cpy_tpp;
+    auto& ucvt_tpp = ops.ucvt_tpp;
+    auto& dcvt_tpp = ops.dcvt_tpp;
+    auto& add_tpp = ops.add_tpp;
+    long rem = numel % BS;
+    long numel_aligned = numel - rem;
+    auto dst = (T*)scratch_data[rank];
+    auto lsrc = (T*)shm_data[rank];
+#pragma omp parallel for num_threads(nThreads)
+    for (int i = 0; i < numel; i += BS) {
+      float ldst[BS];
+      ucvt_tpp(lsrc + i, ldst);
+      for (int p = 1; p < size; p++) {
+        int r1 = peers[p];
+        auto src = (T*)shm_data[r1];
+        add_tpp(ldst, src + i, ldst);
+      }
+      dcvt_tpp(ldst, dst + i);
+    }
+    barrier();
+
+    auto src = (T*)scratch_data[rank];
+#pragma omp parallel for num_threads(nThreads)
+    for (int i = 0; i < numel_aligned; i += BS) {
+      cpy_tpp(src + i, out + i);
+    }
+    if (rem > 0) {
+      for (int i = numel_aligned; i < numel; i++) {
+        out[i] = src[i];
+      }
+    }
+  }
+
+  template <typename T>
+  void reduce_slice(T* out, long numel, int nThreads) {
+    auto ops = shm_tpp::getOps<T>();
+    auto& cpy_tpp = ops.cpy_tpp;
+    auto& ucvt_tpp = ops.ucvt_tpp;
+    auto& dcvt_tpp = ops.dcvt_tpp;
+    auto& add_tpp = ops.add_tpp;
+    long nBlk = (numel + BS - 1) / BS;
+    int slice_start = (nBlk * rank / size) * BS;
+    int slice_end = (nBlk * (rank + 1) / size) * BS;
+
+    auto dst = (T*)scratch_data[rank];
+    auto lsrc = (T*)shm_data[rank];
+#pragma omp parallel for num_threads(nThreads)
+    for (int i = slice_start; i < slice_end; i += BS) {
+      float ldst[BS];
+      ucvt_tpp(lsrc + i, ldst);
+      for (int p = 1; p < size; p++) {
+        int r1 = peers[p];
+        auto src = (T*)shm_data[r1];
+        add_tpp(ldst, src + i, ldst);
+      }
+      dcvt_tpp(ldst, dst + i);
+    }
+    barrier();
+    for (int p = 0; p < size; p++) {
+      int r1 = peers[p];
+      int slice_start = (nBlk * r1 / size) * BS;
+      int slice_end = (nBlk * (r1 + 1) / size) * BS;
+      bool handle_last_blk = false;
+      if (slice_end > numel) {
+        slice_end -= BS;
+        handle_last_blk = true;
+      }
+
+      auto src = (T*)scratch_data[r1];
 #pragma omp parallel for num_threads(nThreads)
-      for (int i = 0; i < numel; i += BS) {
-        float ldst[BS];
-        ucvt_tpp(lsrc + i, ldst);
-        for (int r = 1; r < size; r++) {
-          int r1 = (r + rank) % size;
-          auto src = (T*)shm_data[r1];
-          add_tpp(ldst, src + i, ldst);
+      for (int i = slice_start; i < slice_end; i += BS) {
+        cpy_tpp(src + i, out + i);
+      }
+      if (handle_last_blk) {
+        for (int i = slice_end; i < numel; i++) {
+          out[i] = src[i];
         }
-        dcvt_tpp(ldst, dst + i);
       }
+    }
+  }
+
+  // Sums the staged inputs of ranks [r0, r1) with stride step for block b
+  // into fp32 dst
+  template <typename T>
+  void sum_block(float* dst, long b, long numel, int r0, int r1, int step) {
+    static auto ops = shm_tpp::getOps<T>();
+    long i = b * BS;
+    long len = std::min((long)BS, numel - i);
+    if (len == BS) {
+      ops.ucvt_tpp((T*)shm_data[r0] + i, dst);
+      for (int r = r0 + step; r < r1; r += step)
+        ops.add_tpp(dst, (T*)shm_data[r] + i, dst);
+    } else {
+      for (long j = 0; j < len; j++) {
+        float sum = 0.0f;
+        for (int r = r0; r < r1; r += step)
+          sum += (float)((T*)shm_data[r])[i + j];
+        dst[j] = sum;
+      }
+    }
+  }
+
+  // Adds the fp32 partials of ranks [r0, r1) with stride step for block b
+  void sum_partials(float* dst, long b, long numel, int r0, int r1, int step) {
+    static auto addf_tpp = shm_tpp::getOps<float>().add_tpp;
+    long i = b * BS;
+    long len = std::min((long)BS, numel - i);
+    auto part = [&](int r) { return (float*)scratch_data[r] + i; };
+    if (len == BS) {
+      float acc[BS];
+      memcpy(acc, part(r0), sizeof(acc));
+      for (int r = r0 + step; r < r1; r += step)
+        addf_tpp(acc, part(r), acc);
+      memcpy(dst, acc, sizeof(acc));
+    } else {
+      for (long j = 0; j < len; j++) {
+        float sum = 0.0f;
+        for (int r = r0; r < r1; r += step)
+          sum += part(r)[j];
+        dst[j] = sum;
+      }
+    }
+  }
+
+  template <typename T>
+  void store_block(T* out, const float* src, long b, long numel) {
+    long i = b * BS;
+    long len = std::min((long)BS, numel - i);
+    static auto dcvt_tpp = shm_tpp::getOps<T>().dcvt_tpp;
+    if (len == BS) {
+      dcvt_tpp((float*)src, out + i);
+    } else {
+      for (long j = 0; j < len; j++)
+        out[i + j] = src[j];
+    }
+  }
+
+  template <typename T>
+  void reduce_tree(T* out, long numel, int nThreads) {
+    long nBlk = (numel + BS - 1) / BS;
+    auto part = (float*)scratch_data[rank];
+    // Round one sums pairs of staged inputs, later ones pairs of partials
+    if (rank % 2 == 0) {
+      int r1 = std::min(rank + 2, size);
+#pragma omp parallel for num_threads(nThreads)
+      for (long b = 0; b < nBlk; b++)
+        sum_block<T>(part + b * BS, b, numel, rank, r1, 1);
+    }
+    for (int step = 2; step < size; step *= 2) {
       barrier();
+      if (rank % (2 * step) == 0 && rank + step < size) {
+#pragma omp parallel for num_threads(nThreads)
+        for (long b = 0; b < nBlk; b++)
+          sum_partials(part + b * BS, b, numel, rank, rank + step + 1, step);
+      }
+    }
+    barrier();
+    auto root = (float*)scratch_data[0];
+#pragma omp parallel for num_threads(nThreads)
+    for (long b = 0; b < nBlk; b++)
+      store_block<T>(out, root + b * BS, b, numel);
+  }
 
-      if (true) {
-        auto src = (T*)scratch_data[rank];
-        auto dst = ptr;
+  template <typename T>
+  void reduce_grid2d(T* out, long numel, int nThreads) {
+    long nBlk = (numel + BS - 1) / BS;
+    int cols = grid_cols;
+    int rows = size / cols;
+    int row = rank / cols;
+    int col = rank % cols;
+    auto part = (float*)scratch_data[rank];
+    // Chunk c of the blocks is reduced along each row by the rank in
+    // column c, sub chunk w of that along column c by the rank in row w
+    auto chunk = [&](int c) { return nBlk * c / cols; };
+    auto sub = [&](int c, int w) {
+      return chunk(c) + (chunk(c + 1) - chunk(c)) * w / rows;
+    };
+    int row0 = row * cols;
+#pragma omp parallel for num_threads(nThreads)
+    for (long b = chunk(col); b < chunk(col + 1); b++)
+      sum_block<T>(part + b * BS, b, numel, row0, row0 + cols, 1);
+    barrier();
+    // Final sums overwrite this rank's own partials, which no one else
+    // reads in this phase
 #pragma omp parallel for num_threads(nThreads)
-        for (int i = 0; i < numel_aligned; i += BS) {
-          cpy_tpp(src + i, dst + i);
+    for (long b = sub(col, row); b < sub(col, row + 1); b++)
+      sum_partials(part + b * BS, b, numel, col, size, cols);
+    barrier();
+#pragma omp parallel for num_threads(nThreads)
+    for (long b = 0; b < nBlk; b++) {
+      int c = 0;
+      while (b >= chunk(c + 1))
+        c++;
+      int w = 0;
+      while (b >= sub(c, w + 1))
+        w++;
+      auto src = (float*)scratch_data[w * cols + c];
+      store_block<T>(out, src + b * BS, b, numel);
+    }
+  }
+
+  // Times every algorithm on T messages from 1KB up to
+  // TPP_SHM_CALIB_MAX_BYTES and keeps the fastest per size. Rank 0's
+  // timings decide and the table is handed to the others through its
+  // staging area so that all ranks select the same algorithm. Buffers
+  // rebuilt for the same group size reuse the table if rank 0 has it.
+  template <typename T>
+  void calibrate() {
+    auto dt = c10::CppTypeToScalarType<T>::value;
+    auto key = std::make_pair(size, (int)dt);
+    std::vector<int> table;
+    if (rank == 0 && calibCache().count(key))
+      table = calibCache()[key];
+    int* shared = (int*)shm_data[0];
+    if (rank == 0) {
+      shared[0] = table.size();
+      memcpy(shared + 1, table.data(), table.size() * sizeof(int));
+    }
+    barrier();
+    if (rank != 0)
+      table.assign(shared + 1, shared + 1 + shared[0]);
+    barrier();
+    if (!table.empty()) {
+      algo_tables[dt] = table;
+      calibCache()[key] = table;
+      return;
+    }
+
+    size_t max_bytes =
+        std::min((size_t)TPP_SHM_CALIB_MAX_BYTES, pipelineSliceBytes());
+    int max_lg = 10;
+    while ((1UL << (max_lg + 1)) <= max_bytes)
+      max_lg++;
+    table.assign(max_lg + 1, ALGO_DIRECT);
+    for (int lg = 10; lg <= max_lg; lg++) {
+      long numel = (1L << lg) / sizeof(T);
+      auto t = at::zeros({numel}, dt);
+      auto ptr = t.data_ptr<T>();
+      double best = 0.0;
+      for (int algo = 0; algo < NUM_ALGOS; algo++) {
+        if (!algoFits(algo, numel))
+          continue;
+        int iters = std::max(4L, std::min(32L, (1L << 24) >> lg));
+        allreduce_impl<T>(t, ptr, algo);
+        auto t0 = getTime();
+        for (int i = 0; i < iters; i++)
+          allreduce_impl<T>(t, ptr, algo);
+        double tm = getTime() - t0;
+        if (best == 0.0 || tm < best) {
+          best = tm;
+          table[lg] = algo;
+        }
+      }
+    }
+    for (int lg = 0; lg < 10; lg++)
+      table[lg] = table[10];
+    if (rank == 0)
+      memcpy(shm_data[0], table.data(), table.size() * sizeof(int));
+    barrier();
+    if (rank != 0)
+      memcpy(table.data(), shm_data[0], table.size() * sizeof(int));
+    barrier();
+    algo_tables[dt] = table;
+    calibCache()[key] = table;
+    if (rank == 0) {
+      printf("SHM %s allreduce algorithms by size:", c10::toString(dt));
+      for (int lg = 10; lg <= max_lg; lg++)
+        printf(" %ldKB:%s", (1L << lg) / 1024, algoName(table[lg]));
+      printf("\n");
+    }
+  }
+
+  void allreduce(at::Tensor t, at::Tensor t_out) {
+    auto dt = t.dtype();
+    if (dt == at::kFloat) {
+      allreduce_impl<float>(t, t_out.data_ptr<float>());
+    } else if (dt == at::kBFloat16) {
+      allreduce_impl<bfloat16>(t, t_out.data_ptr<bfloat16>());
+    } else if (dt == at::kHalf) {
+      allreduce_impl<half>(t, t_out.data_ptr<half>());
+    } else {
+      TPP_ASSERT(0, "Unsupported dtype in allreduce\n");
+    }
+  }
+
+  void allreduce(at::Tensor t) {
+    allreduce(t, t);
+  }
+
+  // Large messages stream through NSLOT slices of the staging and scratch
+  // areas. Step k copies slice k in, reduces this rank's share of slice
+  // k - 1 and copies slice k - 2 out, all in one parallel loop followed by
+  // a single barrier, so copies overlap the reduction and each slice costs
+  // one barrier instead of two. With one barrier between a slot's last
+  // read and its next write, two slots are enough.
+  static const int NSLOT = 2;
+
+  size_t pipelineSliceBytes() {
+    return bufsz / 2 / NSLOT;
+  }
+
+  template <typename T>
+  void allreduce_pipelined_impl(at::Tensor t) {
+    TPP_ASSERT(t.is_contiguous(), "allreduce tensor must be contiguous");
+    T* ptr = (T*)t.data_ptr();
+    long numel = t.numel();
+    long slice = pipelineSliceBytes() / sizeof(T) / (BS * size) * (BS * size);
+    TPP_ASSERT(slice > 0, "Too small shm buffer for pipelined allreduce");
+    long nSlices = (numel + slice - 1) / slice;
+    auto ops = shm_tpp::getOps<T>();
+    auto& cpy_tpp = ops.cpy_tpp;
+    auto& ucvt_tpp = ops.ucvt_tpp;
+    auto& dcvt_tpp = ops.dcvt_tpp;
+    auto& add_tpp = ops.add_tpp;
+    auto slice_len = [&](long s) {
+      return (s < 0 || s >= nSlices) ? 0 : std::min(slice, numel - s * slice);
+    };
+    auto slice_blks = [&](long s) { return (slice_len(s) + BS - 1) / BS; };
+
+    for (long k = 0; k < nSlices + 2; k++) {
+      long n_in = slice_blks(k);
+      long red_blks = slice_blks(k - 1);
+      long red_start = red_blks * rank / size;
+      long n_red = red_blks * (rank + 1) / size - red_start;
+      long out_blks = slice_blks(k - 2);
+      long nWork = n_in + n_red + out_blks;
+#pragma omp parallel for
+      for (long w = 0; w < nWork; w++) {
+        long s, i;
+        if (w < n_in) {
+          s = k;
+          i = w * BS;
+        } else if (w < n_in + n_red) {
+          s = k - 1;
+          i = (red_start + w - n_in) * BS;
+        } else {
+          s = k - 2;
+          i = (w - n_in - n_red) * BS;
         }
-        if (rem > 0) {
-          for (int i = numel_aligned; i < numel; i++) {
-            dst[i] = src[i];
+        long len = std::min((long)BS, slice_len(s) - i);
+        long off = (s % NSLOT) * slice + i;
+        T* user = ptr + s * slice + i;
+        if (w < n_in) {
+          auto dst = (T*)shm_data[rank] + off;
+          if (len == BS)
+            cpy_tpp(user, dst);
+          else
+            memcpy(dst, user, len * sizeof(T));
+        } else if (w < n_in + n_red) {
+          auto dst = (T*)scratch_data[rank] + off;
+          if (len == BS) {
+            float ldst[BS];
+            ucvt_tpp((T*)shm_data[rank] + off, ldst);
+            for (int p = 1; p < size; p++) {
+              int r1 = peers[p];
+              add_tpp(ldst, (T*)shm_data[r1] + off, ldst);
+            }
+            dcvt_tpp(ldst, dst);
+          } else {
+            for (long j = 0; j < len; j++) {
+              float acc = 0.0f;
+              for (int r = 0; r < size; r++)
+                acc += (float)((T*)shm_data[r])[off + j];
+              dst[j] = acc;
+            }
           }
+        } else {
+          long b = i / BS;
+          int owner = 0;
+          while (b >= out_blks * (owner + 1) / size)
+            owner++;
+          auto src = (T*)scratch_data[owner] + off;
+          if (len == BS)
+            cpy_tpp(src, user);
+          else
+            memcpy(user, src, len * sizeof(T));
         }
       }
-    } else {
-      int slice_start = (nBlk * rank / size) * BS;
-      int slice_end = (nBlk * (rank + 1) / size) * BS;
+      // Nothing reads the buffers after the last copy out
+      if (k < nSlices + 1)
+        barrier();
+    }
+  }
 
-      auto dst = (T*)scratch_data[rank];
-      auto lsrc = (T*)shm_data[rank];
-#pragma omp parallel for num_threads(nThreads)
-      for (int i = slice_start; i < slice_end; i += BS) {
-        float ldst[BS];
-        ucvt_tpp(lsrc + i, ldst);
-        for (int r = 1; r < size; r++) {
-          int r1 = (r + rank) % size;
-          auto src = (T*)shm_data[r1];
-          add_tpp(ldst, src + i, ldst);
+  // fp32 allreduce with each rank's contribution stored as Tw in its
+  // staging area. fp8 contributions are scaled per block of BS elements so
+  // that the block's absolute max maps to the largest finite value, the
+  // fp32 scales precede the data. Rank r sums its slice of blocks in fp32
+  // into its scratch area in fp32, so all ranks get the same result.
+  template <typename Tw>
+  void allreduce_wire_impl(float* ptr, long numel) {
+    static ConvertTPP<float, Tw> qcvt_tpp(BS);
+    static ConvertTPP<Tw, float> dqcvt_tpp(BS);
+    static AddTPP<float, float> add_tpp(BS);
+    static ScaleTPP<float, float> scale_tpp(BS);
+    static ScaleAddTPP<float, float> scale_add_tpp(BS);
+    static CpyTPP<float> cpy_tpp(BS);
+    static AbsMaxTPP<float> amax_tpp(BS);
+    constexpr bool scaled = sizeof(Tw) == 1;
+    const float wmax = (float)std::numeric_limits<Tw>::max();
+    long nBlk = (numel + BS - 1) / BS;
+    auto wscl = [&](int r) { return (float*)shm_data[r]; };
+    auto wbuf = [&](int r) { return (Tw*)(wscl(r) + (scaled ? nBlk : 0)); };
+
+#pragma omp parallel for
+    for (long b = 0; b < nBlk; b++) {
+      long i = b * BS;
+      long len = std::min((long)BS, numel - i);
+      auto src = ptr + i;
+      float x[BS];
+      if (scaled) {
+        float amax = 0.0f;
+        if (len == BS) {
+          amax_tpp(src, &amax);
+        } else {
+          for (long j = 0; j < len; j++)
+            amax = std::max(amax, std::abs(src[j]));
+        }
+        float s = amax > 0.0f ? amax / wmax : 1.0f;
+        wscl(rank)[b] = s;
+        if (len == BS) {
+          scale_tpp(src, x, 1.0f / s);
+        } else {
+          for (long j = 0; j < len; j++)
+            x[j] = src[j] / s;
         }
-        dcvt_tpp(ldst, dst + i);
+        src = x;
       }
-      barrier();
-      if (true) {
-        for (int r = 0; r < size; r++) {
-          int r1 = (r + rank) % size;
-          int slice_start = (nBlk * r1 / size) * BS;
-          int slice_end = (nBlk * (r1 + 1) / size) * BS;
-          bool handle_last_blk = false;
-          if (slice_end > numel) {
-            slice_end -= BS;
-            handle_last_blk = true;
-          }
+      if (len == BS) {
+        qcvt_tpp(src, wbuf(rank) + i);
+      } else {
+        for (long j = 0; j < len; j++)
+          wbuf(rank)[i + j] = (Tw)src[j];
+      }
+    }
+    barrier();
+
+    long blk_start = nBlk * rank / size;
+    long blk_end = nBlk * (rank + 1) / size;
+#pragma omp parallel for
+    for (long b = blk_start; b < blk_end; b++) {
+      long i = b * BS;
+      long len = std::min((long)BS, numel - i);
+      auto dst = (float*)scratch_data[rank] + i;
+      if (len == BS) {
+        float tmp[BS];
+        dqcvt_tpp(wbuf(rank) + i, dst);
+        if (scaled)
+          scale_tpp(dst, dst, wscl(rank)[b]);
+        for (int p = 1; p < size; p++) {
+          int r1 = peers[p];
+          dqcvt_tpp(wbuf(r1) + i, tmp);
+          if (scaled)
+            scale_add_tpp(tmp, dst, wscl(r1)[b]);
+          else
+            add_tpp(dst, tmp, dst);
+        }
+      } else {
+        for (long j = 0; j < len; j++) {
+          float sum = 0.0f;
+          for (int r = 0; r < size; r++)
+            sum += (float)wbuf(r)[i + j] * (scaled ? wscl(r)[b] : 1.0f);
+          dst[j] = sum;
+        }
+      }
+    }
+    barrier();
 
-          auto src = (T*)scratch_data[r1];
-          auto dst = ptr;
+#pragma omp parallel for
+    for (long b = 0; b < nBlk; b++) {
+      long i = b * BS;
+      long len = std::min((long)BS, numel - i);
+      int owner = 0;
+      while (b >= nBlk * (owner + 1) / size)
+        owner++;
+      auto src = (float*)scratch_data[owner] + i;
+      if (len == BS)
+        cpy_tpp(src, ptr + i);
+      else
+        memcpy(ptr + i, src, len * sizeof(float));
+    }
+  }
+
+  void allreduce_wire(at::Tensor t) {
+    TPP_ASSERT(t.is_contiguous(), "allreduce tensor must be contiguous");
+    auto ptr = t.data_ptr<float>();
+    long numel = t.numel();
+    // The fp32 results of a piece have to fit the scratch area
+    long max_elem = (bufsz / 2) / sizeof(float);
+    for (long a = 0; a < numel; a += max_elem) {
+      long n = std::min(max_elem, numel - a);
+      if (TPP_SHM_WIRE_DTYPE == 1) {
+        allreduce_wire_impl<bfloat16>(ptr + a, n);
+      } else if (TPP_SHM_WIRE_DTYPE == 2) {
+        allreduce_wire_impl<bfloat8>(ptr + a, n);
+      } else if (TPP_SHM_WIRE_DTYPE == 3) {
+        allreduce_wire_impl<hfloat8>(ptr + a, n);
+      } else {
+        TPP_ASSERT(0, "Unsupported TPP_SHM_WIRE_DTYPE\n");
+      }
+    }
+  }
+
+  void allreduce_pipelined(at::Tensor t) {
+    auto dt = t.dtype();
+    if (dt == at::kFloat) {
+      allreduce_pipelined_impl<float>(t);
+    } else if (dt == at::kBFloat16) {
+      allreduce_pipelined_impl<bfloat16>(t);
+    } else if (dt == at::kHalf) {
+      allreduce_pipelined_impl<half>(t);
+    } else {
+      TPP_ASSERT(0, "Unsupported dtype in allreduce\n");
+    }
+  }
+
+  // Gathers [rows, cols[r]] byte pieces of all ranks into out, whose rows
+  // are ld bytes apart. Staging buffers get reused by the next call, so
+  // the second barrier waits for all ranks to be done reading them.
+  void allgather_impl(
+      const char* in,
+      char* out,
+      long rows,
+      const std::vector<long>& cols,
+      long ld) {
+    std::vector<long> offs(size, 0);
+    for (int r = 1; r < size; r++)
+      offs[r] = offs[r - 1] + cols[r - 1];
+    parallel_copy(shm_data[rank], in, rows * cols[rank]);
+    barrier();
+#pragma omp parallel for collapse(2)
+    for (int r = 0; r < size; r++) {
+      for (long i = 0; i < rows; i++) {
+        auto src = (char*)shm_data[r] + i * cols[r];
+        memcpy(out + i * ld + offs[r], src, cols[r]);
+      }
+    }
+    barrier();
+  }
+
+  void allgather(
+      at::Tensor t_in,
+      at::Tensor t_out,
+      const std::vector<long>& split_sizes) {
+    long es = t_in.element_size();
+    long rows = t_in.numel() / t_in.size(-1);
+    long ld = t_out.size(-1) * es;
+    std::vector<long> cols;
+    long max_cols = 0;
+    for (auto s : split_sizes) {
+      cols.push_back(s * es);
+      max_cols = std::max(max_cols, s * es);
+    }
+    TPP_ASSERT(
+        (size_t)max_cols <= bufsz / 2 && max_cols > 0,
+        "Too large allgather row size");
+    // Row chunks are the same on all ranks as all ranks know all splits
+    long max_rows = (bufsz / 2) / max_cols;
+    auto in = (const char*)t_in.data_ptr();
+    auto out = (char*)t_out.data_ptr();
+    for (long i = 0; i < rows; i += max_rows) {
+      long n = std::min(max_rows, rows - i);
+      allgather_impl(in + i * cols[rank], out + i * ld, n, cols, ld);
+    }
+  }
+
+  // Each rank stages its input as [size][n] pieces, piece d holding the
+  // part of chunk d in range, and rank r reduces piece r of all ranks
+  template <typename T>
+  void reduce_scatter_impl(T* in, T* out, long chunk) {
+    long max_elem = (bufsz / 2) / (size * sizeof(T)) / BS * BS;
+    TPP_ASSERT(max_elem > 0, "Too small shm buffer for reduce_scatter");
+    auto ops = shm_tpp::getOps<T>();
+    auto& ucvt_tpp = ops.ucvt_tpp;
+    auto& dcvt_tpp = ops.dcvt_tpp;
+    auto& add_tpp = ops.add_tpp;
+    for (long a = 0; a < chunk; a += max_elem) {
+      long n = std::min(max_elem, chunk - a);
+      auto buf = (T*)shm_data[rank];
+      for (int d = 0; d < size; d++)
+        parallel_copy(buf + d * n, in + d * chunk + a, n * sizeof(T));
+      barrier();
+      long nBlk = (n + BS - 1) / BS;
+      long nThreads = std::min<long>(nBlk, omp_get_max_threads());
 #pragma omp parallel for num_threads(nThreads)
-          for (int i = slice_start; i < slice_end; i += BS) {
-            cpy_tpp(src + i, dst + i);
+      for (long i = 0; i < n; i += BS) {
+        auto lsrc = (T*)shm_data[rank] + rank * n + i;
+        auto dst = out + a + i;
+        if (i + BS <= n) {
+          float ldst[BS];
+          ucvt_tpp(lsrc, ldst);
+          for (int p = 1; p < size; p++) {
+            int r1 = peers[p];
+            auto src = (T*)shm_data[r1] + rank * n + i;
+            add_tpp(ldst, src, ldst);
           }
-          if (handle_last_blk) {
-            for (int i = slice_end; i < numel; i++) {
-              dst[i] = src[i];
+          dcvt_tpp(ldst, dst);
+        } else {
+          for (long j = 0; j < n - i; j++) {
+            float sum = (float)lsrc[j];
+            for (int p = 1; p < size; p++) {
+              int r1 = peers[p];
+              sum += (float)((T*)shm_data[r1] + rank * n + i)[j];
             }
+            dst[j] = (T)sum;
           }
         }
       }
+      barrier();
     }
   }
 
-  void allreduce(at::Tensor t) {
-    auto dt = t.dtype();
+  void reduce_scatter(at::Tensor t_in, at::Tensor t_out) {
+    auto dt = t_in.dtype();
+    long chunk = t_out.numel();
+    TPP_ASSERT(t_in.numel() == chunk * size, "reduce_scatter size mismatch");
     if (dt == at::kFloat) {
-      allreduce_impl<float>(t);
+      reduce_scatter_impl<float>(
+          (float*)t_in.data_ptr(), (float*)t_out.data_ptr(), chunk);
     } else if (dt == at::kBFloat16) {
-      allreduce_impl<bfloat16>(t);
+      reduce_scatter_impl<bfloat16>(
+          (bfloat16*)t_in.data_ptr(), (bfloat16*)t_out.data_ptr(), chunk);
     } else if (dt == at::kHalf) {
-      allreduce_impl<half>(t);
+      reduce_scatter_impl<half>(
+          (half*)t_in.data_ptr(), (half*)t_out.data_ptr(), chunk);
     } else {
-      TPP_ASSERT(0, "Unsupported dtype in allreduce\n");
+      TPP_ASSERT(0, "Unsupported dtype in reduce_scatter\n");
     }
   }
-};
 
-int SHMBuffer::SHMID = 100 + master_port;
-int SHMBuffer::BARID = 10000 + master_port;
+  void broadcast(at::Tensor t, int root) {
+    size_t bytes = t.numel() * t.element_size();
+    size_t max_bytes = bufsz / 2;
+    auto ptr = (char*)t.data_ptr();
+    for (size_t off = 0; off < bytes; off += max_bytes) {
+      size_t n = std::min(max_bytes, bytes - off);
+      if (rank == root)
+        parallel_copy(shm_data[rank], ptr + off, n);
+      barrier();
+      if (rank != root)
+        parallel_copy(ptr + off, shm_data[root], n);
+      barrier();
+    }
+  }
+};
 
-void shm_allreduce(
-    at::Tensor t_in,
-    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+static SHMBuffer* get_shm_inst(
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group,
+    bool drain = true) {
   if (!process_group) {
     printf("Missing process group when using model parallel, use set_pg()\n");
     exit(1);
   }
-  auto shm_inst = SHMBuffer::getInst(TPP_SHM_BUF_SIZE, process_group);
-  long max_elem = TPP_SHM_BUF_SIZE / t_in.element_size();
-  long numel = t_in.numel();
-  if (numel <= max_elem) {
+  return SHMBuffer::getInst(process_group, drain);
+}
+
+void shm_set_buffer_size(
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group,
+    long bytes) {
+  TPP_ASSERT(bytes > 0, "SHM buffer size must be positive\n");
+  SHMBuffer::setSizeHint(process_group, bytes);
+}
+
+static void shm_allreduce_inst(SHMBuffer* shm_inst, at::Tensor t_in) {
+  size_t nBytes = t_in.numel() * t_in.element_size();
+  if (TPP_SHM_WIRE_DTYPE > 0 && t_in.dtype() == at::kFloat &&
+      !shm_inst->isStaged(t_in)) {
+    shm_inst->allreduce_wire(t_in);
+  } else if (
+      shm_inst->isStaged(t_in) || nBytes <= shm_inst->pipelineSliceBytes()) {
     shm_inst->allreduce(t_in);
   } else {
-    t_in = t_in.view({-1});
-    for (int64_t i = 0; i < numel; i += max_elem) {
-      auto start = i;
-      auto end = start + max_elem;
-      if (end > numel)
-        end = numel;
-      auto t = t_in.slice(0, start, end, 1);
-      shm_inst->allreduce(t);
+    shm_inst->allreduce_pipelined(t_in);
+  }
+}
+
+void shm_allreduce(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  shm_allreduce_inst(get_shm_inst(process_group), t_in);
+}
+
+c10::intrusive_ptr<c10d::Work> shm_allreduce_async(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  auto shm_inst = get_shm_inst(process_group, false);
+  auto future = c10::make_intrusive<c10::ivalue::Future>(
+      c10::ListType::create(c10::TensorType::get()));
+  auto fut = shm_inst->submitAsync([=]() {
+    try {
+      shm_allreduce_inst(shm_inst, t_in);
+    } catch (...) {
+      future->setError(std::current_exception());
+      throw;
+    }
+    future->markCompleted(c10::IValue(std::vector<at::Tensor>{t_in}));
+  });
+  return c10::make_intrusive<SHMWork>(fut, future, t_in);
+}
+
+// Pieces of at most one staging area per rank go through reduce_scatter
+// within the node, an allreduce of the 1/local_size shard across nodes and
+// an allgather within the node. Pieces not divisible by the local size are
+// zero padded.
+void shm_allreduce_hierarchical(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> local_pg,
+    c10::intrusive_ptr<c10d::ProcessGroup> cross_pg,
+    std::function<void()> on_cross_wait) {
+  TPP_ASSERT(
+      local_pg && cross_pg, "Missing node process groups, use set_pg()\n");
+  TPP_ASSERT(t_in.is_contiguous(), "allreduce tensor must be contiguous");
+  auto shm_inst = get_shm_inst(local_pg);
+  long L = shm_inst->size;
+  auto t_flat = t_in.view({-1});
+  long numel = t_flat.numel();
+  long max_piece = (shm_inst->bufsz / 2) / t_in.element_size() * L;
+  for (long a = 0; a < numel; a += max_piece) {
+    long n = std::min(max_piece, numel - a);
+    long chunk = (n + L - 1) / L;
+    auto t_piece = t_flat.slice(0, a, a + n);
+    auto t_buf = t_piece;
+    if (chunk * L != n) {
+      t_buf = t_piece.new_zeros({chunk * L});
+      t_buf.slice(0, 0, n).copy_(t_piece);
     }
+    auto t_shard = t_buf.new_empty({1, chunk});
+    shm_inst->reduce_scatter(t_buf, t_shard);
+    std::vector<at::Tensor> temp_vec = {t_shard};
+    auto work = cross_pg->allreduce(temp_vec);
+    if (on_cross_wait && a == 0)
+      on_cross_wait();
+    work->wait();
+    shm_inst->allgather(
+        t_shard, t_buf.view({1, -1}), std::vector<long>(L, chunk));
+    if (t_buf.data_ptr() != t_piece.data_ptr())
+      t_piece.copy_(t_buf.slice(0, 0, n));
+  }
+}
+
+at::Tensor shm_staging_tensor(
+    at::Tensor t_like,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  auto shm_inst = get_shm_inst(process_group);
+  size_t nBytes = t_like.numel() * t_like.element_size();
+  if (nBytes > shm_inst->bufsz / 2)
+    return at::Tensor();
+  return shm_inst->getTensor(t_like);
+}
+
+at::Tensor shm_allreduce_staged(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  auto shm_inst = get_shm_inst(process_group);
+  if (!shm_inst->isStaged(t_in)) {
+    shm_allreduce(t_in, process_group);
+    return t_in;
+  }
+  auto t_out = at::empty_like(t_in);
+  shm_inst->allreduce(t_in, t_out);
+  return t_out;
+}
+
+std::vector<double> shm_barrier_stats(bool reset) {
+  auto& st = barrier_stats;
+  std::lock_guard<std::mutex> lk(st.mtx);
+  std::vector<double> ret = {
+      (double)st.calls,
+      st.total,
+      st.calls > 0 ? st.total / st.calls : 0.0,
+      st.max,
+      (double)st.sleeps};
+  if (reset) {
+    st.calls = st.sleeps = 0;
+    st.total = st.max = 0.0;
+  }
+  return ret;
+}
+
+void shm_allgather(
+    at::Tensor t_in,
+    at::Tensor t_out,
+    std::vector<long> split_sizes,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  auto shm_inst = get_shm_inst(process_group);
+  TPP_ASSERT(
+      (int)split_sizes.size() == shm_inst->size,
+      "Length of split vector doesn't match group size");
+  TPP_ASSERT(t_out.is_contiguous(), "allgather output must be contiguous");
+  shm_inst->allgather(t_in.contiguous(), t_out, split_sizes);
+}
+
+void shm_reduce_scatter(
+    at::Tensor t_in,
+    at::Tensor t_out,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  auto shm_inst = get_shm_inst(process_group);
+  TPP_ASSERT(t_out.is_contiguous(), "reduce_scatter output must be contiguous");
+  shm_inst->reduce_scatter(t_in.contiguous(), t_out);
+}
+
+void shm_broadcast(
+    at::Tensor t,
+    int root,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group) {
+  auto shm_inst = get_shm_inst(process_group);
+  TPP_ASSERT(t.is_contiguous(), "broadcast tensor must be contiguous");
+  shm_inst->broadcast(t, root);
+}
+
+// Queue segment: one page with the QueueHeader, then for each slot a page
+// with the SlotHeader followed by slot_size bytes of tensor data
+SHMQueue::SHMQueue(std::string name, long num_slots, long slot_size)
+    : num_slots(num_slots), slot_size(((slot_size + 4095) / 4096) * 4096) {
+  TPP_ASSERT(sizeof(SlotHeader) <= 4096, "SlotHeader too big\n");
+  slot_stride = 4096 + this->slot_size;
+  size_t bytes = 4096 + num_slots * slot_stride;
+  // FNV-1a of the name, offset by the master port so that concurrent jobs
+  // on one host use different keys
+  uint32_t hash = 2166136261u;
+  for (auto c : name)
+    hash = (hash ^ (uint8_t)c) * 16777619u;
+  key_t key = (key_t)((hash & 0x3fffffff) + master_port);
+  QueueHeader* qh = nullptr;
+  // A second round follows removal of a stale segment
+  for (int attempt = 0;; attempt++) {
+    shmid = shmget(key, bytes, IPC_CREAT | 0600);
+    // Left over segment of a queue with other sizes
+    bool stale = shmid < 0 && errno == EINVAL;
+    if (stale)
+      shmid = shmget(key, 0, 0);
+    TPP_ASSERT(
+        shmid >= 0,
+        "SHMQueue %s: cannot get shared memory of size %lu\n",
+        name.c_str(),
+        bytes);
+    struct shmid_ds ds;
+    if (!stale && shmctl(shmid, IPC_STAT, &ds) == 0)
+      stale = ds.shm_segsz != bytes;
+    if (!stale) {
+      shm_data = shmat(shmid, NULL, 0);
+      TPP_ASSERT(
+          shm_data != (void*)-1, "SHMQueue %s: shmat failed\n", name.c_str());
+      qh = (QueueHeader*)shm_data;
+      // An end that died before its peer attached leaves the segment behind
+      int owner = __atomic_load_n(&qh->owner_pid, __ATOMIC_ACQUIRE);
+      if (owner == 0 || kill(owner, 0) == 0 || errno != ESRCH)
+        break;
+      shmdt(shm_data);
+    }
+    TPP_ASSERT(
+        attempt == 0,
+        "SHMQueue %s: unable to replace stale segment\n",
+        name.c_str());
+    shmctl(shmid, IPC_RMID, NULL);
+  }
+  // Fresh segments are zero filled, the second end to attach removes the
+  // id so the memory goes away with the last detach
+  int n = __sync_add_and_fetch(&qh->attached, 1);
+  if (n == 1)
+    __atomic_store_n(&qh->owner_pid, (int)getpid(), __ATOMIC_RELEASE);
+  else if (n == 2)
+    shmctl(shmid, IPC_RMID, NULL);
+}
+
+SHMQueue::~SHMQueue() {
+  // Once both ends attached the id is already removed. Without a peer yet,
+  // reset the segment so that a restarted end can still meet its peer
+  // there instead of the peer waiting on a segment no one else opens.
+  auto qh = (QueueHeader*)shm_data;
+  if (__atomic_load_n(&qh->attached, __ATOMIC_ACQUIRE) == 1) {
+    for (long i = 0; i < num_slots; i++)
+      __atomic_store_n(&slot_header(i)->full, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&qh->owner_pid, 0, __ATOMIC_RELEASE);
+    __sync_bool_compare_and_swap(&qh->attached, 1, 0);
+  }
+  shmdt(shm_data);
+}
+
+SHMQueue::SlotHeader* SHMQueue::slot_header(long i) {
+  return (SlotHeader*)((char*)shm_data + 4096 + i * slot_stride);
+}
+
+char* SHMQueue::slot_data(long i) {
+  return (char*)slot_header(i) + 4096;
+}
+
+void SHMQueue::send(std::vector<at::Tensor> tensors) {
+  TPP_ASSERT(tensors.size() <= MAX_TENSORS, "Too many tensors in SHMQueue\n");
+  long i = send_idx % num_slots;
+  auto hdr = slot_header(i);
+  auto data = slot_data(i);
+  while (__atomic_load_n(&hdr->full, __ATOMIC_ACQUIRE))
+    sched_yield();
+  long offset = 0;
+  for (size_t n = 0; n < tensors.size(); n++) {
+    auto t = tensors[n].contiguous();
+    size_t bytes = t.numel() * t.element_size();
+    TPP_ASSERT(t.dim() <= MAX_DIMS, "Too many dims in SHMQueue tensor\n");
+    TPP_ASSERT(
+        offset + bytes <= (size_t)slot_size,
+        "SHMQueue slot size too small (%ld)\n",
+        slot_size);
+    hdr->dtype[n] = (int)t.scalar_type();
+    hdr->dim[n] = t.dim();
+    for (int d = 0; d < t.dim(); d++)
+      hdr->sizes[n][d] = t.size(d);
+    hdr->offset[n] = offset;
+    parallel_copy(data + offset, t.data_ptr(), bytes);
+    offset += (bytes + 63) / 64 * 64;
+  }
+  hdr->num_tensors = tensors.size();
+  __atomic_store_n(&hdr->full, 1, __ATOMIC_RELEASE);
+  send_idx++;
+}
+
+std::vector<at::Tensor> SHMQueue::recv() {
+  long i = recv_idx % num_slots;
+  auto hdr = slot_header(i);
+  auto data = slot_data(i);
+  while (!__atomic_load_n(&hdr->full, __ATOMIC_ACQUIRE))
+    sched_yield();
+  std::vector<at::Tensor> tensors;
+  for (int n = 0; n < hdr->num_tensors; n++) {
+    auto sizes = at::IntArrayRef(hdr->sizes[n], hdr->dim[n]);
+    auto t = at::empty(sizes, at::ScalarType(hdr->dtype[n]));
+    parallel_copy(
+        t.data_ptr(), data + hdr->offset[n], t.numel() * t.element_size());
+    tensors.push_back(t);
   }
+  __atomic_store_n(&hdr->full, 0, __ATOMIC_RELEASE);
+  recv_idx++;
+  return tensors;
 }
 
 #undef BS
@@ -3,7 +3,109 @@
 #include <ATen/record_function.h>
 #include <torch/csrc/distributed/c10d/comm.hpp>
 #include <torch/extension.h>
+#include <functional>
 
 void shm_allreduce(
     at::Tensor t_in,
     c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+// Queues the allreduce on a helper thread of the group's SHM buffer and
+// returns right away. Wait on the returned work before touching t_in.
+// SHM collectives issued synchronously in the meantime wait for it first.
+c10::intrusive_ptr<c10d::Work> shm_allreduce_async(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+// Per rank staging size of the SHM buffer of process_group, defaults to
+// TPP_SHM_BUF_SIZE. Groups with small messages can ask for less. Takes
+// effect with the next SHM collective of the group, which reallocates the
+// buffer if needed, so all ranks of the group have to set the same size.
+void shm_set_buffer_size(
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group,
+    long bytes);
+
+// Two level allreduce for multi-node runs: SHM within the node (local_pg)
+// and local_pg->getSize() times less data across nodes (cross_pg, the
+// ranks with the same local rank). on_cross_wait, if given, runs once while
+// the first cross node allreduce is in flight.
+void shm_allreduce_hierarchical(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> local_pg,
+    c10::intrusive_ptr<c10d::ProcessGroup> cross_pg,
+    std::function<void()> on_cross_wait = nullptr);
+
+// Tensor shaped like t_like in this rank's SHM staging buffer, undefined
+// if it doesn't fit. Writing an allreduce input there (e.g. as GEMM output)
+// lets shm_allreduce_staged() skip copying it in. Only valid until the next
+// SHM collective.
+at::Tensor shm_staging_tensor(
+    at::Tensor t_like,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+// Allreduce that returns the result in a new tensor for inputs from
+// shm_staging_tensor() and reduces anything else in place
+at::Tensor shm_allreduce_staged(
+    at::Tensor t_in,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+// Gathers t_in of every rank along the last dim straight into t_out,
+// split_sizes holds the last dim size of each rank
+void shm_allgather(
+    at::Tensor t_in,
+    at::Tensor t_out,
+    std::vector<long> split_sizes,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+// Sums t_in across ranks, t_out gets chunk rank of the flattened result
+void shm_reduce_scatter(
+    at::Tensor t_in,
+    at::Tensor t_out,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+void shm_broadcast(
+    at::Tensor t,
+    int root,
+    c10::intrusive_ptr<c10d::ProcessGroup> process_group);
+
+// SHM barrier wait time of this rank as [calls, total seconds, average
+// seconds per call, max seconds, futex sleeps]
+std::vector<double> shm_barrier_stats(bool reset);
+
+// Single producer / single consumer queue of tensor lists in SysV shared
+// memory, used to pass activations between pipeline stages on one node.
+// Both ends open the queue by name, the first one creates the segment.
+// Segments of dead ends or other sizes left under the name are replaced.
+class SHMQueue {
+ public:
+  static const int MAX_TENSORS = 16;
+  static const int MAX_DIMS = 8;
+  SHMQueue(std::string name, long num_slots, long slot_size);
+  ~SHMQueue();
+  void send(std::vector<at::Tensor> tensors);
+  std::vector<at::Tensor> recv();
+
+ private:
+  // First page of the segment
+  struct QueueHeader {
+    int attached;
+    int owner_pid; // first end to attach
+  };
+  struct SlotHeader {
+    int full;
+    int num_tensors;
+    int dtype[MAX_TENSORS];
+    int dim[MAX_TENSORS];
+    long sizes[MAX_TENSORS][MAX_DIMS];
+    long offset[MAX_TENSORS];
+  };
+  SlotHeader* slot_header(long i);
+  char* slot_data(long i);
+
+  long num_slots;
+  long slot_size;
+  long slot_stride;
+  int shmid;
+  void* shm_data;
+  long send_idx = 0;
+  long recv_idx = 0;
+};
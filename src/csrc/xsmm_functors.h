@@ -23,6 +23,7 @@
 #include <pytorch_extension_wrapper.h>
 #endif
 #include <float8.h>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #ifdef _OPENMP
@@ -102,6 +103,10 @@ template <>
 inline libxsmm_datatype XsmmDtype<uint8_t>() {
   return LIBXSMM_DATATYPE_I8;
 }
+template <>
+inline libxsmm_datatype XsmmDtype<int8_t>() {
+  return LIBXSMM_DATATYPE_I8;
+}
 #ifdef PYTORCH_SUPPORTS_FLOAT8
 template <>
 inline libxsmm_datatype XsmmDtype<bfloat8>() {
@@ -386,6 +391,8 @@ class BaseTPP {
     if (hash == "")
       hash = hash_str();
     auto t1 = __rdtsc();
+    // Blocks may run concurrently on separate thread teams
+    std::lock_guard<std::recursive_mutex> guard(get_kernel_cache_mutex());
     auto search = kernel_cache.find(hash);
     if (search != kernel_cache.end())
       kernel = search->second;
@@ -430,6 +437,10 @@ class BaseTPP {
     return kernel_cache;
   }
 #endif
+  std::recursive_mutex& get_kernel_cache_mutex() {
+    static std::recursive_mutex kernel_cache_mutex;
+    return kernel_cache_mutex;
+  }
   virtual std::string hash_str() = 0;
   virtual void* build_kernel() = 0;
   std::string hash = "";
@@ -1484,6 +1495,38 @@ class ScaleTPP {
   BinaryTPP kernel;
 };
 
+template <typename T>
+class AbsMaxTPP {
+ public:
+  AbsMaxTPP() {}
+  AbsMaxTPP(int N)
+      : N(N),
+        kernel(
+            1,
+            N,
+            N,
+            N,
+            XsmmDtype<T>(),
+            LIBXSMM_DATATYPE_F32,
+            LIBXSMM_DATATYPE_F32,
+            LIBXSMM_MELTW_FLAG_UNARY_REDUCE_ROWS,
+            LIBXSMM_MELTW_TYPE_UNARY_REDUCE_X_OP_ABSMAX) {}
+  void operator()(T* in, float* max) {
+    kernel((void*)in, (void*)max);
+  }
+  void ref(T* in, float* max) {
+    float lmax = 0.0f;
+    for (int i = 0; i < N; i++) {
+      lmax = std::max(lmax, std::abs((float)in[i]));
+    }
+    *max = lmax;
+  }
+
+ private:
+  int N = 0;
+  UnaryTPP kernel;
+};
+
 template <typename T, typename TN = float>
 class Norm2TPP {
  public:
@@ -0,0 +1,154 @@
+###############################################################################
+# Copyright (c) 2022 Intel Corporation - All rights reserved.                 #
+#                                                                             #
+# For information on the license, see the LICENSE file.                       #
+# Further information: https://github.com/libxsmm/tpp-pytorch-extension/      #
+# SPDX-License-Identifier: BSD-3-Clause                                       #
+###############################################################################
+# Author: Dhiraj Kalamkar (Intel Corp.)                                       #
+###############################################################################
+
+import inspect
+import queue
+import threading
+from concurrent.futures import Future
+
+import torch
+from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
+from .llm_common import kv_window_enabled
+
+
+class _Request:
+    def __init__(self, input_ids, attention_mask, max_new_tokens):
+        self.input_ids = input_ids
+        self.attention_mask = attention_mask
+        self.max_new_tokens = max_new_tokens
+        self.future = Future()
+        self.past = None
+        self.tokens = []
+
+
+class DisaggregatedGenerator:
+    """Greedy generation with prefill and decode running concurrently on
+    disjoint core partitions of one process.
+
+    A prefill thread and a decode thread each pin their own OpenMP team with
+    set_thread_team(). Finished prefills hand their KV cache to the decode
+    thread as is, without a copy, and the decode thread steps all active
+    requests round robin. Prefill keeps using the weight reuse loop scheme
+    and blocking (GEMM_LOOP_SCHEME_REUSE, NCB_BLOCK_SIZE) and decode the
+    streaming one, now without competing for the same cores.
+
+    Both threads run the same blocks, so state the blocks keep across calls
+    must not exist: tensor parallel runs (the collectives and SHM buffer are
+    shared), KV window eviction and dynamic RoPE are refused.
+    """
+
+    def __init__(self, model, prefill_cores, decode_cores, eos_token_id=None):
+        assert (
+            fused_llm_cpp.get_pg_size() == 1
+        ), "DisaggregatedGenerator does not support tensor parallel runs"
+        if kv_window_enabled():
+            raise NotImplementedError(
+                "DisaggregatedGenerator does not support KV_WINDOW_SIZE"
+            )
+        rope_scaling = getattr(model.config, "rope_scaling", None) or {}
+        rope_type = rope_scaling.get("rope_type", rope_scaling.get("type"))
+        if rope_type == "dynamic":
+            raise NotImplementedError(
+                "DisaggregatedGenerator does not support dynamic RoPE"
+            )
+        self.model = model
+        self.eos_token_id = eos_token_id
+        params = inspect.signature(model.forward).parameters
+        self.use_position_ids = "position_ids" in params
+        self.prefill_q = queue.Queue()
+        self.decode_q = queue.Queue()
+        self.prefill_thread = threading.Thread(
+            target=self._prefill_loop, args=(list(prefill_cores),), daemon=True
+        )
+        self.decode_thread = threading.Thread(
+            target=self._decode_loop, args=(list(decode_cores),), daemon=True
+        )
+        self.prefill_thread.start()
+        self.decode_thread.start()
+
+    def submit(self, input_ids, attention_mask=None, max_new_tokens=32):
+        """Queues a request, the returned future resolves to the generated
+        token ids of shape [batch, new_tokens]."""
+        if attention_mask is None:
+            attention_mask = torch.ones_like(input_ids)
+        req = _Request(input_ids, attention_mask, max_new_tokens)
+        self.prefill_q.put(req)
+        return req.future
+
+    def shutdown(self):
+        # Requests already submitted are completed first
+        self.prefill_q.put(None)
+        self.prefill_thread.join()
+        self.decode_thread.join()
+
+    def _step(self, req, input_ids):
+        kwargs = {}
+        if self.use_position_ids:
+            position_ids = req.attention_mask.long().cumsum(-1) - 1
+            position_ids.clamp_(min=0)
+            kwargs["position_ids"] = position_ids[:, -input_ids.shape[1] :]
+        out = self.model(
+            input_ids=input_ids,
+            attention_mask=req.attention_mask,
+            past_key_values=req.past,
+            use_cache=True,
+            **kwargs,
+        )
+        req.past = out.past_key_values
+        next_token = out.logits[:, -1, :].argmax(-1, keepdim=True)
+        req.tokens.append(next_token)
+        req.attention_mask = torch.cat(
+            [req.attention_mask, req.attention_mask.new_ones(next_token.shape)], -1
+        )
+        done = len(req.tokens) >= req.max_new_tokens
+        if self.eos_token_id is not None:
+            done = done or bool((next_token == self.eos_token_id).all())
+        if done:
+            req.past = None
+            req.future.set_result(torch.cat(req.tokens, -1))
+        return done
+
+    def _prefill_loop(self, cores):
+        fused_llm_cpp.set_thread_team(cores)
+        with torch.no_grad():
+            while True:
+                req = self.prefill_q.get()
+                if req is None:
+                    self.decode_q.put(None)
+                    return
+                try:
+                    if not self._step(req, req.input_ids):
+                        self.decode_q.put(req)
+                except Exception as e:
+                    req.future.set_exception(e)
+
+    def _decode_loop(self, cores):
+        fused_llm_cpp.set_thread_team(cores)
+        active = []
+        stop = False
+        with torch.no_grad():
+            while not stop or active:
+                # Only block for new work when idle
+                try:
+                    while True:
+                        req = self.decode_q.get(block=not active and not stop)
+                        if req is None:
+                            stop = True
+                        else:
+                            active.append(req)
+                except queue.Empty:
+                    pass
+                for req in list(active):
+                    try:
+                        if self._step(req, req.tokens[-1]):
+                            active.remove(req)
+                    except Exception as e:
+                        active.remove(req)
+                        req.future.set_exception(e)
@@ -0,0 +1,223 @@
+###############################################################################
+# Copyright (c) 2022 Intel Corporation - All rights reserved.                 #
+#                                                                             #
+# For information on the license, see the LICENSE file.                       #
+# Further information: https://github.com/libxsmm/tpp-pytorch-extension/      #
+# SPDX-License-Identifier: BSD-3-Clause                                       #
+###############################################################################
+# Author: Dhiraj Kalamkar (Intel Corp.)                                       #
+###############################################################################
+
+import torch
+from tpp_pytorch_extension.utils.blocked_layout import (
+    BlockedModule,
+    BlockedTensor,
+    get_blocking_signature,
+)
+from typing import Optional, Tuple
+import transformers
+
+from .llm_common import (
+    FixLinear,
+    ShardLinear,
+    get_rank,
+    get_size,
+    set_pg,
+    _reorder_cache,
+    block,
+    global_layer_dtype,
+    get_layer_past_and_offset,
+)
+
+# Decoder layers with (self_attn, encoder_attn, fc1, fc2) and a layer norm
+# for each, mapped to whether they normalize before each sublayer
+ENC_DEC_DECODER_LAYERS = {
+    transformers.models.bart.modeling_bart.BartDecoderLayer: False,
+    transformers.models.mbart.modeling_mbart.MBartDecoderLayer: True,
+    transformers.models.whisper.modeling_whisper.WhisperDecoderLayer: True,
+}
+
+
+class CrossAttnDecoderLayer(BlockedModule):
+    def forward(
+        self,
+        hidden_states: torch.Tensor,
+        attention_mask: Optional[torch.Tensor] = None,
+        encoder_hidden_states: Optional[torch.Tensor] = None,
+        encoder_attention_mask: Optional[torch.Tensor] = None,
+        layer_head_mask: Optional[torch.Tensor] = None,
+        cross_attn_layer_head_mask: Optional[torch.Tensor] = None,
+        past_key_value: Optional[Tuple[torch.Tensor]] = None,
+        output_attentions: Optional[bool] = False,
+        use_cache: Optional[bool] = True,
+    ):
+        if not hasattr(self, "cpp_block"):
+            raise
+        orig_hidden_states = hidden_states
+        hidden_states = self.get_blocked_tensor(
+            hidden_states,
+            self.blocked_input_signature,
+            [None, None, self.features_block_size],
+        )
+        inputs = [hidden_states]
+        dummy_tensor = torch.Tensor().to(self.layer_dtype)
+
+        def add_tensor_or_empty(t):
+            inputs.append(t.contiguous() if t is not None else dummy_tensor)
+
+        # Cross attention K/V are the last two entries of the layer cache
+        cross_key_value = []
+        if past_key_value is not None:
+            cross_key_value = list(past_key_value[-2:])
+            past_key_value = past_key_value[:-2]
+        past_key_value, offset = get_layer_past_and_offset(past_key_value, True)
+
+        add_tensor_or_empty(attention_mask)
+        if len(cross_key_value) > 0:
+            encoder_hidden_states = None
+        add_tensor_or_empty(encoder_hidden_states)
+        if encoder_attention_mask is not None:
+            if encoder_attention_mask.dim() == 4:
+                # Padding only, the same for every query
+                encoder_attention_mask = encoder_attention_mask[:, :, -1:, :]
+            else:
+                encoder_attention_mask = (
+                    1.0 - encoder_attention_mask[:, None, None, :].to(torch.float)
+                ) * -10000.0
+        add_tensor_or_empty(encoder_attention_mask)
+        inputs = [
+            i.to(self.layer_dtype) if i.is_floating_point() else i for i in inputs
+        ]
+
+        past_key_value = [
+            i.to(self.layer_dtype) if i.is_floating_point() else i
+            for i in list(past_key_value) + cross_key_value
+        ]
+
+        outputs = self.cpp_block.forward(inputs, past_key_value, use_cache)
+        hs = outputs[0]
+        present = tuple(outputs[1:])
+
+        hs = BlockedTensor(hs, self.blocked_input_signature, orig_hidden_states.dtype)
+
+        if use_cache:
+            outputs = (hs, present)
+        else:
+            outputs = (hs,)
+
+        return outputs
+
+
+def FixCrossAttnDecoderLayer(
+    self,
+    bk=None,
+    bc=None,
+    layer_dtype=global_layer_dtype,
+    weight_dtype=global_layer_dtype,
+    activation="gelu",
+):
+    if type(self) not in ENC_DEC_DECODER_LAYERS:
+        return
+    if activation not in ("gelu", "relu"):
+        raise NotImplementedError(f"Unsupported activation {activation}")
+    do_layer_norm_before = ENC_DEC_DECODER_LAYERS[type(self)]
+    self.__class__ = CrossAttnDecoderLayer
+    self.features_block_size = bc
+    self.layer_dtype = layer_dtype
+    rank = get_rank()
+    wsize = get_size()
+    if wsize > 1:
+        for attn in [self.self_attn, self.encoder_attn]:
+            ShardLinear(attn.q_proj, 0, rank, wsize, attn.head_dim)
+            ShardLinear(attn.k_proj, 0, rank, wsize, attn.head_dim)
+            ShardLinear(attn.v_proj, 0, rank, wsize, attn.head_dim)
+            ShardLinear(attn.out_proj, 1, rank, wsize, attn.head_dim)
+        ShardLinear(self.fc1, 0, rank, wsize, 64)
+        ShardLinear(self.fc2, 1, rank, wsize, 64)
+        self.model_parallel = True
+    else:
+        self.model_parallel = False
+    for m in self.modules():
+        for name in m._parameters.keys():
+            if m._parameters[name] is None or not m._parameters[name].is_meta:
+                continue
+            param_cls = type(m._parameters[name])
+            kwargs = m._parameters[name].__dict__
+            m._parameters[name] = param_cls(
+                torch.empty_like(m._parameters[name], device="cpu"), **kwargs
+            )
+
+        if isinstance(m, torch.nn.Linear):
+            FixLinear(m, bk, bc, layer_dtype, weight_dtype=weight_dtype)
+    block(self)
+    if not hasattr(self, "cpp_block"):
+
+        def bias_or_empty(lin):
+            return lin.bias if lin.bias is not None else torch.Tensor()
+
+        params = [
+            self.self_attn_layer_norm.weight,
+            self.self_attn_layer_norm.bias,
+            self.encoder_attn_layer_norm.weight,
+            self.encoder_attn_layer_norm.bias,
+            self.final_layer_norm.weight,
+            self.final_layer_norm.bias,
+        ]
+        for attn in [self.self_attn, self.encoder_attn]:
+            for lin in [attn.q_proj, attn.k_proj, attn.v_proj, attn.out_proj]:
+                params += [lin.weight, bias_or_empty(lin)]
+        params += [self.fc1.weight, bias_or_empty(self.fc1)]
+        params += [self.fc2.weight, bias_or_empty(self.fc2)]
+
+        self.cpp_block = torch.classes.tpp_llm.CrossAttnDecoderLayer(
+            params,
+            self.final_layer_norm.eps,
+            self.self_attn.head_dim,
+            do_layer_norm_before,
+            activation,
+        )
+        self.blocked_input_signature = get_blocking_signature("BSF", "BSF")
+
+
+def _reorder_cache_enc_dec(
+    past: Tuple[Tuple[torch.Tensor]], beam_idx: torch.Tensor
+) -> Tuple[Tuple[torch.Tensor]]:
+    # Beams of a sequence share the encoder output, so only the self
+    # attention part of the cache needs reordering
+    self_past = _reorder_cache(
+        tuple(tuple(layer_past[:-2]) for layer_past in past), beam_idx
+    )
+    return tuple(
+        tuple(sp) + tuple(layer_past[-2:]) for sp, layer_past in zip(self_past, past)
+    )
+
+
+def OptimizeModelForEncDec(model, dtype, device="cpu", weight_dtype=None):
+    set_pg()
+
+    if weight_dtype is None:
+        weight_dtype = dtype
+    for m in model.modules():
+        if type(m) in ENC_DEC_DECODER_LAYERS:
+            FixCrossAttnDecoderLayer(
+                m,
+                16,
+                64,
+                dtype,
+                weight_dtype=weight_dtype,
+                activation=getattr(model.config, "activation_function", "gelu"),
+            )
+    for m in model.modules():
+        if isinstance(m, torch.nn.Linear) and not isinstance(m, BlockedModule):
+            FixLinear(m, 16, 64, dtype, parallel_dim=None)
+            block(m)
+    for m in model.modules():
+        for name in m._parameters.keys():
+            if m._parameters[name] is None or not m._parameters[name].is_meta:
+                continue
+            param_cls = type(m._parameters[name])
+            kwargs = m._parameters[name].__dict__
+            m._parameters[name] = param_cls(
+                torch.empty_like(m._parameters[name], device=device), **kwargs
+            )
+    model._reorder_cache = _reorder_cache_enc_dec
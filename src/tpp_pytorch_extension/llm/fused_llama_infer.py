@@ -9,6 +9,7 @@
 ###############################################################################
 
 import math
+import os
 import torch
 from torch import nn
 from torch.nn import CrossEntropyLoss
@@ -41,6 +42,8 @@ from .llm_common import (
     compare,
     global_layer_dtype,
     get_layer_past_and_offset,
+    kv_window_enabled,
+    implicit_attn_mask_enabled,
 )
 
 
@@ -113,6 +116,9 @@ class LlamaDecoderLayer(BlockedModule):
             )
 
         add_tensor_or_empty(position_ids)
+        lora_adapter_ids = getattr(self, "lora_adapter_ids", None)
+        if lora_adapter_ids is not None:
+            inputs.append(lora_adapter_ids)
         inputs = [
             i.to(self.layer_dtype) if i.is_floating_point() else i for i in inputs
         ]
@@ -226,7 +232,17 @@ def FixLlamaDecoderLayer(
             self.mlp.down_proj.weight,
         ]  # since bias is False
 
-        if hasattr(self.self_attn, "rotary_emb"):
+        config = getattr(self.self_attn, "config", None)
+        rope_scaling = getattr(config, "rope_scaling", None) or {}
+        rope_type = rope_scaling.get("rope_type", rope_scaling.get("type", None))
+        rope_otf = int(os.environ.get("ROPE_ON_THE_FLY", "0")) > 0 or rope_type in (
+            "dynamic",
+            "yarn",
+        )
+        if rope_otf:
+            # Sin/cos computed by the kernel, no embed_positions table
+            embed_positions = torch.empty([0])
+        elif hasattr(self.self_attn, "rotary_emb"):
             position_ids = torch.arange(
                 self.self_attn.max_position_embeddings
             ).unsqueeze(0)
@@ -253,6 +269,26 @@ def FixLlamaDecoderLayer(
             self.self_attn.max_position_embeddings,
             self.self_attn.head_dim,
         )
+        if rope_otf:
+            if rope_type is None:
+                rope_type = "default"
+            elif rope_type not in ("default", "linear", "dynamic", "yarn"):
+                raise NotImplementedError(
+                    f"rope_type {rope_type} is not supported with ROPE_ON_THE_FLY"
+                )
+            if rope_type == "dynamic" and kv_window_enabled():
+                raise NotImplementedError(
+                    "Dynamic rope scaling is not supported with KV_WINDOW_SIZE"
+                )
+            max_pos = getattr(config, "max_position_embeddings", 2048)
+            self.cpp_block.set_rope_scaling(
+                rope_type,
+                float(getattr(config, "rope_theta", 10000.0)),
+                float(rope_scaling.get("factor", 1.0)),
+                rope_scaling.get("original_max_position_embeddings", max_pos),
+                float(rope_scaling.get("beta_fast", 32.0)),
+                float(rope_scaling.get("beta_slow", 1.0)),
+            )
         self.blocked_input_signature = get_blocking_signature("BSF", "BSF")
 
 
@@ -321,6 +357,12 @@ def LlamaModel_forward(
             # past_key_values = DynamicCache.from_legacy_cache(past_key_values)
             if past_key_values is not None:
                 past_seen_tokens = past_key_values[0][0].shape[-2]
+                if kv_window_enabled() and attention_mask is not None:
+                    # Cache may have evicted tokens, positions and mask must
+                    # still cover the full sequence
+                    past_seen_tokens = (
+                        attention_mask.shape[-1] - inputs_embeds.shape[1]
+                    )
             else:
                 past_seen_tokens = 0
 
@@ -338,9 +380,17 @@ def LlamaModel_forward(
     if position_ids is None:
         position_ids = cache_position.unsqueeze(0)
 
-    causal_mask = self._update_causal_mask(
-        attention_mask, inputs_embeds, cache_position, past_seen_tokens
-    )
+    if (
+        implicit_attn_mask_enabled()
+        and attention_mask is not None
+        and attention_mask.dim() == 2
+    ):
+        # Fused blocks build causal and left padding masks from valid lengths
+        causal_mask = attention_mask.sum(-1)
+    else:
+        causal_mask = self._update_causal_mask(
+            attention_mask, inputs_embeds, cache_position, past_seen_tokens
+        )
 
     # embed positions
     hidden_states = inputs_embeds
@@ -26,6 +26,9 @@ import numpy as np
 import os
 import time
 import inspect
+import struct
+import hashlib
+from collections import OrderedDict
 from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
 
 from transformers.modeling_outputs import CausalLMOutputWithPast
@@ -525,9 +528,45 @@ def all_reduce(t):
         torch.distributed.all_reduce(t)
 
 
+_node_pgs = None
+
+
 def set_pg():
+    global _node_pgs
     if torch.distributed.is_available() and torch.distributed.is_initialized():
         fused_llm_cpp.set_pg(torch.distributed.distributed_c10d._get_default_group())
+        # Multi-node runs (MPI_LOCALNRANKS ranks per node, e.g. two emulated
+        # nodes on one machine with gloo) use a two level allreduce
+        world = get_size()
+        local_size = int(os.environ.get("MPI_LOCALNRANKS", "0"))
+        if not (1 < local_size < world and world % local_size == 0):
+            return
+        if _node_pgs is None:
+            rank = get_rank()
+            # new_group() has to be called by all ranks for all groups
+            for n in range(world // local_size):
+                pg = torch.distributed.new_group(
+                    list(range(n * local_size, (n + 1) * local_size))
+                )
+                if rank // local_size == n:
+                    local_pg = pg
+            for l in range(local_size):
+                pg = torch.distributed.new_group(list(range(l, world, local_size)))
+                if rank % local_size == l:
+                    cross_pg = pg
+            _node_pgs = (local_pg, cross_pg)
+        fused_llm_cpp.set_node_pgs(*_node_pgs)
+
+
+def kv_window_enabled():
+    # Sink + recent window KV eviction is done by the C++ blocks
+    return int(os.environ.get("KV_WINDOW_SIZE", "0")) > 0
+
+
+def implicit_attn_mask_enabled():
+    # Pass per sequence valid lengths instead of float masks, assumes left
+    # padding
+    return int(os.environ.get("IMPLICIT_ATTN_MASK", "0")) > 0
 
 
 def get_layer_past_and_offset(
@@ -606,6 +645,259 @@ def get_layer_past_and_offset(
         return (layer_past, layer_past[3])
 
 
+def _kv_cache_evicted(layer_past):
+    # Tokens dropped by KV window eviction, stored after the key/value
+    # buffers of an indirect kv_cache tuple
+    if len(layer_past) > 6:
+        return layer_past[6]
+    return torch.tensor(0)
+
+
+def _kv_cache_rows(past: Tuple[Tuple[torch.Tensor]]):
+    """Returns per layer (offset, key, value, beam_idx, evicted) holding only
+    the used rows of an indirect kv_cache"""
+    rows = []
+    B_DIM = BATCH_DIM_IN_KV_CACHE
+    for layer_past in past:
+        assert len(layer_past) >= 6, "Only indirect kv_cache is supported"
+        S = int(layer_past[3])
+        if B_DIM == 1:
+            key = layer_past[4][:S]
+            value = layer_past[5][:S]
+        else:
+            key = layer_past[4][:, :, :S]
+            value = layer_past[5][:, :, :S]
+        evicted = int(_kv_cache_evicted(layer_past))
+        rows.append((S, key, value, layer_past[2][:S], evicted))
+    return rows
+
+
+def _kv_cache_from_rows(rows, drop=0):
+    """Builds indirect kv_cache tuples with room to grow from saved rows,
+    leaving out the last drop rows"""
+    inc_size = int(os.environ.get("KV_CACHE_INC_SIZE", "128"))
+    B_DIM = BATCH_DIM_IN_KV_CACHE
+    past = []
+    for S, key, value, beam_idx, evicted in rows:
+        S -= drop
+        if B_DIM == 1:
+            key, value = key[:S], value[:S]
+        else:
+            key, value = key[:, :, :S], value[:, :, :S]
+        beam_idx = beam_idx[:S]
+        capacity = S + inc_size
+        B2 = beam_idx.shape[1]
+        new_beam_idx = torch.arange(B2).unsqueeze(0).expand([capacity, B2]).contiguous()
+        new_beam_idx[:S] = beam_idx
+        if B_DIM == 1:
+            new_key = key.new_zeros([capacity] + list(key.shape[1:]))
+            new_value = value.new_zeros([capacity] + list(value.shape[1:]))
+            new_key[:S] = key
+            new_value[:S] = value
+            key = new_key[:S].permute([1, 2, 0, 3])
+            value = new_value[:S].permute([1, 2, 0, 3])
+        else:
+            B, N, _, H = key.shape
+            new_key = key.new_zeros([B, N, capacity, H])
+            new_value = value.new_zeros([B, N, capacity, H])
+            new_key[:, :, :S] = key
+            new_value[:, :, :S] = value
+            key = new_key[:, :, :S]
+            value = new_value[:, :, :S]
+        past.append(
+            (
+                key,
+                value,
+                new_beam_idx,
+                torch.tensor(S),
+                new_key,
+                new_value,
+                torch.tensor(evicted),
+            )
+        )
+    return tuple(past)
+
+
+KV_SNAPSHOT_MAGIC = b"TPPKVC02"
+
+
+def _write_tensor(f, t):
+    t = t.contiguous()
+    dt = str(t.dtype).split(".")[-1].encode()
+    f.write(struct.pack("<q", len(dt)) + dt)
+    f.write(struct.pack("<q", t.dim()) + struct.pack(f"<{t.dim()}q", *t.shape))
+    f.write(t.view(-1).view(torch.uint8).numpy().tobytes())
+
+
+def _read_tensor(f):
+    (n,) = struct.unpack("<q", f.read(8))
+    dt = getattr(torch, f.read(n).decode())
+    (ndim,) = struct.unpack("<q", f.read(8))
+    shape = struct.unpack(f"<{ndim}q", f.read(8 * ndim))
+    t = torch.empty(shape, dtype=dt)
+    nbytes = t.numel() * t.element_size()
+    buf = bytearray(f.read(nbytes))
+    t.view(-1).view(torch.uint8).copy_(torch.frombuffer(buf, dtype=torch.uint8))
+    return t
+
+
+def save_kv_cache(past: Tuple[Tuple[torch.Tensor]], path: str):
+    """Saves the used part of an indirect kv_cache to a binary file"""
+    rows = _kv_cache_rows(past)
+    with open(path, "wb") as f:
+        f.write(KV_SNAPSHOT_MAGIC)
+        f.write(struct.pack("<qq", len(rows), BATCH_DIM_IN_KV_CACHE))
+        for S, key, value, beam_idx, evicted in rows:
+            f.write(struct.pack("<qq", S, evicted))
+            _write_tensor(f, key)
+            _write_tensor(f, value)
+            _write_tensor(f, beam_idx)
+
+
+def load_kv_cache(path: str):
+    """Loads a kv_cache saved with save_kv_cache(), the result can be passed
+    as past_key_values to only process tokens following the saved ones"""
+    rows = []
+    with open(path, "rb") as f:
+        assert f.read(8) == KV_SNAPSHOT_MAGIC, f"{path} is not a kv_cache file"
+        n_layers, b_dim = struct.unpack("<qq", f.read(16))
+        assert b_dim == BATCH_DIM_IN_KV_CACHE, "kv_cache layout mismatch"
+        for _ in range(n_layers):
+            S, evicted = struct.unpack("<qq", f.read(16))
+            key, value, beam_idx = _read_tensor(f), _read_tensor(f), _read_tensor(f)
+            rows.append((S, key, value, beam_idx, evicted))
+    return _kv_cache_from_rows(rows)
+
+
+class PrefixKVCache:
+    """In-memory LRU of kv_cache snapshots keyed by a hash of the prompt
+    token ids, used to skip prefill of shared prompt prefixes"""
+
+    def __init__(self, max_entries=8):
+        # Continuing a prefill on an evicting cache isn't supported
+        if kv_window_enabled():
+            raise NotImplementedError("PrefixKVCache does not support KV_WINDOW_SIZE")
+        self.max_entries = max_entries
+        self.entries = OrderedDict()
+
+    @staticmethod
+    def token_hash(input_ids):
+        ids = input_ids.to(torch.int64).contiguous().numpy()
+        return hashlib.sha1(ids.tobytes()).hexdigest()
+
+    def put(self, input_ids, past: Tuple[Tuple[torch.Tensor]]):
+        """Stores the kv_cache computed for input_ids [B, S]"""
+        key = self.token_hash(input_ids)
+        rows = [
+            (S, k.clone(), v.clone(), b.clone(), e)
+            for S, k, v, b, e in _kv_cache_rows(past)
+        ]
+        self.entries[key] = (input_ids.shape[-1], rows)
+        self.entries.move_to_end(key)
+        while len(self.entries) > self.max_entries:
+            self.entries.popitem(last=False)
+
+    def lookup(self, input_ids):
+        """Returns (prefix_len, past_key_values) for the longest stored prefix
+        of input_ids, or (0, None). At least the last token is left to be
+        processed, an exact match is restored without its last token. The
+        returned cache is a private copy."""
+        L = input_ids.shape[-1]
+        lengths = sorted(
+            set(S for S, _ in self.entries.values() if S <= L), reverse=True
+        )
+        for S in lengths:
+            key = self.token_hash(input_ids[..., :S])
+            if key in self.entries:
+                drop = 1 if S == L else 0
+                if S - drop == 0:
+                    continue
+                self.entries.move_to_end(key)
+                _, rows = self.entries[key]
+                return S - drop, _kv_cache_from_rows(rows, drop)
+        return 0, None
+
+
+def share_model_weights(model, tag, checkpoint):
+    """Moves the prepared decoder layer weights into host wide shared memory
+    segments named by tag. The first process fills them, later processes
+    using the same tag map them read-only and free their own copies, so they
+    can be built with uninitialized (e.g. meta) weights. checkpoint names the
+    weights (e.g. model path and revision), a left over segment of the same
+    tag holding another checkpoint is replaced once its creator is gone.
+    Returns True if this process created the segments or kept private
+    weights because the segments belong to another user.
+
+    In processes that didn't create them the parameters of the decoder layers
+    alias the read-only mapping, any in-place update of them (load_state_dict,
+    copy_, ...) faults."""
+    created = True
+    for name, m in model.named_modules():
+        if hasattr(m, "cpp_block"):
+            created = (
+                m.cpp_block.share_weights(f"{tag}:{name}", checkpoint) and created
+            )
+    return created
+
+
+# Decoder layer projections that can carry LoRA adapters
+LORA_TARGETS = {
+    "q": "self_attn.q_proj",
+    "k": "self_attn.k_proj",
+    "v": "self_attn.v_proj",
+    "o": "self_attn.o_proj",
+    "gate": "mlp.gate_proj",
+    "up": "mlp.up_proj",
+    "down": "mlp.down_proj",
+}
+
+
+def load_lora_adapters(model, adapters):
+    """Loads LoRA adapters into the fused decoder layers, one copy of the base
+    weights then serves all of them.
+
+    adapters is a list indexed by adapter id, each entry maps a module name
+    (e.g. model.layers.0.self_attn.q_proj) to (lora_A [r, C], lora_B [K, r],
+    scaling). Ranks are zero padded to a common value per projection.
+    """
+    assert get_size() == 1, "LoRA adapters are not supported with tensor parallel"
+    nA = len(adapters)
+    for name, m in model.named_modules():
+        if not hasattr(m, "cpp_block"):
+            continue
+        for target, path in LORA_TARGETS.items():
+            entries = [a.get(name + "." + path) for a in adapters]
+            present = [e for e in entries if e is not None]
+            if len(present) == 0:
+                continue
+            C = present[0][0].shape[1]
+            K = present[0][1].shape[0]
+            r = max(e[0].shape[0] for e in present)
+            r = (r + 3) // 4 * 4  # multiple of the VNNI block size
+            A = torch.zeros([nA, C, r])
+            B = torch.zeros([nA, r, K])
+            scale = torch.zeros([nA])
+            for i, e in enumerate(entries):
+                if e is None:
+                    continue
+                lora_A, lora_B, scaling = e
+                ri = lora_A.shape[0]
+                A[i, :, :ri] = lora_A.t()
+                B[i, :ri, :] = lora_B.t()
+                scale[i] = scaling
+            m.cpp_block.set_lora(
+                target, A.to(m.layer_dtype), B.to(m.layer_dtype), scale
+            )
+
+
+def set_lora_adapter_ids(model, adapter_ids):
+    """Selects the adapter per request ([B]) or per token ([B, S]), -1 runs
+    the base model only and None disables adapters."""
+    for m in model.modules():
+        if hasattr(m, "cpp_block"):
+            m.lora_adapter_ids = adapter_ids
+
+
 def _reorder_cache(
     past: Tuple[Tuple[torch.Tensor]], beam_idx: torch.Tensor
 ) -> Tuple[Tuple[torch.Tensor]]:
@@ -665,6 +957,7 @@ def _reorder_cache(
                         layer_past[3],
                         layer_past_4,
                         layer_past_5,
+                        _kv_cache_evicted(layer_past),
                         remapped_ind,
                     )
                 )
@@ -676,11 +969,8 @@ def _reorder_cache(
             remapped_ind = fused_llm_cpp.remap_indices(past[0][2], past[0][3])
             new_past = []
             for layer_past in past:
-                l_layer_past = list(layer_past)
-                if len(layer_past) == 6:
-                    l_layer_past.append(remapped_ind)
-                else:
-                    l_layer_past[6] = remapped_ind
+                l_layer_past = list(layer_past[:6])
+                l_layer_past += [_kv_cache_evicted(layer_past), remapped_ind]
                 new_past.append(tuple(l_layer_past))
             past = tuple(new_past)
             return past
@@ -0,0 +1,119 @@
+###############################################################################
+# Copyright (c) 2022 Intel Corporation - All rights reserved.                 #
+#                                                                             #
+# For information on the license, see the LICENSE file.                       #
+# Further information: https://github.com/libxsmm/tpp-pytorch-extension/      #
+# SPDX-License-Identifier: BSD-3-Clause                                       #
+###############################################################################
+# Author: Dhiraj Kalamkar (Intel Corp.)                                       #
+###############################################################################
+
+import torch
+from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
+
+from .llm_common import get_layer_past_and_offset
+
+
+def get_cpp_layers(model):
+    return [m for m in model.modules() if hasattr(m, "cpp_block")]
+
+
+class PipelineStage:
+    """One stage of a layer pipeline split across processes of one node,
+    typically one process per socket, each optimized without
+    torch.distributed so that no layer is sharded.
+
+    Stage s runs its contiguous slice of decoder layers on micro-batches
+    received from stage s - 1 and passes the results on to stage s + 1
+    through shared memory queues. A micro-batch is the input list of the
+    C++ blocks, i.e. [hidden_states, attention_mask, position_ids, ...].
+    KV caches stay with the stage owning the layer, one per micro-batch.
+    The last stage can hand values (e.g. next tokens) back to the first
+    one with send_back() / recv_back() to close the generation loop.
+    Beam search cache reordering is not supported.
+    """
+
+    def __init__(
+        self,
+        model,
+        stage,
+        num_stages,
+        name="tpp_pp",
+        num_slots=4,
+        slot_size=256 * 1024 * 1024,
+        layer_split=None,
+    ):
+        layers = get_cpp_layers(model)
+        n = len(layers)
+        if layer_split is None:
+            layer_split = [n * i // num_stages for i in range(num_stages + 1)]
+        assert len(layer_split) == num_stages + 1
+        start, end = layer_split[stage], layer_split[stage + 1]
+        self.stage = stage
+        self.num_stages = num_stages
+        self.blocks = [l.cpp_block for l in layers[start:end]]
+        self.layer_dtype = layers[start].layer_dtype
+        # Release weights of the layers owned by other stages so this
+        # process only keeps its own layers in local memory
+        for l in layers[:start] + layers[end:]:
+            del l.cpp_block
+            for p in l.parameters():
+                p.data = torch.empty(0, dtype=p.dtype)
+
+        def queue(src, dst):
+            return fused_llm_cpp.SHMQueue(f"{name}.{src}.{dst}", num_slots, slot_size)
+
+        self.recv_q = queue(stage - 1, stage) if stage > 0 else None
+        last = num_stages - 1
+        self.send_q = queue(stage, stage + 1) if stage < last else None
+        self.back_q = None
+        if num_stages > 1 and (stage == 0 or stage == last):
+            self.back_q = queue(last, 0)
+        self.reset()
+
+    def reset(self):
+        # Drop KV caches of all micro-batches, call before a new batch
+        self.caches = {}
+
+    def _run_layers(self, mb, inputs):
+        caches = self.caches.setdefault(mb, [None] * len(self.blocks))
+        for i, blk in enumerate(self.blocks):
+            past, _ = get_layer_past_and_offset(caches[i], True)
+            outputs = blk.forward(inputs, list(past), True)
+            inputs = [outputs[0]] + inputs[1:]
+            caches[i] = tuple(outputs[1:])
+        return inputs
+
+    def step(self, micro_batches=None):
+        """Runs one forward step over all micro-batches. Stage 0 takes the
+        micro-batch inputs and streams them downstream without waiting, the
+        last stage returns the output hidden states in micro-batch order."""
+        outputs = []
+        mb = 0
+        num_mb = len(micro_batches) if self.stage == 0 else 1
+        while mb < num_mb:
+            if self.stage == 0:
+                inputs = [
+                    i.to(self.layer_dtype) if i.is_floating_point() else i
+                    for i in micro_batches[mb]
+                ]
+            else:
+                msg = self.recv_q.recv()
+                mb, num_mb = msg[0].tolist()
+                inputs = msg[1:]
+            inputs = self._run_layers(mb, inputs)
+            if self.send_q is not None:
+                self.send_q.send([torch.tensor([mb, num_mb])] + inputs)
+            else:
+                outputs.append(inputs[0])
+            mb += 1
+        return outputs
+
+    def send_back(self, tensors):
+        assert self.stage == self.num_stages - 1
+        if self.back_q is not None:
+            self.back_q.send(list(tensors))
+
+    def recv_back(self):
+        assert self.stage == 0
+        return self.back_q.recv()
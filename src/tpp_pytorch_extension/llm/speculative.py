@@ -0,0 +1,159 @@
+###############################################################################
+# Copyright (c) 2022 Intel Corporation - All rights reserved.                 #
+#                                                                             #
+# For information on the license, see the LICENSE file.                       #
+# Further information: https://github.com/libxsmm/tpp-pytorch-extension/      #
+# SPDX-License-Identifier: BSD-3-Clause                                       #
+###############################################################################
+# Author: Dhiraj Kalamkar (Intel Corp.)                                       #
+###############################################################################
+
+import torch
+from tpp_pytorch_extension._C import _fused_llm_infer as fused_llm_cpp
+
+from .llm_common import kv_window_enabled
+from .pipeline import get_cpp_layers
+
+
+def _final_norm(model):
+    for path in ["model.norm", "transformer.ln_f", "model.decoder.final_layer_norm"]:
+        m = model
+        for name in path.split("."):
+            m = getattr(m, name, None)
+        if m is not None:
+            return m
+    return torch.nn.Identity()
+
+
+class _Stack:
+    # Embedding and LM head of a model around its C++ block stack runner
+    def __init__(self, model, cores):
+        # Token embeddings only, e.g. OPT also adds learned positions
+        model_type = getattr(model.config, "model_type", None)
+        if model_type not in ("llama", "gptj"):
+            raise NotImplementedError(
+                f"speculative_generate does not support {model_type} models"
+            )
+        # Rollbacks can't undo frequencies rescaled by the sequence length
+        rope_scaling = getattr(model.config, "rope_scaling", None) or {}
+        rope_type = rope_scaling.get("rope_type", rope_scaling.get("type"))
+        if rope_type == "dynamic":
+            raise NotImplementedError(
+                "speculative_generate does not support dynamic RoPE"
+            )
+        layers = get_cpp_layers(model)
+        self.layer_dtype = layers[0].layer_dtype
+        self.runner = fused_llm_cpp.BlockStackRunner(
+            [l.cpp_block for l in layers], list(cores)
+        )
+        self.embed = model.get_input_embeddings()
+        self.norm = _final_norm(model)
+        self.head = model.get_output_embeddings()
+
+    def launch(self, ids):
+        pos = self.runner.length()
+        hs = self.embed(ids).to(self.layer_dtype)
+        pid = torch.arange(pos, pos + ids.shape[1]).unsqueeze(0)
+        # Empty mask, the blocks apply the causal mask themselves
+        am = torch.Tensor().to(self.layer_dtype)
+        self.runner.launch([hs, am, pid])
+
+    def wait(self):
+        hs = self.runner.wait()
+        return self.head(self.norm(hs)).argmax(-1)
+
+    def forward(self, ids):
+        self.launch(ids)
+        return self.wait()
+
+
+def _common_prefix(a, b):
+    n = 0
+    while n < len(a) and n < len(b) and a[n] == b[n]:
+        n += 1
+    return n
+
+
+def speculative_generate(
+    draft_model,
+    target_model,
+    input_ids,
+    draft_cores,
+    target_cores,
+    max_new_tokens=32,
+    num_draft=4,
+    eos_token_id=None,
+):
+    """Greedy speculative decoding (batch size 1) with the draft and target
+    block stacks each running on their own thread team. While the target
+    verifies the drafts of step t, the draft keeps going and speculates the
+    drafts of step t+1 assuming everything gets accepted; those are reused
+    when the guess holds and rolled back otherwise. The calling thread
+    runs the embeddings and LM heads and is pinned to the draft cores.
+    Output matches greedy decoding of the target model. Tensor parallel
+    runs, KV window eviction and dynamic RoPE are refused."""
+    assert input_ids.shape[0] == 1, "Only batch size 1 is supported"
+    # Both teams would share the process group and its SHM buffer
+    assert (
+        fused_llm_cpp.get_pg_size() == 1
+    ), "speculative_generate does not support tensor parallel runs"
+    # Rollbacks and position ids take the cache offset as the token count
+    if kv_window_enabled():
+        raise NotImplementedError(
+            "speculative_generate does not support KV_WINDOW_SIZE"
+        )
+    fused_llm_cpp.set_thread_team(list(draft_cores))
+    draft = _Stack(draft_model, draft_cores)
+    target = _Stack(target_model, target_cores)
+    prompt = input_ids[0].tolist()
+    k = num_draft
+
+    def tensor(tokens):
+        return torch.tensor([tokens], dtype=input_ids.dtype)
+
+    with torch.no_grad():
+        target.launch(input_ids)
+        dnext = draft.forward(input_ids)[0, -1].item()
+        dctx = list(prompt)
+        seq = prompt + [target.wait()[0, -1].item()]
+
+        while len(seq) - len(prompt) < max_new_tokens:
+            if seq[-1] == eos_token_id:
+                break
+            # Bring the draft cache to seq, keeping drafts made ahead of it
+            p = _common_prefix(dctx, seq)
+            if p < len(seq):
+                if p < len(dctx):
+                    draft.runner.rollback(p)
+                    dctx = dctx[:p]
+                dnext = draft.forward(tensor(seq[p:]))[0, -1].item()
+                dctx = list(seq)
+            drafts = dctx[len(seq) :][:k]
+            while len(drafts) < k:
+                drafts.append(dnext)
+                if len(drafts) < k:
+                    dnext = draft.forward(tensor([dnext]))[0, -1].item()
+                    dctx.append(drafts[-1])
+
+            # Verify step t on the target team ...
+            base = len(seq) - 1
+            target.launch(tensor([seq[-1]] + drafts))
+            # ... while drafting ahead for step t+1
+            if len(dctx) == len(seq) + k - 1:
+                ahead = [drafts[-1]]
+                while len(ahead) <= k and not target.runner.ready():
+                    dnext = draft.forward(tensor([ahead[-1]]))[0, -1].item()
+                    dctx.append(ahead[-1])
+                    ahead.append(dnext)
+            preds = target.wait()[0].tolist()
+
+            n = 0
+            while n < k and drafts[n] == preds[n]:
+                n += 1
+            seq += drafts[:n] + [preds[n]]
+            target.runner.rollback(base + n + 1)
+            if eos_token_id is not None and eos_token_id in seq[len(prompt) :]:
+                seq = seq[: seq.index(eos_token_id, len(prompt)) + 1]
+                break
+
+    return tensor(seq[len(prompt) :][:max_new_tokens])